@@ -0,0 +1,482 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Throughput and latency benchmark of the ENC28J60 datapath.
+ *
+ * Drives ENC28J60_EMAC against the simulated chip with synthetic traffic
+ * and reports frames/s, bytes/s, SPI transactions and bytes per frame
+ * and latency percentiles as a table, JSON or CSV. The times are host
+ * times of the driver thread and the model. The SPI time at BENCH_SPI_HZ
+ * estimates the bus time of a frame on the board.
+ */
+#include <stdlib.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "enc28j60_emac.h"
+#include "enc28j60_sim.h"
+#include "host_memory_manager.h"
+
+#define BENCH_FRAMES        20000U
+#define BENCH_SPI_HZ        20000000U
+#define BENCH_POOL_UNITS    1024U
+#define BENCH_INT_PIN       ((PinName)1)
+#define BENCH_SETTLE_MS     std::chrono::milliseconds(20)
+#define BENCH_TIME_OUT_MS   std::chrono::seconds(2)
+
+typedef std::chrono::steady_clock   bench_clock_t;
+
+/** Frame lengths without CRC, repeated in order */
+static const uint16_t   sizes_64[] = { 60 };
+static const uint16_t   sizes_mtu[] = { 1514 };
+
+/** Simple IMIX 7:4:1 of 64, 594 and 1518 byte frames */
+static const uint16_t   sizes_imix[] = { 60, 590, 60, 60, 590, 60, 1514, 60, 590, 60, 590, 60 };
+
+typedef struct
+{
+    const char*     name;
+    bool            tx;
+    const uint16_t* sizes;
+    uint8_t         count;
+} bench_scenario_t;
+
+static const bench_scenario_t   scenarios[] =
+{
+    { "rx_64", false, sizes_64, 1 },
+    { "rx_mtu", false, sizes_mtu, 1 },
+    { "rx_imix", false, sizes_imix, sizeof(sizes_imix) / sizeof(sizes_imix[0]) },
+    { "tx_64", true, sizes_64, 1 },
+    { "tx_mtu", true, sizes_mtu, 1 },
+    { "tx_imix", true, sizes_imix, sizeof(sizes_imix) / sizeof(sizes_imix[0]) },
+};
+
+typedef struct
+{
+    double      avg_us;
+    double      p50_us;
+    double      p99_us;
+    double      p999_us;
+    double      max_us;
+} bench_dist_t;
+
+typedef struct
+{
+    std::string     name;
+    uint32_t        frames;
+    uint64_t        bytes;
+    uint32_t        errors;
+    double          seconds;
+    double          frames_per_s;
+    double          bytes_per_s;
+    double          spi_transactions_per_frame;
+    double          spi_bytes_per_frame;
+    double          spi_us_per_frame;
+    bench_dist_t    latency;
+} bench_result_t;
+
+/**
+ * @brief   Computes the distribution of times in ns.
+ * @note    Sorts the samples.
+ * @param
+ * @retval
+ */
+static bench_dist_t bench_dist(std::vector<uint64_t>& ns)
+{
+    bench_dist_t    dist;
+    double          sum = 0;
+
+    memset(&dist, 0, sizeof(dist));
+    if (ns.empty())
+        return dist;
+
+    std::sort(ns.begin(), ns.end());
+    for (size_t i = 0; i < ns.size(); i++)
+        sum += ns[i];
+
+    dist.avg_us = sum / ns.size() / 1000.0;
+    dist.p50_us = ns[ns.size() / 2] / 1000.0;
+    dist.p99_us = ns[std::min(ns.size() - 1, ns.size() * 99 / 100)] / 1000.0;
+    dist.p999_us = ns[std::min(ns.size() - 1, ns.size() * 999 / 1000)] / 1000.0;
+    dist.max_us = ns.back() / 1000.0;
+    return dist;
+}
+
+/**
+ * @brief   Fills a frame addressed to the driver.
+ * @note
+ * @param
+ * @retval
+ */
+static void bench_frame(uint8_t* frame, uint16_t len, const uint8_t* dst, uint32_t seq)
+{
+    memcpy(frame, dst, 6);
+    memcpy(frame + 6, "\x02\x00\x00\x00\x00\x02", 6);
+    frame[12] = 0x88;   // local experimental ethertype
+    frame[13] = 0xB5;
+    for (uint16_t i = 14; i < len; i++)
+        frame[i] = (uint8_t)(seq + i);
+}
+
+/**
+ * @brief   Runs a scenario.
+ * @note    The driver thread runs on the INT pin of the model.
+ *          RX: frames are injected until the receive buffer is full, then
+ *          the driver drains it. Latency is from the injection to the
+ *          delivery to the stack.
+ *          TX: frames are queued by link_out. Latency is from the link_out
+ *          call to the transmission by the model.
+ *          The time is the wall time of the whole run.
+ * @param
+ * @retval
+ */
+static bench_result_t bench_run(const bench_scenario_t* scenario, uint32_t frames, uint32_t budget, bool batch, uint32_t chain)
+{
+    static const uint8_t        mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    // The driver thread runs until the process exits, so nothing it uses is freed
+    ENC28J60Sim&                sim = *new ENC28J60Sim();
+    HostMemoryManager&          memory = *new HostMemoryManager(BENCH_POOL_UNITS);
+    ENC28J60_EMAC&              emac = *new ENC28J60_EMAC(new ENC28J60(&sim), BENCH_INT_PIN);
+    bench_result_t              result;
+    std::vector<uint64_t>       latency;
+    std::deque<bench_clock_t::time_point>   sent;
+    std::deque<uint16_t>        sentLen;
+    std::mutex                  mutex;
+    std::condition_variable     cond;
+    enc28j60_sim_counters_t     counters;
+    uint8_t                     frame[MAX_FRAMELEN];
+    bench_clock_t::time_point   start;
+    bench_clock_t::time_point   end;
+    uint32_t                    done = 0;
+    uint32_t                    seq = 0;
+
+    result.name = scenario->name;
+    result.bytes = 0;
+    result.errors = 0;
+    latency.reserve(frames);
+
+    // Takes the oldest frame sent to the driver
+    auto arrived = [&](uint16_t len) {
+        std::lock_guard<std::mutex> lock(mutex);
+        bench_clock_t::time_point now = bench_clock_t::now();
+
+        if (sent.empty() || len != sentLen.front()) {
+            result.errors++;
+        }
+        else {
+            latency.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(now - sent.front()).count());
+            result.bytes += len;
+            sent.pop_front();
+            sentLen.pop_front();
+        }
+
+        done++;
+        cond.notify_all();
+    };
+
+    emac.set_memory_manager(memory);
+    emac.set_link_input_cb([&](emac_mem_buf_t* buf) {
+        arrived(memory.get_total_len(buf));
+        memory.free(buf);
+    });
+    if (batch) {
+        emac.set_link_input_batch_cb([&](emac_mem_buf_t** bufs, uint32_t count) {
+            for (uint32_t i = 0; i < count; i++) {
+                arrived(memory.get_total_len(bufs[i]));
+                memory.free(bufs[i]);
+            }
+        });
+    }
+    sim.onTransmit([&](const uint8_t* data, uint16_t len) {
+        arrived(len);
+    });
+    sim.onInterrupt([] { mbed::InterruptIn::fall_edge(BENCH_INT_PIN); });
+
+    emac.power_up();
+    emac.set_hwaddr(mac);
+    emac.set_rx_budget(budget);
+    std::this_thread::sleep_for(BENCH_SETTLE_MS);
+    emac.reset_stats();
+    sim.resetCounters();
+
+    start = bench_clock_t::now();
+    if (!scenario->tx) {
+        while (seq < frames) {
+            std::unique_lock<std::mutex>    lock(mutex);
+
+            while (seq < frames) {
+                uint16_t    len = scenario->sizes[seq % scenario->count];
+
+                bench_frame(frame, len, mac, seq);
+                sent.push_back(bench_clock_t::now());
+                sentLen.push_back(len);
+                if (!sim.injectFrame(frame, len)) {
+                    sent.pop_back();
+                    sentLen.pop_back();
+                    break;
+                }
+
+                seq++;
+            }
+
+            if (!cond.wait_for(lock, BENCH_TIME_OUT_MS, [&] { return done == seq; }))
+                break;
+        }
+    }
+    else {
+        while (seq < frames) {
+            uint16_t        len = scenario->sizes[seq % scenario->count];
+            emac_mem_buf_t* buf;
+
+            if (chain == 0) {
+                buf = memory.alloc_heap(len, ENC28J60_BUFF_ALIGNMENT);
+                bench_frame((uint8_t*)memory.get_ptr(buf), len, mac, seq);
+            }
+            else {
+                // Like the chains of small buffers made by the stack
+                bench_frame(frame, len, mac, seq);
+                buf = memory.alloc_heap(chain < len ? chain : len, ENC28J60_BUFF_ALIGNMENT);
+                for (uint32_t pos = chain; pos < len; pos += chain)
+                    memory.cat(buf, memory.alloc_heap(chain < len - pos ? chain : len - pos, ENC28J60_BUFF_ALIGNMENT));
+                memory.copy_to_buf(buf, frame, len);
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                sent.push_back(bench_clock_t::now());
+                sentLen.push_back(len);
+            }
+
+            if (!emac.link_out(buf)) {
+                std::lock_guard<std::mutex> lock(mutex);
+                sent.pop_back();
+                sentLen.pop_back();
+                result.errors++;
+            }
+
+            seq++;
+        }
+
+        std::unique_lock<std::mutex>    lock(mutex);
+        cond.wait_for(lock, BENCH_TIME_OUT_MS, [&] { return sent.empty(); });
+    }
+
+    end = bench_clock_t::now();
+    sim.getCounters(&counters);
+    emac.power_down();
+    sim.onTransmit(NULL);
+    sim.onInterrupt(NULL);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    result.errors += sent.size();
+    result.frames = done;
+    result.seconds = std::chrono::duration<double>(end - start).count();
+    result.frames_per_s = result.seconds > 0 ? done / result.seconds : 0;
+    result.bytes_per_s = result.seconds > 0 ? result.bytes / result.seconds : 0;
+    result.spi_transactions_per_frame = done ? (double)counters.transactions / done : 0;
+    result.spi_bytes_per_frame = done ? (double)counters.bytes / done : 0;
+    result.spi_us_per_frame = result.spi_bytes_per_frame * 8 * 1000000.0 / BENCH_SPI_HZ;
+    result.latency = bench_dist(latency);
+    return result;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+static void print_dist_json(const char* name, const bench_dist_t* d, bool last)
+{
+    printf("      \"%s\": { \"avg_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f }%s\n",
+           name, d->avg_us, d->p50_us, d->p99_us, d->p999_us, d->max_us, last ? "" : ",");
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+static void print_json(const std::vector<bench_result_t>& results)
+{
+    printf("{\n  \"spi_hz\": %u,\n  \"results\": [\n", BENCH_SPI_HZ);
+    for (size_t i = 0; i < results.size(); i++) {
+        const bench_result_t*   r = &results[i];
+
+        printf("    {\n");
+        printf("      \"scenario\": \"%s\",\n", r->name.c_str());
+        printf("      \"frames\": %u,\n", r->frames);
+        printf("      \"bytes\": %llu,\n", (unsigned long long)r->bytes);
+        printf("      \"errors\": %u,\n", r->errors);
+        printf("      \"seconds\": %.6f,\n", r->seconds);
+        printf("      \"frames_per_s\": %.1f,\n", r->frames_per_s);
+        printf("      \"bytes_per_s\": %.1f,\n", r->bytes_per_s);
+        printf("      \"spi_transactions_per_frame\": %.2f,\n", r->spi_transactions_per_frame);
+        printf("      \"spi_bytes_per_frame\": %.2f,\n", r->spi_bytes_per_frame);
+        printf("      \"spi_us_per_frame\": %.2f,\n", r->spi_us_per_frame);
+        print_dist_json("latency", &r->latency, true);
+        printf("    }%s\n", i + 1 < results.size() ? "," : "");
+    }
+
+    printf("  ]\n}\n");
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+static void print_csv(const std::vector<bench_result_t>& results)
+{
+    printf("scenario,frames,bytes,errors,seconds,frames_per_s,bytes_per_s,"
+           "spi_transactions_per_frame,spi_bytes_per_frame,spi_us_per_frame,"
+           "latency_avg_us,latency_p50_us,latency_p99_us,latency_p999_us,latency_max_us\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const bench_result_t*   r = &results[i];
+
+        printf("%s,%u,%llu,%u,%.6f,%.1f,%.1f,%.2f,%.2f,%.2f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+               r->name.c_str(), r->frames, (unsigned long long)r->bytes, r->errors, r->seconds,
+               r->frames_per_s, r->bytes_per_s, r->spi_transactions_per_frame, r->spi_bytes_per_frame,
+               r->spi_us_per_frame, r->latency.avg_us, r->latency.p50_us, r->latency.p99_us,
+               r->latency.p999_us, r->latency.max_us);
+    }
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+static void print_table(const std::vector<bench_result_t>& results)
+{
+    printf("%-8s %8s %10s %10s %8s %9s %9s %9s %9s %9s\n",
+           "scenario", "frames", "frames/s", "MB/s", "spi_tr/f", "spi_B/f", "spi_us/f",
+           "lat_p50", "lat_p99", "lat_max");
+    for (size_t i = 0; i < results.size(); i++) {
+        const bench_result_t*   r = &results[i];
+
+        printf("%-8s %8u %10.0f %10.2f %8.1f %9.1f %9.1f %9.2f %9.2f %9.2f%s\n",
+               r->name.c_str(), r->frames, r->frames_per_s, r->bytes_per_s / 1e6,
+               r->spi_transactions_per_frame, r->spi_bytes_per_frame, r->spi_us_per_frame,
+               r->latency.p50_us, r->latency.p99_us, r->latency.max_us,
+               r->errors ? " ERRORS" : "");
+    }
+
+    printf("times in us, spi_us/f is the SPI bus time per frame at %u Hz\n", BENCH_SPI_HZ);
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+            "usage: %s [--json|--csv] [--frames N] [--budget N] [--batch] [--chain BYTES] [--scenario NAME]...\n"
+            "scenarios:", prog);
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+        fprintf(stderr, " %s", scenarios[i].name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<bench_result_t>             results;
+    std::vector<const bench_scenario_t*>    selected;
+    const char*     format = "table";
+    uint32_t        frames = BENCH_FRAMES;
+    uint32_t        budget = RECEIVE_TASK_BUDGET;
+    bool            batch = false;
+    uint32_t        chain = 0;
+    uint32_t        errors = 0;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "--json" || arg == "--csv") {
+            format = argv[i] + 2;
+        }
+        else
+        if (arg == "--frames" && i + 1 < argc) {
+            frames = strtoul(argv[++i], NULL, 0);
+        }
+        else
+        if (arg == "--budget" && i + 1 < argc) {
+            budget = strtoul(argv[++i], NULL, 0);
+        }
+        else
+        if (arg == "--batch") {
+            batch = true;
+        }
+        else
+        if (arg == "--chain" && i + 1 < argc) {
+            chain = strtoul(argv[++i], NULL, 0);
+        }
+        else
+        if (arg == "--scenario" && i + 1 < argc) {
+            const char* name = argv[++i];
+            size_t      j;
+
+            for (j = 0; j < sizeof(scenarios) / sizeof(scenarios[0]); j++) {
+                if (strcmp(scenarios[j].name, name) == 0) {
+                    selected.push_back(&scenarios[j]);
+                    break;
+                }
+            }
+
+            if (j == sizeof(scenarios) / sizeof(scenarios[0])) {
+                usage(argv[0]);
+                return 2;
+            }
+        }
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (frames == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (selected.empty()) {
+        for (size_t j = 0; j < sizeof(scenarios) / sizeof(scenarios[0]); j++)
+            selected.push_back(&scenarios[j]);
+    }
+
+    for (size_t i = 0; i < selected.size(); i++) {
+        results.push_back(bench_run(selected[i], frames, budget, batch, chain));
+        errors += results.back().errors;
+    }
+
+    if (strcmp(format, "json") == 0)
+        print_json(results);
+    else
+    if (strcmp(format, "csv") == 0)
+        print_csv(results);
+    else
+        print_table(results);
+
+    return errors ? 1 : 0;
+}
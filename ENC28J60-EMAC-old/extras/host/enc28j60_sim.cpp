@@ -0,0 +1,1141 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "enc28j60_sim.h"
+
+#define MEM_MASK        (ENC28J60_SIM_MEM_SIZE - 1)
+#define COMMON_REG      0x1B    // EIE to ECON1 are in all banks
+
+// receive status vector byte 3 bits (see datasheet page 44, table 7-3)
+#define RSV3_MULTICAST  0x01
+#define RSV3_BROADCAST  0x02
+
+// transmit status vector bits (see datasheet page 42, table 7-1)
+#define TSV2_DONE       0x80
+#define TSV3_MULTICAST  0x01
+#define TSV3_BROADCAST  0x02
+#define TSV3_EXCESSIVE_COLLISION    0x10
+
+// PHIR flags
+#define PHIR_PLNKIF     0x0010
+#define PHIR_PGIF       0x0004
+
+/**
+ * @brief   Ethernet CRC-32 of a frame.
+ * @note
+ * @param
+ * @retval
+ */
+static uint32_t sim_crc32(const uint8_t* data, uint16_t len)
+{
+    uint32_t    crc = 0xFFFFFFFF;
+
+    for (uint16_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (uint8_t j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+    }
+
+    return ~crc;
+}
+
+/**
+ * @brief   Bit of the hash table filter for a destination address.
+ * @note    Bits 28:23 of the CRC the MAC computes over the address
+ *          (see datasheet page 50).
+ * @param
+ * @retval
+ */
+static uint8_t sim_hash_index(const uint8_t* addr)
+{
+    uint32_t    crc = 0xFFFFFFFF;
+    uint8_t     data;
+    uint8_t     bit;
+
+    for (uint8_t i = 0; i < 6; i++) {
+        data = addr[i];
+        for (uint8_t j = 0; j < 8; j++) {
+            bit = (crc >> 31) ^ (data & 0x01);
+            crc <<= 1;
+            data >>= 1;
+            if (bit)
+                crc ^= 0x04C11DB7;
+        }
+    }
+
+    return (crc >> 23) & 0x3F;
+}
+
+/**
+ * @brief
+ * @note    Powers up the chip as after a power-on reset with the link up.
+ * @param
+ * @retval
+ */
+ENC28J60Sim::ENC28J60Sim() :
+    _erxrdptl(0),
+    _selected(false),
+    _opcode(false),
+    _cmd(0),
+    _arg(0),
+    _dataCount(0),
+    _link(true),
+    _txErrors(0),
+    _txCollisions(0),
+    _txLate(false),
+    _txStall(false),
+    _txDelay(0),
+    _txCountdown(0),
+    _txThreadStop(false),
+    _intAsserted(false),
+    _freq(0),
+    _freqLimit(0),
+    _noise(0),
+    _failCount(0)
+{
+    memset(_mem, 0, sizeof(_mem));
+    memset(&_counters, 0, sizeof(_counters));
+    _reset();
+}
+
+/**
+ * @brief
+ * @note    Stops the thread of the delayed transmissions.
+ * @param
+ * @retval
+ */
+ENC28J60Sim::~ENC28J60Sim()
+{
+    {
+        std::lock_guard<std::recursive_mutex>   lock(_mutex);
+        _txThreadStop = true;
+    }
+    _txCond.notify_all();
+    if (_txThread.joinable())
+        _txThread.join();
+}
+
+/**
+ * @brief
+ * @note    The model doesn't depend on the clock, except the limit of setSpiLimit.
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::setFrequency(int hz)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    _freq = hz;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::setSpiLimit(int hz)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    _freqLimit = hz;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::failTransfers(uint32_t count)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    _failCount = count;
+}
+
+/**
+ * @brief   Starts an SPI instruction.
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::select(void)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+
+    _selected = true;
+    _opcode = false;
+    _dataCount = 0;
+    _counters.transactions++;
+}
+
+/**
+ * @brief   Ends an SPI instruction.
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::deselect(void)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+
+    _selected = false;
+    _opcode = false;
+    if (_txCountdown != 0 && --_txCountdown == 0 && (_regs[0][ECON1] & ECON1_TXRTS))
+        _transmit();
+    _updateInt();
+}
+
+/**
+ * @brief
+ * @note    Bytes are ignored while the chip isn't selected.
+ * @param
+ * @retval
+ */
+bool ENC28J60Sim::transfer(const uint8_t* tx, uint8_t* rx, uint16_t len, bool blocking)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    uint8_t out;
+    bool    done = true;
+
+    if (!blocking && len >= ENC28J60_SPI_ASYNC_MIN_LEN && _failCount != 0) {
+        _failCount--;
+        len /= 2;
+        done = false;
+    }
+
+    for (uint16_t i = 0; i < len; i++) {
+        out = _selected ? _byte(tx != NULL ? tx[i] : 0x00) : 0xFF;
+        if (_freqLimit != 0 && _freq > _freqLimit && (++_noise & 0x0F) == 0)
+            out ^= 0x10;
+        if (rx != NULL)
+            rx[i] = out;
+    }
+
+    _counters.bytes += len;
+    return done;
+}
+
+/**
+ * @brief   Clocks one byte of an SPI instruction.
+ * @note    The first byte after select is the opcode (see datasheet page 28).
+ * @param
+ * @retval  Byte clocked out on SO
+ */
+uint8_t ENC28J60Sim::_byte(uint8_t in)
+{
+    uint8_t bank = _regs[0][ECON1] & (ECON1_BSEL1 | ECON1_BSEL0);
+    uint8_t out = 0x00;
+    uint16_t    addr;
+
+    if (!_opcode) {
+        _opcode = true;
+        _cmd = in & 0xE0;
+        _arg = in & ADDR_MASK;
+        if (in == ENC28J60_SOFT_RESET)
+            _reset();
+        return out;
+    }
+
+    switch (_cmd) {
+        case ENC28J60_READ_CTRL_REG:
+            // MAC and MII registers shift out a dummy byte first
+            if (_dataCount > 0 || !_isMacMii(_arg))
+                out = _readReg(_arg);
+            break;
+
+        case ENC28J60_READ_BUF_MEM & 0xE0:
+            if (_arg != (ENC28J60_READ_BUF_MEM & ADDR_MASK))
+                break;
+
+            // ERDPT wraps from ERXND to ERXST (see datasheet page 34)
+            addr = _pair(0, ERDPTL);
+            out = _mem[addr];
+            if (_regs[0][ECON2] & ECON2_AUTOINC) {
+                if (addr == _pair(0, ERXNDL))
+                    addr = _pair(0, ERXSTL);
+                else
+                    addr = (addr + 1) & MEM_MASK;
+                _setPair(0, ERDPTL, addr);
+            }
+            break;
+
+        case ENC28J60_WRITE_CTRL_REG:
+            if (_dataCount == 0)
+                _writeReg(_arg, in);
+            break;
+
+        case ENC28J60_WRITE_BUF_MEM & 0xE0:
+            if (_arg != (ENC28J60_WRITE_BUF_MEM & ADDR_MASK))
+                break;
+
+            addr = _pair(0, EWRPTL);
+            _mem[addr] = in;
+            if (_regs[0][ECON2] & ECON2_AUTOINC)
+                _setPair(0, EWRPTL, (addr + 1) & MEM_MASK);
+            break;
+
+        case ENC28J60_BIT_FIELD_SET:
+            // Only ETH registers have the bit field operations
+            if (_dataCount == 0 && !_isMacMii(_arg))
+                _writeReg(_arg, _reg(bank, _arg) | in);
+            break;
+
+        case ENC28J60_BIT_FIELD_CLR:
+            if (_dataCount == 0 && !_isMacMii(_arg))
+                _writeReg(_arg, _reg(bank, _arg) & ~in);
+            break;
+
+        default:
+            break;
+    }
+
+    _dataCount++;
+    return out;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+uint8_t& ENC28J60Sim::_reg(uint8_t bank, uint8_t addr)
+{
+    return _regs[addr >= COMMON_REG ? 0 : bank][addr];
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+uint16_t ENC28J60Sim::_pair(uint8_t bank, uint8_t addr)
+{
+    addr &= ADDR_MASK;
+    return (_regs[bank][addr + 1] << 8) | _regs[bank][addr];
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::_setPair(uint8_t bank, uint8_t addr, uint16_t value)
+{
+    addr &= ADDR_MASK;
+    _regs[bank][addr] = value & 0xFF;
+    _regs[bank][addr + 1] = value >> 8;
+}
+
+/**
+ * @brief   Checks for a MAC or MII register in the selected bank.
+ * @note
+ * @param
+ * @retval
+ */
+bool ENC28J60Sim::_isMacMii(uint8_t addr)
+{
+    uint8_t bank = _regs[0][ECON1] & (ECON1_BSEL1 | ECON1_BSEL0);
+
+    if (addr >= COMMON_REG)
+        return false;
+
+    if (bank == 2)
+        return true;
+
+    return bank == 3 && (addr <= (MAADR4 & ADDR_MASK) || addr == (MISTAT & ADDR_MASK));
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+uint8_t ENC28J60Sim::_readReg(uint8_t addr)
+{
+    uint8_t bank = _regs[0][ECON1] & (ECON1_BSEL1 | ECON1_BSEL0);
+    uint8_t value = _reg(bank, addr);
+
+    if (addr == ESTAT) {
+        value &= ~ESTAT_INT;
+        if (interruptPending())
+            value |= ESTAT_INT;
+    }
+
+    return value;
+}
+
+/**
+ * @brief   Writes a register and runs its side effects.
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::_writeReg(uint8_t addr, uint8_t value)
+{
+    uint8_t bank = _regs[0][ECON1] & (ECON1_BSEL1 | ECON1_BSEL0);
+    uint8_t old = _reg(bank, addr);
+
+    if (addr >= COMMON_REG) {
+        switch (addr) {
+            case EIR:
+                // PKTIF and LINKIF are cleared by the hardware only
+                _regs[0][EIR] = (value & ~(EIR_PKTIF | EIR_LINKIF)) | (old & (EIR_PKTIF | EIR_LINKIF));
+                break;
+
+            case ESTAT:
+                // BUFER, LATECOL and TXABRT are cleared by software, the rest is read-only
+                _regs[0][ESTAT] = (old & ~(ESTAT_BUFER | ESTAT_LATECOL | ESTAT_TXABRT)) |
+                    (old & value & (ESTAT_BUFER | ESTAT_LATECOL | ESTAT_TXABRT));
+                break;
+
+            case ECON2:
+                if ((value & ECON2_PKTDEC) && _regs[1][EPKTCNT & ADDR_MASK] > 0) {
+                    _regs[1][EPKTCNT & ADDR_MASK]--;
+                    if (_regs[1][EPKTCNT & ADDR_MASK] == 0)
+                        _regs[0][EIR] &= ~EIR_PKTIF;
+                }
+
+                _regs[0][ECON2] = value & ~ECON2_PKTDEC;
+                if (value & ECON2_PWRSV)
+                    _regs[0][ESTAT] &= ~ESTAT_CLKRDY;
+                else
+                    _regs[0][ESTAT] |= ESTAT_CLKRDY;
+                break;
+
+            case ECON1:
+                _regs[0][ECON1] = value;
+                if (value & ECON1_TXRST) {
+                    _regs[0][ECON1] &= ~ECON1_TXRTS;
+                    _txStall = false;
+                    _txCountdown = 0;
+                }
+
+                if (value & ECON1_RXRST) {
+                    _setPair(0, ERXWRPTL, _pair(0, ERXSTL));
+                    _regs[1][EPKTCNT & ADDR_MASK] = 0;
+                    _regs[0][EIR] &= ~EIR_PKTIF;
+                }
+
+                if ((value & ECON1_DMAST) && !(old & ECON1_DMAST))
+                    _dma();
+
+                if ((_regs[0][ECON1] & ECON1_TXRTS) && !(old & ECON1_TXRTS)) {
+                    if (_txDelay != 0) {
+                        _txCountdown = _txDelay;
+                        _txDeadline = std::chrono::steady_clock::now() + ENC28J60_SIM_TX_DELAY_MAX;
+                        _txCond.notify_all();
+                    }
+                    else
+                        _transmit();
+                }
+                break;
+
+            default:
+                _regs[0][addr] = value;
+                break;
+        }
+
+        return;
+    }
+
+    switch ((bank << 5) | addr) {
+        case ERXSTL:
+        case ERXSTH:
+            // ERXWRPT follows ERXST (see datasheet page 33)
+            _regs[0][addr] = value;
+            _setPair(0, ERXWRPTL, _pair(0, ERXSTL));
+            break;
+
+        case ERXRDPTL:
+            _erxrdptl = value;
+            break;
+
+        case ERXRDPTH:
+            // ERXRDPTL takes effect when ERXRDPTH is written
+            _regs[0][ERXRDPTL] = _erxrdptl;
+            _regs[0][ERXRDPTH] = value & 0x1F;
+            break;
+
+        case ERXWRPTL:
+        case ERXWRPTH:
+        case EPKTCNT:
+        case EREVID:
+        case MISTAT & 0x7F:
+        case MIRDL & 0x7F:
+        case MIRDH & 0x7F:
+            break;
+
+        case MICMD & 0x7F:
+            _regs[2][addr] = value;
+            if (value & MICMD_MIIRD) {
+                uint8_t     phyAddr = _regs[2][MIREGADR & ADDR_MASK];
+                uint16_t    data = _phy[phyAddr & 0x1F];
+
+                _regs[2][MIRDL & ADDR_MASK] = data & 0xFF;
+                _regs[2][MIRDH & ADDR_MASK] = data >> 8;
+
+                // Reading PHIR clears the PHY interrupt flags
+                if (phyAddr == PHIR) {
+                    _phy[PHIR] = 0;
+                    _regs[0][EIR] &= ~EIR_LINKIF;
+                }
+            }
+            break;
+
+        case MIWRH & 0x7F:
+            _regs[2][addr] = value;
+            _phyWrite(_regs[2][MIREGADR & ADDR_MASK], _pair(2, MIWRL));
+            break;
+
+        default:
+            _regs[bank][addr] = value;
+            break;
+    }
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::_phyWrite(uint8_t address, uint16_t value)
+{
+    switch (address & 0x1F) {
+        case PHCON1:
+            if (value & PHCON1_PRST) {
+                _phy[PHCON1] = 0;
+                _phy[PHCON2] = 0;
+                _phy[PHIE] = 0;
+                _phy[PHIR] = 0;
+                _phy[PHLCON] = 0x3422;
+            }
+            else {
+                _phy[PHCON1] = value;
+            }
+            break;
+
+        case PHSTAT1:
+        case PHSTAT2:
+        case PHHID1:
+        case PHHID2:
+        case PHIR:
+            break;
+
+        default:
+            _phy[address & 0x1F] = value;
+            break;
+    }
+}
+
+/**
+ * @brief   System reset.
+ * @note    Reset values of the registers used by the driver (see datasheet page 14).
+ *          The buffer memory keeps its content.
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::_reset(void)
+{
+    memset(_regs, 0, sizeof(_regs));
+    memset(_phy, 0, sizeof(_phy));
+
+    _setPair(0, ERDPTL, 0x05FA);
+    _setPair(0, ERXSTL, 0x05FA);
+    _setPair(0, ERXNDL, 0x1FFF);
+    _setPair(0, ERXRDPTL, 0x05FA);
+    _erxrdptl = 0xFA;
+    _regs[0][ECON2] = ECON2_AUTOINC;
+    _regs[0][ESTAT] = ESTAT_CLKRDY;
+    _regs[1][ERXFCON & ADDR_MASK] = ERXFCON_UCEN | ERXFCON_CRCEN | ERXFCON_BCEN;
+    _regs[2][MACON2 & ADDR_MASK] = MACON2_MARST;
+    _setPair(2, MAMXFLL, 0x0600);
+    _regs[3][EREVID & ADDR_MASK] = ENC28J60_SIM_REVID;
+
+    _phy[PHHID1] = 0x0083;
+    _phy[PHHID2] = 0x1400;
+    _phy[PHLCON] = 0x3422;
+    _phy[PHSTAT1] = PHSTAT1_PFDPX | PHSTAT1_PHDPX | (_link ? PHSTAT1_LLSTAT : 0);
+    _phy[PHSTAT2] = _link ? PHSTAT2_LSTAT : 0;
+}
+
+/**
+ * @brief   Transmits the packet from ETXST to ETXND.
+ * @note    ETXST holds the control byte. The status vector is written
+ *          after ETXND (see datasheet page 40).
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::_transmit(void)
+{
+    uint16_t    start = _pair(0, ETXSTL);
+    uint16_t    end = _pair(0, ETXNDL);
+    uint16_t    len = (end - start) & MEM_MASK;
+    uint8_t     frame[ENC28J60_SIM_MEM_SIZE];
+    uint8_t     tsv[TX_STAT_LEN];
+    bool        abort = false;
+
+    if (_txStall)
+        return;
+
+    for (uint16_t i = 0; i < len; i++)
+        frame[i] = _mem[(start + 1 + i) & MEM_MASK];
+
+    memset(tsv, 0, sizeof(tsv));
+    tsv[0] = len & 0xFF;
+    tsv[1] = len >> 8;
+    tsv[2] = _txCollisions & TSV2_COLLISION_COUNT;
+    if (len >= 6 && (frame[0] & 0x01)) {
+        if (memcmp(frame, "\xff\xff\xff\xff\xff\xff", 6) == 0)
+            tsv[3] |= TSV3_BROADCAST;
+        else
+            tsv[3] |= TSV3_MULTICAST;
+    }
+
+    if (_txLate) {
+        tsv[3] |= TSV3_LATE_COLLISION;
+        _regs[0][ESTAT] |= ESTAT_LATECOL;
+    }
+
+    if (_txErrors > 0) {
+        _txErrors--;
+        abort = true;
+        tsv[3] |= TSV3_EXCESSIVE_COLLISION;
+    }
+    else {
+        tsv[2] |= TSV2_DONE;
+    }
+
+    tsv[4] = tsv[0];
+    tsv[5] = tsv[1];
+    for (uint8_t i = 0; i < TX_STAT_LEN; i++)
+        _mem[(end + 1 + i) & MEM_MASK] = tsv[i];
+
+    _regs[0][ECON1] &= ~ECON1_TXRTS;
+    if (abort) {
+        _regs[0][ESTAT] |= ESTAT_TXABRT;
+        _regs[0][EIR] |= EIR_TXERIF;
+        _counters.tx_aborts++;
+    }
+    else {
+        _regs[0][ESTAT] &= ~ESTAT_TXABRT;
+        _regs[0][EIR] |= EIR_TXIF;
+        _counters.tx_frames++;
+        if (_txCb)
+            _txCb(frame, len);
+    }
+}
+
+/**
+ * @brief   Copies memory or computes a checksum from EDMAST to EDMAND.
+ * @note    Addresses wrap in the receive buffer (see datasheet page 71).
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::_dma(void)
+{
+    uint16_t    rxStart = _pair(0, ERXSTL);
+    uint16_t    rxEnd = _pair(0, ERXNDL);
+    uint16_t    src = _pair(0, EDMASTL);
+    uint16_t    end = _pair(0, EDMANDL);
+    uint16_t    dst = _pair(0, EDMADSTL);
+    bool        checksum = (_regs[0][ECON1] & ECON1_CSUMEN) != 0;
+    uint32_t    sum = 0;
+    uint32_t    count = 0;
+
+    while (count < ENC28J60_SIM_MEM_SIZE) {
+        if (checksum)
+            sum += (count & 1) ? _mem[src] : _mem[src] << 8;
+        else {
+            _mem[dst] = _mem[src];
+            dst = (dst == rxEnd) ? rxStart : (dst + 1) & MEM_MASK;
+        }
+
+        count++;
+        if (src == end)
+            break;
+        src = (src == rxEnd) ? rxStart : (src + 1) & MEM_MASK;
+    }
+
+    if (checksum) {
+        while (sum >> 16)
+            sum = (sum & 0xFFFF) + (sum >> 16);
+        sum = ~sum & 0xFFFF;
+        _regs[0][EDMACSL & ADDR_MASK] = sum & 0xFF;
+        _regs[0][EDMACSH & ADDR_MASK] = sum >> 8;
+    }
+
+    _regs[0][ECON1] &= ~ECON1_DMAST;
+    _regs[0][EIR] |= EIR_DMAIF;
+    _counters.dma_operations++;
+}
+
+/**
+ * @brief   Runs the receive filters (see datasheet page 47).
+ * @note
+ * @param
+ * @retval
+ */
+bool ENC28J60Sim::_accept(const uint8_t* frame, uint16_t len)
+{
+    uint8_t     fcon = _regs[1][ERXFCON & ADDR_MASK];
+    uint8_t     mac[6];
+    bool        broadcast;
+    bool        multicast;
+    bool        any = false;
+    bool        all = true;
+    bool        match;
+
+    if ((fcon & (ERXFCON_UCEN | ERXFCON_PMEN | ERXFCON_MPEN | ERXFCON_HTEN | ERXFCON_MCEN | ERXFCON_BCEN)) == 0)
+        return true;
+
+    if (len < 14)
+        return false;
+
+    mac[0] = _regs[3][MAADR5 & ADDR_MASK];
+    mac[1] = _regs[3][MAADR4 & ADDR_MASK];
+    mac[2] = _regs[3][MAADR3 & ADDR_MASK];
+    mac[3] = _regs[3][MAADR2 & ADDR_MASK];
+    mac[4] = _regs[3][MAADR1 & ADDR_MASK];
+    mac[5] = _regs[3][MAADR0 & ADDR_MASK];
+    broadcast = memcmp(frame, "\xff\xff\xff\xff\xff\xff", 6) == 0;
+    multicast = (frame[0] & 0x01) && !broadcast;
+
+    for (uint16_t filter = ERXFCON_BCEN; filter <= ERXFCON_UCEN; filter <<= 1) {
+        if ((fcon & filter) == 0 || filter == ERXFCON_CRCEN || filter == ERXFCON_ANDOR || filter == ERXFCON_MPEN)
+            continue;
+
+        switch (filter) {
+            case ERXFCON_UCEN:
+                match = memcmp(frame, mac, 6) == 0;
+                break;
+
+            case ERXFCON_BCEN:
+                match = broadcast;
+                break;
+
+            case ERXFCON_MCEN:
+                match = multicast;
+                break;
+
+            case ERXFCON_HTEN: {
+                uint8_t index = sim_hash_index(frame);
+                match = (_regs[1][(EHT0 & ADDR_MASK) + (index >> 3)] & (1 << (index & 7))) != 0;
+                break;
+            }
+
+            default: {
+                // ERXFCON_PMEN: checksum of the bytes selected by EPMM from EPMO on
+                uint16_t    offset = _pair(1, EPMOL);
+                uint32_t    sum = 0;
+                bool        odd = false;
+
+                match = true;
+                for (uint8_t i = 0; i < 64; i++) {
+                    if ((_regs[1][(EPMM0 & ADDR_MASK) + (i >> 3)] & (1 << (i & 7))) == 0)
+                        continue;
+
+                    if (offset + i >= len) {
+                        match = false;
+                        break;
+                    }
+
+                    sum += odd ? frame[offset + i] : frame[offset + i] << 8;
+                    odd = !odd;
+                }
+
+                while (sum >> 16)
+                    sum = (sum & 0xFFFF) + (sum >> 16);
+                match = match && (~sum & 0xFFFF) == _pair(1, EPMCSL);
+                break;
+            }
+        }
+
+        any = any || match;
+        all = all && match;
+    }
+
+    return (fcon & ERXFCON_ANDOR) ? all : any;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+uint16_t ENC28J60Sim::_rxNext(uint16_t addr)
+{
+    return (addr == _pair(0, ERXNDL)) ? _pair(0, ERXSTL) : (addr + 1) & MEM_MASK;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::_rxWrite(uint16_t* addr, uint8_t value)
+{
+    _mem[*addr] = value;
+    *addr = _rxNext(*addr);
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+bool ENC28J60Sim::injectFrame(const uint8_t* frame, uint16_t len, bool crcOk)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    bool        received = _receive(frame, len, crcOk);
+
+    _updateInt();
+    return received;
+}
+
+/**
+ * @brief   Writes a frame to the receive buffer.
+ * @note    The receive hardware writes up to, but not including ERXRDPT.
+ *          The next packet pointer is kept even (see datasheet page 43).
+ * @param
+ * @retval
+ */
+bool ENC28J60Sim::_receive(const uint8_t* frame, uint16_t len, bool crcOk)
+{
+    uint16_t    size = _pair(0, ERXNDL) - _pair(0, ERXSTL) + 1;
+    uint16_t    wr = _pair(0, ERXWRPTL);
+    uint16_t    rd = _pair(0, ERXRDPTL);
+    uint16_t    total = RX_NEXT_LEN + RX_STAT_LEN + len + RX_CRC_LEN;
+    uint16_t    space;
+    uint16_t    next;
+    uint16_t    addr;
+    uint32_t    crc;
+    uint8_t     rsv3 = 0;
+
+    if ((_regs[0][ECON1] & ECON1_RXEN) == 0 || !_link)
+        return false;
+
+    if ((_regs[2][MACON3 & ADDR_MASK] & MACON3_HFRMLEN) == 0 && len + RX_CRC_LEN > _pair(2, MAMXFLL)) {
+        _counters.rx_filtered++;
+        return false;
+    }
+
+    if ((!crcOk && (_regs[1][ERXFCON & ADDR_MASK] & ERXFCON_CRCEN)) || !_accept(frame, len)) {
+        _counters.rx_filtered++;
+        return false;
+    }
+
+    space = (rd - wr + size) % size;
+    if (space == 0)
+        space = size;
+
+    if ((total + 1) / 2 * 2 > space || _regs[1][EPKTCNT & ADDR_MASK] == 255) {
+        _regs[0][EIR] |= EIR_RXERIF;
+        _counters.rx_overflows++;
+        return false;
+    }
+
+    next = wr;
+    for (uint16_t i = 0; i < (total + 1) / 2 * 2; i++)
+        next = _rxNext(next);
+
+    if (frame[0] & 0x01)
+        rsv3 = memcmp(frame, "\xff\xff\xff\xff\xff\xff", 6) == 0 ? RSV3_BROADCAST : RSV3_MULTICAST;
+
+    addr = wr;
+    _rxWrite(&addr, next & 0xFF);
+    _rxWrite(&addr, next >> 8);
+    _rxWrite(&addr, (len + RX_CRC_LEN) & 0xFF);
+    _rxWrite(&addr, (len + RX_CRC_LEN) >> 8);
+    _rxWrite(&addr, crcOk ? RSV2_RXOK : RSV2_CRCERROR);
+    _rxWrite(&addr, rsv3);
+    for (uint16_t i = 0; i < len; i++)
+        _rxWrite(&addr, frame[i]);
+
+    crc = sim_crc32(frame, len);
+    if (!crcOk)
+        crc = ~crc;
+    for (uint8_t i = 0; i < RX_CRC_LEN; i++)
+        _rxWrite(&addr, crc >> (i * 8));
+
+    _setPair(0, ERXWRPTL, next);
+    _regs[1][EPKTCNT & ADDR_MASK]++;
+    _regs[0][EIR] |= EIR_PKTIF;
+    _counters.rx_frames++;
+    return true;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::setLink(bool up)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+
+    if (up == _link)
+        return;
+
+    _link = up;
+    _phy[PHSTAT2] = up ? (_phy[PHSTAT2] | PHSTAT2_LSTAT) : (_phy[PHSTAT2] & ~PHSTAT2_LSTAT);
+    if (up)
+        _phy[PHSTAT1] |= PHSTAT1_LLSTAT;
+    else
+        _phy[PHSTAT1] &= ~PHSTAT1_LLSTAT;    // latches low until read
+
+    _phy[PHIR] |= PHIR_PLNKIF;
+    if ((_phy[PHIE] & (PHIE_PGEIE | PHIE_PLNKIE)) == (PHIE_PGEIE | PHIE_PLNKIE)) {
+        _phy[PHIR] |= PHIR_PGIF;
+        _regs[0][EIR] |= EIR_LINKIF;
+    }
+
+    _updateInt();
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::onTransmit(enc28j60_sim_tx_cb_t cb)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    _txCb = cb;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::injectTxErrors(uint32_t count, uint8_t collisions, bool late)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    _txErrors = count;
+    _txCollisions = collisions;
+    _txLate = late;
+}
+
+/**
+ * @brief
+ * @note    The delay applies to the transmissions started after the call.
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::delayTransmit(uint32_t transactions)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    _txDelay = transactions;
+    if (transactions != 0 && !_txThread.joinable())
+        _txThread = std::thread(&ENC28J60Sim::_txDelayThread, this);
+}
+
+/**
+ * @brief   Completes a delayed transmission at its deadline.
+ * @note    Runs until the model is destroyed.
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::_txDelayThread(void)
+{
+    std::unique_lock<std::recursive_mutex>  lock(_mutex);
+
+    while (!_txThreadStop) {
+        if (_txCountdown == 0) {
+            _txCond.wait(lock);
+            continue;
+        }
+
+        if (_txCond.wait_until(lock, _txDeadline) == std::cv_status::timeout && _txCountdown != 0) {
+            _txCountdown = 0;
+            if (_regs[0][ECON1] & ECON1_TXRTS)
+                _transmit();
+            _updateInt();
+        }
+    }
+}
+
+/**
+ * @brief
+ * @note    Releasing the stall transmits the pending packet.
+ *          ECON1_TXRST releases it too, without the transmission.
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::stallTransmit(bool stall)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    _txStall = stall;
+    if (!stall && (_regs[0][ECON1] & ECON1_TXRTS))
+        _transmit();
+    _updateInt();
+}
+
+/**
+ * @brief
+ * @note    The oldest packet starts after ERXRDPT.
+ * @param
+ * @retval
+ */
+bool ENC28J60Sim::corruptRxHeader(void)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    uint16_t    addr = _rxNext(_pair(0, ERXRDPTL));
+
+    if (_regs[1][EPKTCNT & ADDR_MASK] == 0)
+        return false;
+
+    _mem[addr] = 0x55;
+    _mem[_rxNext(addr)] = 0x55;
+    return true;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::onInterrupt(enc28j60_sim_int_cb_t cb)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    _intCb = cb;
+    _intAsserted = interruptPending();
+}
+
+/**
+ * @brief
+ * @note    INT is asserted when EIE_INTIE is set and an enabled flag is set.
+ * @param
+ * @retval
+ */
+bool ENC28J60Sim::interruptPending(void)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    uint8_t eie = _regs[0][EIE];
+
+    return (eie & EIE_INTIE) && (eie & _regs[0][EIR] & ~EIE_INTIE) != 0;
+}
+
+/**
+ * @brief   Follows the INT pin.
+ * @note    Called at the end of every instruction and host event.
+ *          The callback runs on the falling edge.
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::_updateInt(void)
+{
+    bool    asserted = interruptPending();
+
+    if (asserted && !_intAsserted && _intCb)
+        _intCb();
+    _intAsserted = asserted;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+uint8_t ENC28J60Sim::packetCount(void)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    return _regs[1][EPKTCNT & ADDR_MASK];
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+uint16_t ENC28J60Sim::rxFreeSpace(void)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    uint16_t    size = _pair(0, ERXNDL) - _pair(0, ERXSTL) + 1;
+    uint16_t    space = (_pair(0, ERXRDPTL) - _pair(0, ERXWRPTL) + size) % size;
+
+    return space == 0 ? size : space;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::getCounters(enc28j60_sim_counters_t* counters)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    *counters = _counters;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60Sim::resetCounters(void)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    memset(&_counters, 0, sizeof(_counters));
+}
+
+/**
+ * @brief
+ * @note
+ * @param   address register as defined in enc28j60_reg.h
+ * @retval
+ */
+uint8_t ENC28J60Sim::peekReg(uint8_t address)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    return _reg((address & BANK_MASK) >> 5, address & ADDR_MASK);
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+uint16_t ENC28J60Sim::peekPhy(uint8_t address)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    return _phy[address & 0x1F];
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+uint8_t ENC28J60Sim::peekMem(uint16_t addr)
+{
+    std::lock_guard<std::recursive_mutex>   lock(_mutex);
+    return _mem[addr & MEM_MASK];
+}
@@ -0,0 +1,216 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ENC28J60_SIM_H_
+#define ENC28J60_SIM_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "enc28j60_transport.h"
+#include "enc28j60_reg.h"
+
+#define ENC28J60_SIM_MEM_SIZE   8192U
+#define ENC28J60_SIM_REVID      0x06U
+#define ENC28J60_SIM_TX_DELAY_MAX   std::chrono::microseconds(100)
+
+/**
+ * \brief Simulator counters
+ */
+typedef struct
+{
+    uint32_t    transactions;           /*!< chip selects */
+    uint32_t    bytes;                  /*!< bytes clocked in both directions, opcodes included */
+    uint32_t    rx_frames;              /*!< frames written to the receive buffer */
+    uint32_t    rx_filtered;            /*!< frames rejected by the receive filters */
+    uint32_t    rx_overflows;           /*!< frames dropped for lack of space or EPKTCNT at 255 */
+    uint32_t    tx_frames;              /*!< frames transmitted */
+    uint32_t    tx_aborts;              /*!< transmissions aborted by fault injection */
+    uint32_t    dma_operations;
+} enc28j60_sim_counters_t;
+
+typedef std::function<void(const uint8_t* frame, uint16_t len)> enc28j60_sim_tx_cb_t;
+typedef std::function<void(void)>                                enc28j60_sim_int_cb_t;
+
+/**
+ * \brief Behavioural model of the ENC28J60 at the SPI level
+ *
+ * Decodes the SPI instruction set, keeps the register banks, the 8 KB buffer
+ * memory and the PHY registers, and implements the receive buffer
+ * (ERXST, ERXND, ERXWRPT, ERXRDPT, EPKTCNT), transmission (TXRTS, status vector),
+ * the DMA copy and checksum, the receive filters and the interrupt flags.
+ * Frames are injected by the host and transmitted frames are passed to a callback.
+ * Everything completes instantly, so the timing of the driver is not modelled.
+ */
+class   ENC28J60Sim :
+    public ENC28J60Transport
+{
+public:
+    ENC28J60Sim();
+    virtual ~ENC28J60Sim();
+
+    virtual void        setFrequency(int hz);
+    virtual void        select(void);
+    virtual void        deselect(void);
+    virtual bool        transfer(const uint8_t* tx, uint8_t* rx, uint16_t len, bool blocking);
+
+    /**
+     * \brief Receives a frame from the wire.
+     *
+     * \param[in] frame Frame without CRC
+     * \param[in] len Frame length
+     * \param[in] crcOk False to receive the frame with a CRC error
+     * \return True if the frame was written to the receive buffer
+     */
+    bool                injectFrame(const uint8_t* frame, uint16_t len, bool crcOk = true);
+
+    /**
+     * \brief Sets the link state. A change sets the PHY interrupt flags.
+     */
+    void                setLink(bool up);
+
+    /**
+     * \brief Sets the callback for transmitted frames.
+     */
+    void                onTransmit(enc28j60_sim_tx_cb_t cb);
+
+    /**
+     * \brief Aborts the next transmissions with EIR_TXERIF and ESTAT_TXABRT.
+     *
+     * \param[in] count Number of transmissions to abort
+     * \param[in] collisions Collision count written to the status vector of every transmission
+     * \param[in] late Report a late collision in the status vector
+     */
+    void                injectTxErrors(uint32_t count, uint8_t collisions = 0, bool late = false);
+
+    /**
+     * \brief Keeps ECON1_TXRTS set without completing the transmissions,
+     * until the transmit logic is reset with ECON1_TXRST (see errata).
+     */
+    void                stallTransmit(bool stall);
+
+    /**
+     * \brief Completes the transmissions after a number of SPI transactions
+     * instead of when ECON1_TXRTS is set, like the wire time of a frame.
+     *
+     * A transmission completes after ENC28J60_SIM_TX_DELAY_MAX without SPI
+     * transactions too, so the driver isn't kept waiting when it is idle.
+     *
+     * \param[in] transactions Chip select cycles, counting the one which sets ECON1_TXRTS, 0 for no delay
+     */
+    void                delayTransmit(uint32_t transactions);
+
+    /**
+     * \brief Makes the SPI unreliable above a clock frequency, like long wires.
+     *
+     * Above the limit every 16th byte clocked out on SO has a bit flipped.
+     * The bytes clocked in are not changed, so the state of the model stays valid.
+     *
+     * \param[in] hz Highest reliable frequency, 0 for no limit
+     */
+    void                setSpiLimit(int hz);
+
+    /**
+     * \brief Aborts the next transfers, like a timed out asynchronous transfer.
+     *
+     * Only not blocking transfers at least ENC28J60_SPI_ASYNC_MIN_LEN long
+     * are aborted. The first half of an aborted transfer is clocked.
+     *
+     * \param[in] count Number of transfers to abort, 0 for none
+     */
+    void                failTransfers(uint32_t count);
+
+    /**
+     * \brief Overwrites the next packet pointer of the oldest packet in the receive buffer.
+     *
+     * \return False if no packet is buffered
+     */
+    bool                corruptRxHeader(void);
+
+    /**
+     * \brief Sets the callback for the falling edge of the INT pin.
+     *
+     * It runs in the thread which caused the edge, with the model locked.
+     * mbed::InterruptIn::fall_edge passes it to the driver.
+     */
+    void                onInterrupt(enc28j60_sim_int_cb_t cb);
+
+    /**
+     * \brief State of the INT pin, true is low (asserted).
+     */
+    bool                interruptPending(void);
+
+    uint8_t             packetCount(void);
+    uint16_t            rxFreeSpace(void);
+    void                getCounters(enc28j60_sim_counters_t* counters);
+    void                resetCounters(void);
+
+    /**
+     * \brief Direct access for the host, not counted as SPI traffic.
+     */
+    uint8_t             peekReg(uint8_t address);
+    uint16_t            peekPhy(uint8_t address);
+    uint8_t             peekMem(uint16_t addr);
+private:
+    uint8_t             _byte(uint8_t in);
+    uint8_t&            _reg(uint8_t bank, uint8_t addr);
+    uint8_t             _readReg(uint8_t addr);
+    void                _writeReg(uint8_t addr, uint8_t value);
+    uint16_t            _pair(uint8_t bank, uint8_t addr);
+    void                _setPair(uint8_t bank, uint8_t addr, uint16_t value);
+    bool                _isMacMii(uint8_t addr);
+    void                _reset(void);
+    bool                _receive(const uint8_t* frame, uint16_t len, bool crcOk);
+    void                _updateInt(void);
+    void                _transmit(void);
+    void                _dma(void);
+    bool                _accept(const uint8_t* frame, uint16_t len);
+    uint16_t            _rxNext(uint16_t addr);
+    void                _rxWrite(uint16_t* addr, uint8_t value);
+    void                _phyWrite(uint8_t address, uint16_t value);
+    void                _txDelayThread(void);
+
+    std::recursive_mutex    _mutex;
+    uint8_t                 _mem[ENC28J60_SIM_MEM_SIZE];
+    uint8_t                 _regs[4][32];
+    uint16_t                _phy[32];
+    uint8_t                 _erxrdptl;      // ERXRDPTL is buffered until ERXRDPTH is written
+    bool                    _selected;
+    bool                    _opcode;
+    uint8_t                 _cmd;
+    uint8_t                 _arg;
+    uint16_t                _dataCount;
+    bool                    _link;
+    uint32_t                _txErrors;
+    uint8_t                 _txCollisions;
+    bool                    _txLate;
+    bool                    _txStall;
+    uint32_t                _txDelay;
+    uint32_t                _txCountdown;   // chip select cycles until the transmission completes
+    std::chrono::steady_clock::time_point   _txDeadline;    // it completes anyway
+    std::condition_variable_any _txCond;
+    std::thread             _txThread;
+    bool                    _txThreadStop;
+    enc28j60_sim_tx_cb_t    _txCb;
+    enc28j60_sim_int_cb_t   _intCb;
+    bool                    _intAsserted;
+    int                     _freq;
+    int                     _freqLimit;
+    uint32_t                _noise;         // bytes clocked out above _freqLimit
+    uint32_t                _failCount;     // not blocking transfers to abort
+    enc28j60_sim_counters_t _counters;
+};
+#endif /* ENC28J60_SIM_H_ */
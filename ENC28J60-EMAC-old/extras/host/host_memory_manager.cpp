@@ -0,0 +1,313 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdlib.h>
+#include "host_memory_manager.h"
+
+/**
+ * @brief
+ * @note
+ * @param   pool_units number of HOST_POOL_UNIT buffers in the pool
+ * @retval
+ */
+HostMemoryManager::HostMemoryManager(uint32_t pool_units) :
+    _poolFree(pool_units),
+    _heapLimit(UINT32_MAX),
+    _heapUsed(0)
+{ }
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+HostMemoryManager::host_buf_t* HostMemoryManager::_alloc(uint32_t size, bool pool)
+{
+    host_buf_t*     buf = (host_buf_t*)malloc(sizeof(host_buf_t));
+
+    buf->next = NULL;
+    buf->len = size;
+    buf->size = size;
+    buf->pool = pool;
+    buf->data = (uint8_t*)malloc(size > 0 ? size : 1);
+    return buf;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+emac_mem_buf_t* HostMemoryManager::alloc_heap(uint32_t size, uint32_t align)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (_heapLimit != UINT32_MAX && _heapUsed + size > _heapLimit)
+        return NULL;
+
+    _heapUsed += size;
+    return _alloc(size, false);
+}
+
+/**
+ * @brief
+ * @note    Allocates a chain of pool units.
+ * @param
+ * @retval
+ */
+emac_mem_buf_t* HostMemoryManager::alloc_pool(uint32_t size, uint32_t align)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    uint32_t        units = (size + HOST_POOL_UNIT - 1) / HOST_POOL_UNIT;
+    host_buf_t*     head = NULL;
+    host_buf_t*     tail = NULL;
+    host_buf_t*     buf;
+
+    if (units == 0)
+        units = 1;
+
+    if (units > _poolFree)
+        return NULL;
+
+    _poolFree -= units;
+    while (units > 0) {
+        buf = _alloc(HOST_POOL_UNIT, true);
+        buf->len = size > HOST_POOL_UNIT ? HOST_POOL_UNIT : size;
+        size -= buf->len;
+        if (tail == NULL)
+            head = buf;
+        else
+            tail->next = buf;
+        tail = buf;
+        units--;
+    }
+
+    return head;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+uint32_t HostMemoryManager::get_pool_alloc_unit(uint32_t align) const
+{
+    return HOST_POOL_UNIT;
+}
+
+/**
+ * @brief
+ * @note    Frees the whole chain.
+ * @param
+ * @retval
+ */
+void HostMemoryManager::free(emac_mem_buf_t* buf)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    host_buf_t*     next;
+
+    for (host_buf_t* b = (host_buf_t*)buf; b != NULL; b = next) {
+        next = b->next;
+        if (b->pool)
+            _poolFree++;
+        else
+            _heapUsed -= b->size;
+        ::free(b->data);
+        ::free(b);
+    }
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+uint32_t HostMemoryManager::get_total_len(const emac_mem_buf_t* buf) const
+{
+    uint32_t    len = 0;
+
+    for (const host_buf_t* b = (const host_buf_t*)buf; b != NULL; b = b->next)
+        len += b->len;
+
+    return len;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void HostMemoryManager::copy(emac_mem_buf_t* to_buf, const emac_mem_buf_t* from_buf)
+{
+    const host_buf_t*   from = (const host_buf_t*)from_buf;
+    host_buf_t*         to = (host_buf_t*)to_buf;
+    uint32_t            from_pos = 0;
+    uint32_t            to_pos = 0;
+    uint32_t            len;
+
+    while (from != NULL && to != NULL) {
+        len = from->len - from_pos < to->len - to_pos ? from->len - from_pos : to->len - to_pos;
+        memcpy(to->data + to_pos, from->data + from_pos, len);
+        from_pos += len;
+        to_pos += len;
+        if (from_pos == from->len) {
+            from = from->next;
+            from_pos = 0;
+        }
+
+        if (to_pos == to->len) {
+            to = to->next;
+            to_pos = 0;
+        }
+    }
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void HostMemoryManager::copy_to_buf(emac_mem_buf_t* to_buf, const void* ptr, uint32_t len)
+{
+    const uint8_t*  data = (const uint8_t*)ptr;
+    uint32_t        part;
+
+    for (host_buf_t* b = (host_buf_t*)to_buf; b != NULL && len > 0; b = b->next) {
+        part = b->len < len ? b->len : len;
+        memcpy(b->data, data, part);
+        data += part;
+        len -= part;
+    }
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+uint32_t HostMemoryManager::copy_from_buf(void* ptr, uint32_t len, const emac_mem_buf_t* from_buf) const
+{
+    uint8_t*    data = (uint8_t*)ptr;
+    uint32_t    copied = 0;
+    uint32_t    part;
+
+    for (const host_buf_t* b = (const host_buf_t*)from_buf; b != NULL && copied < len; b = b->next) {
+        part = b->len < len - copied ? b->len : len - copied;
+        memcpy(data + copied, b->data, part);
+        copied += part;
+    }
+
+    return copied;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void HostMemoryManager::cat(emac_mem_buf_t* to_buf, emac_mem_buf_t* cat_buf)
+{
+    host_buf_t*     b = (host_buf_t*)to_buf;
+
+    while (b->next != NULL)
+        b = b->next;
+    b->next = (host_buf_t*)cat_buf;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+emac_mem_buf_t* HostMemoryManager::get_next(const emac_mem_buf_t* buf) const
+{
+    return ((const host_buf_t*)buf)->next;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void* HostMemoryManager::get_ptr(const emac_mem_buf_t* buf) const
+{
+    return ((const host_buf_t*)buf)->data;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+uint32_t HostMemoryManager::get_len(const emac_mem_buf_t* buf) const
+{
+    return ((const host_buf_t*)buf)->len;
+}
+
+/**
+ * @brief
+ * @note    Only shrinks the buffer.
+ * @param
+ * @retval
+ */
+void HostMemoryManager::set_len(emac_mem_buf_t* buf, uint32_t len)
+{
+    host_buf_t*     b = (host_buf_t*)buf;
+
+    b->len = len < b->size ? len : b->size;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void HostMemoryManager::set_heap_limit(uint32_t bytes)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _heapLimit = bytes;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+uint32_t HostMemoryManager::pool_free(void) const
+{
+    return _poolFree;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+uint32_t HostMemoryManager::heap_used(void) const
+{
+    return _heapUsed;
+}
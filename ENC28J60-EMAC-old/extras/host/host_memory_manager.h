@@ -0,0 +1,74 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOST_MEMORY_MANAGER_H_
+#define HOST_MEMORY_MANAGER_H_
+
+#include "EMAC.h"
+
+/**
+ * \brief EMACMemoryManager on the host heap
+ *
+ * Pool buffers are chains of HOST_POOL_UNIT sized buffers, like the lwIP
+ * pbuf pool. The pool has a limited number of units, so the driver's
+ * fallbacks for an exhausted pool can be exercised.
+ */
+#define HOST_POOL_UNIT  512U
+
+class   HostMemoryManager :
+    public EMACMemoryManager
+{
+public:
+    HostMemoryManager(uint32_t pool_units = 16);
+
+    virtual emac_mem_buf_t*     alloc_heap(uint32_t size, uint32_t align);
+    virtual emac_mem_buf_t*     alloc_pool(uint32_t size, uint32_t align);
+    virtual uint32_t            get_pool_alloc_unit(uint32_t align) const;
+    virtual void                free(emac_mem_buf_t* buf);
+    virtual uint32_t            get_total_len(const emac_mem_buf_t* buf) const;
+    virtual void                copy(emac_mem_buf_t* to_buf, const emac_mem_buf_t* from_buf);
+    virtual void                copy_to_buf(emac_mem_buf_t* to_buf, const void* ptr, uint32_t len);
+    virtual uint32_t            copy_from_buf(void* ptr, uint32_t len, const emac_mem_buf_t* from_buf) const;
+    virtual void                cat(emac_mem_buf_t* to_buf, emac_mem_buf_t* cat_buf);
+    virtual emac_mem_buf_t*     get_next(const emac_mem_buf_t* buf) const;
+    virtual void*               get_ptr(const emac_mem_buf_t* buf) const;
+    virtual uint32_t            get_len(const emac_mem_buf_t* buf) const;
+    virtual void                set_len(emac_mem_buf_t* buf, uint32_t len);
+
+    /**
+     * \brief Limits the heap allocations. 0 makes every heap allocation fail.
+     *
+     * \param[in] bytes Heap bytes or UINT32_MAX for no limit
+     */
+    void                        set_heap_limit(uint32_t bytes);
+
+    uint32_t                    pool_free(void) const;
+    uint32_t                    heap_used(void) const;
+private:
+    typedef struct host_buf_t
+    {
+        struct host_buf_t*  next;
+        uint32_t            len;
+        uint32_t            size;
+        bool                pool;
+        uint8_t*            data;
+    } host_buf_t;
+
+    host_buf_t*                 _alloc(uint32_t size, bool pool);
+
+    std::mutex                  _mutex;
+    uint32_t                    _poolFree;
+    uint32_t                    _heapLimit;
+    uint32_t                    _heapUsed;
+};
+#endif /* HOST_MEMORY_MANAGER_H_ */
@@ -0,0 +1,19 @@
+/*
+ * Minimal Arduino API for building the driver on a Linux host.
+ */
+#ifndef HOST_ARDUINO_H_
+#define HOST_ARDUINO_H_
+
+#include "mbed.h"
+
+#define PIN_SPI_MOSI    11
+#define PIN_SPI_MISO    12
+#define PIN_SPI_SCK     13
+#define PIN_SPI_SS      10
+
+inline PinName digitalPinToPinName(int pin)
+{
+    return (PinName)pin;
+}
+
+#endif /* HOST_ARDUINO_H_ */
@@ -0,0 +1,66 @@
+/*
+ * Minimal Mbed OS API for building the driver on a Linux host.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOST_EMAC_H_
+#define HOST_EMAC_H_
+
+#include "mbed.h"
+
+typedef void emac_mem_buf_t;
+typedef mbed::Callback<void(emac_mem_buf_t*)>   emac_link_input_cb_t;
+typedef mbed::Callback<void(bool)>              emac_link_state_change_cb_t;
+
+class   EMACMemoryManager
+{
+public:
+    virtual ~EMACMemoryManager() { }
+    virtual emac_mem_buf_t*     alloc_heap(uint32_t size, uint32_t align) = 0;
+    virtual emac_mem_buf_t*     alloc_pool(uint32_t size, uint32_t align) = 0;
+    virtual uint32_t            get_pool_alloc_unit(uint32_t align) const = 0;
+    virtual void                free(emac_mem_buf_t* buf) = 0;
+    virtual uint32_t            get_total_len(const emac_mem_buf_t* buf) const = 0;
+    virtual void                copy(emac_mem_buf_t* to_buf, const emac_mem_buf_t* from_buf) = 0;
+    virtual void                copy_to_buf(emac_mem_buf_t* to_buf, const void* ptr, uint32_t len) = 0;
+    virtual uint32_t            copy_from_buf(void* ptr, uint32_t len, const emac_mem_buf_t* from_buf) const = 0;
+    virtual void                cat(emac_mem_buf_t* to_buf, emac_mem_buf_t* cat_buf) = 0;
+    virtual emac_mem_buf_t*     get_next(const emac_mem_buf_t* buf) const = 0;
+    virtual void*               get_ptr(const emac_mem_buf_t* buf) const = 0;
+    virtual uint32_t            get_len(const emac_mem_buf_t* buf) const = 0;
+    virtual void                set_len(emac_mem_buf_t* buf, uint32_t len) = 0;
+};
+
+class   EMAC
+{
+public:
+    virtual ~EMAC() { }
+    static EMAC&        get_default_instance(void);
+    virtual bool        power_up(void) = 0;
+    virtual void        power_down(void) = 0;
+    virtual uint32_t    get_mtu_size(void) const = 0;
+    virtual uint32_t    get_align_preference(void) const = 0;
+    virtual void        get_ifname(char* name, uint8_t size) const = 0;
+    virtual uint8_t     get_hwaddr_size(void) const = 0;
+    virtual bool        get_hwaddr(uint8_t* addr) const = 0;
+    virtual void        set_hwaddr(const uint8_t* addr) = 0;
+    virtual bool        link_out(emac_mem_buf_t* buf) = 0;
+    virtual void        set_link_input_cb(emac_link_input_cb_t input_cb) = 0;
+    virtual void        set_link_state_cb(emac_link_state_change_cb_t state_cb) = 0;
+    virtual void        add_multicast_group(const uint8_t* address) = 0;
+    virtual void        remove_multicast_group(const uint8_t* address) = 0;
+    virtual void        set_all_multicast(bool all) = 0;
+    virtual void        set_memory_manager(EMACMemoryManager& mem_mngr) = 0;
+};
+
+#endif /* HOST_EMAC_H_ */
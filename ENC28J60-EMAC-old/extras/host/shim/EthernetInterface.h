@@ -0,0 +1,20 @@
+/*
+ * Minimal Mbed OS API for building the driver on a Linux host.
+ */
+#ifndef HOST_ETHERNET_INTERFACE_H_
+#define HOST_ETHERNET_INTERFACE_H_
+
+#include "EMAC.h"
+
+class   EthInterface
+{
+public:
+    virtual ~EthInterface() { }
+    static EthInterface*    get_target_default_instance(void);
+};
+
+class   EthernetInterface :
+    public EthInterface
+{ };
+
+#endif /* HOST_ETHERNET_INTERFACE_H_ */
@@ -0,0 +1,432 @@
+/*
+ * Minimal Mbed OS API for building the driver on a Linux host.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOST_MBED_H_
+#define HOST_MBED_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+
+#include "mbed_atomic.h"
+
+typedef int PinName;
+#define NC  ((PinName)-1)
+
+#define DEVICE_SPI_ASYNCH       1
+#define SPI_EVENT_COMPLETE      (1 << 3)
+
+#define MBED_ASSERT(expr)
+#define MBED_WEAK   __attribute__((weak))
+
+#define osWaitForever           0xFFFFFFFFU
+#define osPriorityNormal        24
+#define osPriorityAboveNormal   32
+#define osPriorityHigh          40
+#define osPriorityRealtime      48
+typedef int osPriority_t;
+typedef std::thread::id osThreadId_t;
+
+/**
+ * \brief Microsecond ticker of the host steady clock
+ */
+inline uint32_t us_ticker_read(void)
+{
+    return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>
+        (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void wait_us(int us)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+namespace mbed
+{
+template<typename F>
+class   Callback;
+
+/**
+ * \brief Mbed Callback over std::function
+ */
+template<typename R, typename... A>
+class   Callback<R(A...)>
+{
+public:
+    Callback() { }
+    Callback(std::nullptr_t) { }
+    Callback(R (*f)(A...)) : _fn(f) { }
+    template<typename T, typename U>
+    Callback(U* obj, R (T::*method)(A...)) : _fn([obj, method](A... a) { return (obj->*method)(a...); }) { }
+    template<typename L, typename = decltype(std::declval<L>()(std::declval<A>()...))>
+    Callback(L l) : _fn(l) { }
+
+    R operator()(A... a) const { return _fn(a...); }
+    explicit operator bool() const { return (bool)_fn; }
+private:
+    std::function<R(A...)>  _fn;
+};
+
+template<typename T, typename U, typename R, typename... A>
+Callback<R(A...)> callback(U* obj, R (T::*method)(A...))
+{
+    return Callback<R(A...)>(obj, method);
+}
+
+template<typename R, typename... A>
+Callback<R(A...)> callback(R (*f)(A...))
+{
+    return Callback<R(A...)>(f);
+}
+
+typedef Callback<void(int)> event_callback_t;
+
+/**
+ * \brief SPI without a device. ENC28J60 is reached through ENC28J60Transport.
+ *
+ * The asynchronous transfers complete as set by set_async_mode, so the
+ * tests can time out ENC28J60SpiTransport.
+ */
+class   SPI
+{
+public:
+    enum    AsyncMode
+    {
+        ASYNC_COMPLETE,     // completes at once
+        ASYNC_NEVER,        // never completes, only aborted
+        ASYNC_LATE          // completes when it is aborted, like after a time out
+    };
+
+    SPI(PinName mosi, PinName miso, PinName sclk, PinName ssel = NC) : _async_mode(ASYNC_COMPLETE) { }
+    void    format(int bits, int mode = 0) { }
+    void    frequency(int hz = 1000000) { }
+    void    set_default_write_value(char value) { }
+    void    lock(void) { }
+    void    unlock(void) { }
+    int     write(int value) { return 0; }
+    int     write(const char* tx, int tx_len, char* rx, int rx_len)
+    {
+        if (rx != NULL)
+            memset(rx, 0, rx_len);
+        return tx_len > rx_len ? tx_len : rx_len;
+    }
+
+    template<typename T>
+    int     transfer(const T* tx, int tx_len, T* rx, int rx_len, const event_callback_t& cb, int event = SPI_EVENT_COMPLETE)
+    {
+        write((const char*)tx, tx_len, (char*)rx, rx_len);
+        _pending = cb;
+        if (_async_mode == ASYNC_COMPLETE)
+            _complete();
+        return 0;
+    }
+
+    void    abort_transfer(void)
+    {
+        if (_async_mode == ASYNC_LATE)
+            _complete();
+        _pending = nullptr;
+    }
+
+    void    set_async_mode(AsyncMode mode) { _async_mode = mode; }
+private:
+    void    _complete(void)
+    {
+        event_callback_t    cb = _pending;
+
+        _pending = nullptr;
+        if (cb)
+            cb(SPI_EVENT_COMPLETE);
+    }
+
+    AsyncMode           _async_mode;
+    event_callback_t    _pending;
+};
+
+class   DigitalOut
+{
+public:
+    DigitalOut(PinName pin, int value = 0) : _value(value) { }
+    DigitalOut& operator=(int value) { _value = value; return *this; }
+    operator    int() { return _value; }
+private:
+    int _value;
+};
+
+/**
+ * \brief Interrupt input. The host calls trigger() or fall_edge(pin) for a falling edge.
+ */
+class   InterruptIn
+{
+public:
+    InterruptIn(PinName pin) : _pin(pin), _enabled(false)
+    {
+        std::lock_guard<std::mutex> lock(_registry_mutex());
+        _registry().push_back(this);
+    }
+
+    ~InterruptIn()
+    {
+        std::lock_guard<std::mutex> lock(_registry_mutex());
+        _registry().remove(this);
+    }
+
+    void    fall(Callback<void()> func) { _fall = func; }
+    void    enable_irq(void) { _enabled = true; }
+    void    disable_irq(void) { _enabled = false; }
+    void    trigger(void)
+    {
+        if (_enabled && _fall)
+            _fall();
+    }
+
+    /**
+     * \brief Falling edge on every InterruptIn of the pin
+     */
+    static void fall_edge(PinName pin)
+    {
+        std::lock_guard<std::mutex> lock(_registry_mutex());
+        for (std::list<InterruptIn*>::iterator it = _registry().begin(); it != _registry().end(); ++it) {
+            if ((*it)->_pin == pin)
+                (*it)->trigger();
+        }
+    }
+private:
+    static std::list<InterruptIn*>& _registry(void)
+    {
+        static std::list<InterruptIn*>  registry;
+        return registry;
+    }
+
+    static std::mutex& _registry_mutex(void)
+    {
+        static std::mutex   mutex;
+        return mutex;
+    }
+
+    PinName             _pin;
+    Callback<void()>    _fall;
+    volatile bool       _enabled;
+};
+
+}
+
+namespace rtos
+{
+class   Mutex
+{
+public:
+    Mutex() { }
+    Mutex(const char* name) { }
+    void lock(void) { _mutex.lock(); }
+    bool trylock(void) { return _mutex.try_lock(); }
+    void unlock(void) { _mutex.unlock(); }
+private:
+    std::recursive_mutex    _mutex;
+};
+
+class   EventFlags
+{
+public:
+    EventFlags() : _flags(0) { }
+
+    uint32_t set(uint32_t flags)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _flags |= flags;
+        _cond.notify_all();
+        return _flags;
+    }
+
+    uint32_t clear(uint32_t flags = 0x7fffffff)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        uint32_t    prev = _flags;
+        _flags &= ~flags;
+        return prev;
+    }
+
+    uint32_t get(void) const { return _flags; }
+
+    template<typename D>
+    uint32_t wait_any_for(uint32_t flags, D rel_time, bool clear = true)
+    {
+        std::unique_lock<std::mutex>    lock(_mutex);
+        uint32_t    result;
+
+        _cond.wait_for(lock, rel_time, [&] { return (_flags & flags) != 0; });
+        result = _flags & flags;
+        if (clear)
+            _flags &= ~flags;
+        return result;
+    }
+
+    uint32_t wait_any(uint32_t flags, uint32_t ms = osWaitForever, bool clear = true)
+    {
+        return wait_any_for(flags, std::chrono::milliseconds(ms == osWaitForever ? 1000000000UL : ms), clear);
+    }
+private:
+    std::mutex              _mutex;
+    std::condition_variable _cond;
+    uint32_t                _flags;
+};
+
+class   Semaphore
+{
+public:
+    Semaphore(int32_t count = 0) : _count(count) { }
+
+    void release(void)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _count++;
+        _cond.notify_one();
+    }
+
+    void acquire(void)
+    {
+        std::unique_lock<std::mutex>    lock(_mutex);
+        _cond.wait(lock, [&] { return _count > 0; });
+        _count--;
+    }
+
+    bool try_acquire(void)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_count == 0)
+            return false;
+        _count--;
+        return true;
+    }
+
+    template<typename D>
+    bool try_acquire_for(D rel_time)
+    {
+        std::unique_lock<std::mutex>    lock(_mutex);
+        if (!_cond.wait_for(lock, rel_time, [&] { return _count > 0; }))
+            return false;
+        _count--;
+        return true;
+    }
+private:
+    std::mutex              _mutex;
+    std::condition_variable _cond;
+    int32_t                 _count;
+};
+
+namespace ThisThread
+{
+inline EventFlags*& current_flags(void)
+{
+    static thread_local EventFlags* flags = NULL;
+    return flags;
+}
+
+template<typename D>
+void sleep_for(D rel_time)
+{
+    std::this_thread::sleep_for(rel_time);
+}
+
+inline osThreadId_t get_id(void)
+{
+    return std::this_thread::get_id();
+}
+
+inline void yield(void)
+{
+    std::this_thread::yield();
+}
+
+template<typename D>
+uint32_t flags_wait_any_for(uint32_t flags, D rel_time, bool clear = true)
+{
+    if (current_flags() == NULL) {
+        sleep_for(rel_time);
+        return 0;
+    }
+
+    return current_flags()->wait_any_for(flags, rel_time, clear);
+}
+}
+
+/**
+ * \brief Thread over std::thread
+ *
+ * The thread is detached when the object is destroyed.
+ */
+class   Thread
+{
+public:
+    Thread(osPriority_t priority = osPriorityNormal, uint32_t stack_size = 0, unsigned char* stack_mem = NULL, const char* name = NULL) { }
+
+    ~Thread()
+    {
+        if (_thread.joinable())
+            _thread.detach();
+    }
+
+    int start(mbed::Callback<void()> task)
+    {
+        EventFlags*     flags = &_flags;
+        _thread = std::thread([flags, task] { ThisThread::current_flags() = flags; task(); });
+        return 0;
+    }
+
+    int join(void)
+    {
+        if (_thread.joinable())
+            _thread.join();
+        return 0;
+    }
+
+    uint32_t flags_set(uint32_t flags)
+    {
+        return _flags.set(flags);
+    }
+
+    osThreadId_t get_id(void) const
+    {
+        return _thread.get_id();
+    }
+private:
+    std::thread _thread;
+    EventFlags  _flags;
+};
+
+namespace Kernel
+{
+struct  Clock
+{
+    typedef std::chrono::milliseconds                   duration;
+    typedef std::chrono::time_point<Clock, duration>    time_point;
+    static time_point now(void)
+    {
+        return time_point(std::chrono::duration_cast<duration>(std::chrono::steady_clock::now().time_since_epoch()));
+    }
+};
+}
+}
+
+namespace ThisThread = rtos::ThisThread;
+
+#endif /* HOST_MBED_H_ */
@@ -0,0 +1,4 @@
+/*
+ * Minimal Mbed OS API for building the driver on a Linux host.
+ */
+#include "../mbed.h"
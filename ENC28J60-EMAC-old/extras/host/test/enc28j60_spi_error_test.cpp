@@ -0,0 +1,163 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * SPI error test.
+ *
+ * An asynchronous transfer which times out is aborted with only a part of
+ * the data transferred. The packet it belongs to must be dropped, not passed
+ * to the stack or transmitted with stale data, and the packets after it must
+ * pass as usual. A transfer which completes after the time out, before it
+ * is aborted, must not end the wait for the next transfer.
+ */
+#include <atomic>
+
+#include "enc28j60_emac.h"
+#include "enc28j60_sim.h"
+#include "host_memory_manager.h"
+
+#define TEST_INT_PIN        ((PinName)1)
+#define TEST_CS_PIN         ((PinName)2)
+#define TEST_FRAME_LEN      300U
+#define TEST_FRAMES         5U
+#define TEST_RX_FILL        0x33
+#define TEST_TX_FILL        0x44
+#define TEST_SETTLE_MS      std::chrono::milliseconds(20)
+#define TEST_WAIT_MS        std::chrono::milliseconds(200)
+
+/**
+ * @brief   Checks the payload of a frame.
+ * @note
+ * @param
+ * @retval  True if all bytes after the MAC addresses are fill
+ */
+static bool test_check(const uint8_t* frame, uint16_t len, uint8_t fill)
+{
+    for (uint16_t i = 12; i < len; i++) {
+        if (frame[i] != fill)
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief   Times out asynchronous transfers of ENC28J60SpiTransport.
+ * @note
+ * @param
+ * @retval  True if every transfer reported its own result
+ */
+static bool test_late_completion(void)
+{
+    mbed::SPI               spi(NC, NC, NC);
+    ENC28J60SpiTransport    transport(&spi, TEST_CS_PIN);
+    uint8_t                 data[ENC28J60_SPI_ASYNC_MIN_LEN];
+    bool                    late;
+    bool                    next;
+    bool                    done;
+
+    // Completes after the time out, before the abort
+    spi.set_async_mode(mbed::SPI::ASYNC_LATE);
+    transport.select();
+    late = transport.transfer(NULL, data, sizeof(data), false);
+    transport.deselect();
+
+    // Must time out, not take the completion of the previous transfer
+    spi.set_async_mode(mbed::SPI::ASYNC_NEVER);
+    transport.select();
+    next = transport.transfer(NULL, data, sizeof(data), false);
+    transport.deselect();
+
+    spi.set_async_mode(mbed::SPI::ASYNC_COMPLETE);
+    transport.select();
+    done = transport.transfer(NULL, data, sizeof(data), false);
+    transport.deselect();
+
+    if (late || next || !done) {
+        printf("late completion: late %d, next %d, done %d\n", late, next, done);
+        return false;
+    }
+
+    return true;
+}
+
+int main()
+{
+    static const uint8_t    mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    // The driver thread runs until the process exits, so nothing it uses is freed
+    ENC28J60Sim&            sim = *new ENC28J60Sim();
+    HostMemoryManager&      memory = *new HostMemoryManager(64);
+    ENC28J60_EMAC&          emac = *new ENC28J60_EMAC(new ENC28J60(&sim), TEST_INT_PIN);
+    std::atomic<uint32_t>   received(0);
+    std::atomic<uint32_t>   transmitted(0);
+    std::atomic<uint32_t>   bad(0);
+    uint8_t                 frame[TEST_FRAME_LEN];
+    enc28j60_stats_t        stats;
+    bool                    failed = !test_late_completion();
+
+    emac.set_link_input_cb([&](emac_mem_buf_t* buf) {
+            uint8_t data[TEST_FRAME_LEN];
+            uint32_t len = memory.copy_from_buf(data, sizeof(data), buf);
+
+            if (!test_check(data, len, TEST_RX_FILL))
+                bad++;
+            received++;
+            memory.free(buf);
+        });
+    sim.onTransmit([&](const uint8_t* data, uint16_t len) {
+            if (!test_check(data, len, TEST_TX_FILL))
+                bad++;
+            transmitted++;
+        });
+    sim.onInterrupt([] { mbed::InterruptIn::fall_edge(TEST_INT_PIN); });
+    emac.set_memory_manager(memory);
+    emac.power_up();
+    emac.set_hwaddr(mac);
+    std::this_thread::sleep_for(TEST_SETTLE_MS);
+
+    // The first received frame is dropped
+    memcpy(frame, mac, 6);
+    memset(&frame[6], TEST_RX_FILL, sizeof(frame) - 6);
+    sim.failTransfers(1);
+    for (uint8_t i = 0; i < TEST_FRAMES; i++)
+        sim.injectFrame(frame, sizeof(frame));
+    std::this_thread::sleep_for(TEST_WAIT_MS);
+
+    // The first transmitted frame is dropped
+    memset(frame, 0xFF, 6);
+    memset(&frame[6], TEST_TX_FILL, sizeof(frame) - 6);
+    sim.failTransfers(1);
+    for (uint8_t i = 0; i < TEST_FRAMES; i++) {
+        emac_mem_buf_t* buf = memory.alloc_heap(sizeof(frame), ENC28J60_BUFF_ALIGNMENT);
+
+        memory.copy_to_buf(buf, frame, sizeof(frame));
+        emac.link_out(buf);
+        std::this_thread::sleep_for(TEST_SETTLE_MS);
+    }
+    std::this_thread::sleep_for(TEST_WAIT_MS);
+
+    emac.get_stats(&stats);
+    failed |= received != TEST_FRAMES - 1 || transmitted != TEST_FRAMES - 1 || bad != 0
+          || stats.spi_errors != 2 || stats.rx_frames != TEST_FRAMES - 1 || stats.rx_resyncs != 0
+          || stats.tx_frames != TEST_FRAMES - 1 || stats.tx_drops != 1;
+
+    emac.power_down();
+    sim.onTransmit(NULL);
+    sim.onInterrupt(NULL);
+
+    printf("%s: received %u, transmitted %u, bad %u, spi_errors %u, rx_resyncs %u, tx_drops %u\n",
+           failed ? "FAILED" : "passed", (uint32_t)received, (uint32_t)transmitted, (uint32_t)bad,
+           stats.spi_errors, stats.rx_resyncs, stats.tx_drops);
+    return failed ? 1 : 0;
+}
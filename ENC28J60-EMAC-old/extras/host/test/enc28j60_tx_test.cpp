@@ -0,0 +1,105 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Transmit completion test.
+ *
+ * A packet queued behind the packet in transmission is started by the driver
+ * thread when the INT pin reports the completion. It must not lose the
+ * completion flags of the started packet if it completes before the
+ * interrupt flags are acknowledged. A lost completion shows up as a reset
+ * of the watchdog and a duplicate transmission.
+ */
+#include <atomic>
+
+#include "enc28j60_emac.h"
+#include "enc28j60_sim.h"
+#include "host_memory_manager.h"
+
+#define TEST_INT_PIN        ((PinName)1)
+#define TEST_FRAME_LEN      60U
+#define TEST_ROUNDS         20U
+#define TEST_SETTLE_MS      std::chrono::milliseconds(5)
+#define TEST_WAIT_MS        std::chrono::milliseconds(300)
+
+/**
+ * @brief   Queues a frame for transmission.
+ * @note
+ * @param
+ * @retval
+ */
+static bool test_send(ENC28J60_EMAC& emac, HostMemoryManager& memory, uint8_t seq)
+{
+    emac_mem_buf_t* buf = memory.alloc_heap(TEST_FRAME_LEN, ENC28J60_BUFF_ALIGNMENT);
+    uint8_t*        frame = (uint8_t*)memory.get_ptr(buf);
+
+    memset(frame, seq, TEST_FRAME_LEN);
+    memcpy(frame, "\x02\x00\x00\x00\x00\x02", 6);
+    return emac.link_out(buf);
+}
+
+int main()
+{
+    static const uint8_t    mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    // The driver thread runs until the process exits, so nothing it uses is freed
+    ENC28J60Sim&            sim = *new ENC28J60Sim();
+    HostMemoryManager&      memory = *new HostMemoryManager(64);
+    ENC28J60_EMAC&          emac = *new ENC28J60_EMAC(new ENC28J60(&sim), TEST_INT_PIN);
+    std::atomic<uint32_t>   transmitted(0);
+    enc28j60_stats_t        stats;
+    uint32_t                failures = 0;
+
+    sim.onTransmit([&](const uint8_t* data, uint16_t len) { transmitted++; });
+    sim.onInterrupt([] { mbed::InterruptIn::fall_edge(TEST_INT_PIN); });
+    emac.set_memory_manager(memory);
+    emac.power_up();
+    emac.set_hwaddr(mac);
+    std::this_thread::sleep_for(TEST_SETTLE_MS);
+
+    for (uint8_t round = 0; round < TEST_ROUNDS; round++) {
+        emac.reset_stats();
+        transmitted = 0;
+
+        // The second packet waits for the first one, which doesn't complete
+        sim.delayTransmit(0);
+        sim.stallTransmit(true);
+        test_send(emac, memory, 2 * round);
+        test_send(emac, memory, 2 * round + 1);
+        std::this_thread::sleep_for(TEST_SETTLE_MS);
+
+        // The second packet completes right after the driver thread starts it
+        sim.delayTransmit(1);
+        sim.stallTransmit(false);
+        std::this_thread::sleep_for(TEST_SETTLE_MS);
+
+        // The next packet is transmitted only if the completion wasn't lost
+        sim.delayTransmit(0);
+        test_send(emac, memory, 0xFF);
+        std::this_thread::sleep_for(TEST_WAIT_MS);
+
+        emac.get_stats(&stats);
+        if (transmitted != 3 || stats.tx_frames != 3 || stats.tx_resets != 0) {
+            printf("round %u: transmitted %u, tx_frames %u, tx_resets %u\n",
+                   round, (uint32_t)transmitted, stats.tx_frames, stats.tx_resets);
+            failures++;
+        }
+    }
+
+    emac.power_down();
+    sim.onTransmit(NULL);
+    sim.onInterrupt(NULL);
+
+    printf("%s: %u of %u rounds failed\n", failures ? "FAILED" : "passed", failures, TEST_ROUNDS);
+    return failures ? 1 : 0;
+}
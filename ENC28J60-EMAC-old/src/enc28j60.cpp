@@ -35,6 +35,8 @@ using namespace std::chrono_literals;
 /** Millisec timeout macros */
 #define RESET_TIME_OUT_MS       50ms
 #define REG_WRITE_TIME_OUT_MS   50ms
+#define DMA_TIME_OUT_US         500
+#define RX_BUSY_TIME_OUT_US     1500    // a maximum size frame at 10 Mbit/s
 #define PHY_RESET_TIME_OUT_MS   100ms
 #define INIT_FINISH_DELAY       2000ms
 
@@ -55,11 +57,11 @@ using namespace std::chrono_literals;
 #define DATA_FIFO_USED_SPACE_POS    0U
 #define STATUS_FIFO_USED_SPACE_POS  16U
 
-#define HW_CFG_REG_RX_FIFO_POS      10U
-#define HW_CFG_REG_RX_FIFO_SIZE_ALL 8U
-#define HW_CFG_REG_RX_FIFO_SIZE_MIN 2U          /*< Min Rx fifo size in KB */
-#define HW_CFG_REG_RX_FIFO_SIZE_MAX 6U          /*< Max Rx fifo size in KB */
-#define HW_CFG_REG_RX_FIFO_SIZE     5U          /*< Rx fifo size in KB */
+// The transmit buffer must hold a maximum size packet
+static_assert(ENC28J60_RX_BUF_MAX_KB * KBYTES_TO_BYTES_MULTIPLIER + TX_CTRL_LEN + MAX_FRAMELEN + TX_STAT_LEN <= ETXND_INI + 1,
+              "ENC28J60_RX_BUF_MAX_KB leaves no room for the transmit buffer");
+static_assert(ENC28J60_RX_BUF_MIN_KB * KBYTES_TO_BYTES_MULTIPLIER >= RX_NEXT_LEN + RX_STAT_LEN + MAX_FRAMELEN,
+              "ENC28J60_RX_BUF_MIN_KB is too small for a maximum size packet");
 
 /**
  * @brief
@@ -68,12 +70,17 @@ using namespace std::chrono_literals;
  * @retval
  */
 ENC28J60::ENC28J60(PinName mosi, PinName miso, PinName sclk, PinName cs) :
-    _spi(new SPI(mosi, miso, sclk)),
-    _cs(cs),
+    _transport(new ENC28J60SpiTransport(mosi, miso, sclk, cs)),
+    _transportOwned(true),
     _bank(0),
     _ready(true),
-    _next(ERXST_INI)
+    _fullDuplex(false),
+    _next(ERXST_INI),
+    _rxEnd(ERXND_INI),
+    _batchLen(0),
+    _batchDepth(0)
 {
+    memset(&_counters, 0, sizeof(_counters));
     init();
 }
 
@@ -84,15 +91,53 @@ ENC28J60::ENC28J60(PinName mosi, PinName miso, PinName sclk, PinName cs) :
  * @retval
  */
 ENC28J60::ENC28J60(mbed::SPI* spi, PinName cs) :
-    _spi(spi),
-    _cs(cs),
+    _transport(new ENC28J60SpiTransport(spi, cs)),
+    _transportOwned(true),
     _bank(0),
     _ready(true),
-    _next(ERXST_INI)
+    _fullDuplex(false),
+    _next(ERXST_INI),
+    _rxEnd(ERXND_INI),
+    _batchLen(0),
+    _batchDepth(0)
 {
+    memset(&_counters, 0, sizeof(_counters));
     init();
 }
 
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+ENC28J60::ENC28J60(ENC28J60Transport* transport) :
+    _transport(transport),
+    _transportOwned(false),
+    _bank(0),
+    _ready(true),
+    _fullDuplex(false),
+    _next(ERXST_INI),
+    _rxEnd(ERXND_INI),
+    _batchLen(0),
+    _batchDepth(0)
+{
+    memset(&_counters, 0, sizeof(_counters));
+    init();
+}
+
+/**
+ * @brief
+ * @note    A transport passed to the constructor belongs to the caller.
+ * @param
+ * @retval
+ */
+ENC28J60::~ENC28J60()
+{
+    if (_transportOwned)
+        delete _transport;
+}
+
 /**
  * @brief
  * @note
@@ -102,15 +147,22 @@ ENC28J60::ENC28J60(mbed::SPI* spi, PinName cs) :
 void ENC28J60::init()
 {
     // Initialize SPI interface
-    _cs = 1;
-    _spi->format(8, 0);         // 8bit, mode 0
-    _spi->frequency(20000000);  // 20MHz
+#if ENC28J60_SPI_CALIBRATION
+    _spiCal.frequency = _calibrateSpi();
+#else
+    _spiCal.frequency = ENC28J60_SPI_FREQ_MAX;
+    _spiCal.bytes = 0;
+    _spiCal.errors = 0;
+#endif
+    _transport->setFrequency(_spiCal.frequency);
 
     // Wait SPI to become stable
     ThisThread::sleep_for(RESET_TIME_OUT_MS);
 
     // Perform system reset
     writeOp(ENC28J60_SOFT_RESET, 0, ENC28J60_SOFT_RESET);
+    _bank = 0;
+    _invalidateShadow();
 
     // Check CLKRDY bit to see if reset is complete
     // while(!(readReg(ESTAT) & ESTAT_CLKRDY));
@@ -118,21 +170,33 @@ void ENC28J60::init()
     // Workaround: Just wait.
     ThisThread::sleep_for(RESET_TIME_OUT_MS);
 
+    // The configuration is written in one batch, the PHY writes flush it
+    beginBatch();
+
     // Set pointers to receive buffer boundaries
-    writeRegPair(ERXSTL, ERXST_INI);
-    writeRegPair(ERXNDL, ERXND_INI);
+    writeRegPair<ERXSTL>(ERXST_INI);
+    writeRegPair<ERXNDL>(_rxEnd);
 
     // Set receive pointer. Receive hardware will write data up to,
-    // but not including the memory pointed to by ERXRDPT
-    writeReg(ERXRDPTL, ERXST_INI);
+    // but not including the memory pointed to by ERXRDPT.
+    // ERXRDPTL takes effect when ERXRDPTH is written and the value
+    // must be odd (see freeRxBuffer). ERXND frees the whole buffer.
+    writeRegPair<ERXRDPTL>(_rxEnd);
 
     // All memory which is not used by the receive buffer is considered the transmission buffer.
     // No explicit action is required to initialize the transmission buffer.
     // TX buffer start.
-    writeRegPair(ETXSTL, ETXST_INI);
+    writeRegPair<ETXSTL>(_rxEnd + 1);
 
     // TX buffer end at end of ethernet buffer memory.
-    writeRegPair(ETXNDL, ETXND_INI);
+    writeRegPair<ETXNDL>(ETXND_INI);
+
+    // No packet is in transmission or waits for it
+    _txLen = 0;
+    _txQueuedLen = 0;
+    _txLoadStart = _rxEnd + 1;
+    _txRetries = 0;
+    _txResetPending = false;
 
     // However, he host controller should leave at least seven bytes between each
     // packet and the beginning of the receive buffer.
@@ -146,55 +210,54 @@ void ENC28J60::init()
     // 06 08 -- ff ff ff ff ff ff -> ip checksum for theses bytes=f7f9
     // in binary these poitions are:11 0000 0011 1111
     // This is hex 303F->EPMM0=0x3f,EPMM1=0x30
-    //TODO define specific pattern to receive dhcp-broadcast packages instead of setting ERFCON_BCEN!
-    writeReg(ERXFCON, ERXFCON_UCEN | ERXFCON_CRCEN | ERXFCON_PMEN | ERXFCON_BCEN);
-    writeRegPair(EPMM0, 0x303f);
-    writeRegPair(EPMCSL, 0xf7f9);
+    // ERFCON_BCEN is set to receive dhcp-broadcast packets too. Use setPatternFilter
+    // and disable ERXFCON_BCEN to receive only specific broadcast packets.
+    writeReg<ERXFCON>(ERXFCON_UCEN | ERXFCON_CRCEN | ERXFCON_PMEN | ERXFCON_BCEN);
+    writeRegPair<EPMM0>(0x303f);
+    writeRegPair<EPMCSL>(0xf7f9);
 
-    // Enable MAC receive and bring MAC out of reset (writes 0x00 to MACON2)
-    writeRegPair(MACON1, MACON1_MARXEN | MACON1_TXPAUS | MACON1_RXPAUS);
+    // Bring MAC out of reset
+    writeReg<MACON2>(0x00);
 
-    // Enable automatic padding to 60bytes and CRC operations
-    writeOp(ENC28J60_BIT_FIELD_SET, MACON3, MACON3_PADCFG0 | MACON3_TXCRCEN | MACON3_FRMLNEN);
-
-    // Set inter-frame gap (non-back-to-back)
-    writeRegPair(MAIPGL, 0x0C12);
-
-    // Set inter-frame gap (back-to-back)
-    writeReg(MABBIPG, 0x12);
+    // MACON1, MACON3, MACON4, the inter-packet gaps and the PHY duplex mode
+    setFullDuplex(ENC28J60_FULL_DUPLEX);
 
     // Set the maximum packet size which the controller will accept
     // Do not send packets longer than MAX_FRAMELEN:
-    writeRegPair(MAMXFLL, MAX_FRAMELEN);
+    writeRegPair<MAMXFLL>(MAX_FRAMELEN);
 
-    // No loopback of transmitted frames
+    // No loopback of transmitted frames in half duplex
     phyWrite(PHCON2, PHCON2_HDLDIS);
 
+    // Pause time of the transmitted pause frames
+    writeRegPair<EPAUSL>(ENC28J60_PAUSE_TIME);
+
     // Switch to bank 0
-    _setBank(ECON1);
+    _setBank<ERDPTL>();
 
-    // Enable interrutps
-    writeOp(ENC28J60_BIT_FIELD_SET, EIE, EIE_INTIE | EIE_PKTIE);
+    // Enable interrutps. EIE is written whole, so its shadow copy is known.
+    writeReg<EIE>(EIE_INTIE | EIE_PKTIE);
 
     // Enable packet reception
-    writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_RXEN);
+    bitFieldSet<ECON1>(ECON1_RXEN);
 
     // Configure leds
     phyWrite(PHLCON, 0x476);
+
+    endBatch();
 }
 
 /**
  * @brief
  * @note
  * @param
- * @retval
+ * @retval  ENC28J60_ERROR_TIMEOUT if the header couldn't be read, the
+ *          packet stays in the receive buffer
  */
 enc28j60_error_t ENC28J60::getPacketInfo(packet_t* packet)
 {
     enc28j60_error_t    ret;
-    uint8_t             nextPacketAddrL;
-    uint8_t             nextPacketAddrH;
-    uint8_t             status[RX_STAT_LEN];
+    uint8_t             header[RX_NEXT_LEN + RX_STAT_LEN];
 
     if (!_ready)
         return ENC28J60_ERROR_LASTPACKET;
@@ -203,7 +266,7 @@ enc28j60_error_t ENC28J60::getPacketInfo(packet_t* packet)
     // The Receive Packet Pending Interrupt Flag (EIR.PKTIF) does not reliably
     // report the status of pending packets. See Rev. B4 Silicon Errata point 6.
     // Workaround: Check EPKTCNT
-    if (readReg(EPKTCNT) == 0)
+    if (readReg<EPKTCNT>() == 0)
         return ENC28J60_ERROR_NOPACKET;
 
     _ready = false;
@@ -212,20 +275,32 @@ enc28j60_error_t ENC28J60::getPacketInfo(packet_t* packet)
     packet->addr = _next;
 
     // Program the receive buffer read pointer to point to this packet.
-    writeRegPair(ERDPTL, packet->addr);
+    writeRegPair<ERDPTL>(packet->addr);
+
+    // Read the next packet address and the packet status vector bytes
+    // (see datasheet page 43) in one transfer. The read pointer is left
+    // at the begin of the payload for readPacket. A failed transfer says
+    // nothing about the buffer, the packet is read again on the next call.
+    if (!readBuf(header, sizeof(header))) {
+        _ready = true;
+        return ENC28J60_ERROR_TIMEOUT;
+    }
 
-    // Read the next packet address
-    nextPacketAddrL = readOp(ENC28J60_READ_BUF_MEM, 0);
-    nextPacketAddrH = readOp(ENC28J60_READ_BUF_MEM, 0);
-    _next = (nextPacketAddrH << 8) | nextPacketAddrL;
+    packet->next = (header[1] << 8) | header[0];
+    memcpy(packet->status, &header[RX_NEXT_LEN], RX_STAT_LEN);
 
-    // Read the packet status vector bytes (see datasheet page 43)
-    for (uint8_t i = 0; i < RX_STAT_LEN; i++) {
-        status[i] = readOp(ENC28J60_READ_BUF_MEM, 0);
+    // Get payload length (see datasheet page 43)
+    packet->payload.len = (packet->status[1] << 8) | packet->status[0];
+
+    // The next packet pointer is even and in the receive buffer. A corrupted
+    // header (see Rev. B7 Silicon Errata point 11) loses the track of the packets.
+    if ((packet->next & 1) != 0 || (uint16_t) (packet->next - ERXST_INI) > (uint16_t) (_rxEnd - ERXST_INI)
+    ||  packet->payload.len < RX_CRC_LEN || packet->payload.len > MAX_FRAMELEN) {
+        resyncRxBuffer();
+        return ENC28J60_ERROR_NOPACKET;
     }
 
-    // Get payload length (see datasheet page 43)
-    packet->payload.len = (status[1] << 8) | status[0];
+    _next = packet->next;
 
     // Remove CRC bytes
     packet->payload.len -= RX_CRC_LEN;
@@ -235,10 +310,15 @@ enc28j60_error_t ENC28J60::getPacketInfo(packet_t* packet)
     // need to check this.
     // Bit 7 in byte 3 of receive status vectors indicates that the packet
     // had a valid CRC and no symbol errors.
-    if ((status[2] & (1 << 7)) != 0) {
+    if ((packet->status[2] & RSV2_RXOK) != 0) {
         ret = ENC28J60_ERROR_OK;
     }
     else {
+        if ((packet->status[2] & RSV2_CRCERROR) != 0)
+            _counters.rx_crc_errors++;
+        else
+            _counters.rx_symbol_errors++;
+
         // Drop faulty packet:
         // Move the receive read pointer to the begin of the next packet.
         // This frees the memory we just read out.
@@ -255,263 +335,1174 @@ void ENC28J60::abortPacketRead(uint16_t addr) {
 }
 
 /**
- * @brief
- * @note
+ * @brief
+ * @note
+ * @param
+ * @retval  ENC28J60_ERROR_TIMEOUT if the SPI transfer failed, the payload isn't valid
+ */
+enc28j60_error_t ENC28J60::readPacket(packet_t* packet)
+{
+    // Read operation in receive buffer wraps the read pointer automatically.
+    // getPacketInfo left the receive buffer read pointer (ERDPTL) at the begin
+    // of the payload (see datasheet page 43) and every call continues where
+    // the previous one ended. So a payload can be read in parts.
+    if (!readBuf(packet->payload.buf, packet->payload.len))
+        return ENC28J60_ERROR_TIMEOUT;
+
+    return ENC28J60_ERROR_OK;
+}
+
+/**
+ * @brief   Frees the memory occupied by last packet.
+ * @note    Programs the Receive Pointer (ERXRDPT)to point to the next
+ *          packet address. Receive hardware will write data up to,
+ *          but not including the memory pointed to by ERXRDPT.
+ * @param
+ * @retval
+ */
+void ENC28J60::freeRxBuffer(void)
+{
+    beginBatch();
+    _setRecvPointer();
+
+    // Decrement the packet counter to indicate we are done with this packet.
+    bitFieldSet<ECON2>(ECON2_PKTDEC);
+    endBatch();
+
+    _ready = true;  // ready for next packet
+}
+
+/**
+ * @brief   Resynchronizes the receive buffer in place.
+ * @note    Drops the buffered packets and continues at the receive write
+ *          pointer. Unlike init() it doesn't reset ENC28J60, so it takes
+ *          microseconds. The reception is stopped at a packet boundary
+ *          meanwhile.
+ * @param
+ * @retval
+ */
+void ENC28J60::resyncRxBuffer(void)
+{
+    bitFieldClr<ECON1>(ECON1_RXEN);
+    _waitRecvIdle();
+
+    _next = getWritePointer();
+    _setRecvPointer();
+    while (readReg<EPKTCNT>() != 0)
+        bitFieldSet<ECON2>(ECON2_PKTDEC);
+
+    _ready = true;
+    _counters.rx_resyncs++;
+
+    bitFieldSet<ECON1>(ECON1_RXEN);
+}
+
+/**
+ * @brief   Waits until the packet in reception is written.
+ * @note    Used with reception disabled.
+ * @param
+ * @retval
+ */
+void ENC28J60::_waitRecvIdle(void)
+{
+    uint16_t    timeout = 0;
+
+    while (readReg<ESTAT>() & ESTAT_RXBUSY) {
+        wait_us(10);
+        timeout++;
+        if (timeout > RX_BUSY_TIME_OUT_US / 10)
+            break;
+    }
+}
+
+/**
+ * @brief   Frees the receive buffer up to the next packet.
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60::_setRecvPointer(void)
+{
+    uint16_t    readPointer = _next - 1;
+
+    // Compensate for the errata rev B7, point 11:
+    // The receive hardware may corrupt the circular
+    // receive buffer (including the Next Packet Pointer
+    // and receive status vector fields) when an even value
+    // is programmed into the ERXRDPTH:ERXRDPTL registers.
+    // Workaround: Never write an even address!
+    // _next at the start of the buffer wraps readPointer out of it, to ERXND.
+    if ((uint16_t) (readPointer - ERXST_INI) > (uint16_t) (_rxEnd - ERXST_INI))
+        writeRegPair<ERXRDPTL>(_rxEnd);
+    else
+        writeRegPair<ERXRDPTL>(readPointer);
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+enc28j60_error_t ENC28J60::startPacketInTxBuffer(uint16_t payloadLen)
+{
+    uint8_t             controlByte = 0;
+    enc28j60_error_t    error;
+
+    error = _reserveTxBuffer(payloadLen);
+    if (error != ENC28J60_ERROR_OK)
+        return error;
+
+    setWritePrt(_txLoadStart, 0);
+
+    //_tx_packet.payload.len = data_len;
+    if (!writeBuf(&controlByte, sizeof(controlByte)))
+        return ENC28J60_ERROR_TIMEOUT;
+
+    return error;
+}
+
+/**
+ * @brief   Loads a packet in the transmit buffer in one SPI transaction.
+ * @note    The control byte and all segments are written with the chip
+ *          select held low. Long segments are transferred asynchronously
+ *          (see ENC28J60_SPI_ASYNC). More data can be appended with
+ *          loadDataInTxBuffer.
+ * @param   payloadLen packet length
+ * @param   segments parts of the packet in order
+ * @param   count number of segments
+ * @retval  ENC28J60_ERROR_BUSY if both packets in the transmit buffer are used,
+ *          ENC28J60_ERROR_TIMEOUT if the SPI transfer failed
+ */
+enc28j60_error_t ENC28J60::loadPacketInTxBuffer(uint16_t payloadLen, const payload_t* segments, uint8_t count)
+{
+    uint8_t             header[] = { ENC28J60_WRITE_BUF_MEM, 0 };   // command, control byte
+    enc28j60_error_t    error;
+    bool                done = true;
+
+    error = _reserveTxBuffer(payloadLen);
+    if (error != ENC28J60_ERROR_OK)
+        return error;
+
+    setWritePrt(_txLoadStart, 0);
+    _flushBatch();
+
+    _counters.spi_transactions++;
+    _counters.spi_bytes += sizeof(header);
+    _transport->select();
+    _transport->transfer(header, NULL, sizeof(header), true);
+    for (uint8_t i = 0; i < count && done; i++) {
+        if (segments[i].len > 0) {
+            done = _transport->transfer(segments[i].buf, NULL, segments[i].len, false);
+            _counters.spi_bytes += segments[i].len;
+        }
+    }
+
+    _transport->deselect();
+
+    // The packet isn't transmitted, its room is reserved again by the next load
+    if (!done) {
+        _counters.spi_errors++;
+        return ENC28J60_ERROR_TIMEOUT;
+    }
+
+    return ENC28J60_ERROR_OK;
+}
+
+/**
+ * @brief   Finds room for a packet in the transmit buffer.
+ * @note    Sets _txLoadStart.
+ * @param   payloadLen
+ * @retval  ENC28J60_ERROR_BUSY if both packets in the transmit buffer are used
+ */
+enc28j60_error_t ENC28J60::_reserveTxBuffer(uint16_t payloadLen)
+{
+    uint16_t    packetLen = TX_CTRL_LEN + payloadLen + TX_STAT_LEN;
+    uint16_t    inFlightEnd;
+
+    if (packetLen > ETXND_INI - _rxEnd)
+        return ENC28J60_ERROR_FIFOFULL;
+
+    // The transmit buffer holds two packets. One in transmission
+    // and one loaded after it, or before it if it doesn't fit after it.
+    if (_txQueuedLen != 0)
+        return ENC28J60_ERROR_BUSY;
+
+    if (_txLen == 0) {
+        _txLoadStart = _rxEnd + 1;
+    }
+    else {
+        inFlightEnd = _txStart + TX_CTRL_LEN + _txLen + TX_STAT_LEN;
+        if (inFlightEnd + packetLen - 1 <= ETXND_INI)
+            _txLoadStart = inFlightEnd;
+        else
+        if (_rxEnd + 1 + packetLen <= _txStart)
+            _txLoadStart = _rxEnd + 1;
+        else
+            return ENC28J60_ERROR_BUSY;
+    }
+
+    return ENC28J60_ERROR_OK;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+enc28j60_error_t ENC28J60::loadDataInTxBuffer(uint8_t* buf, uint16_t len)
+{
+    enc28j60_error_t    error = ENC28J60_ERROR_OK;
+
+    if (!writeBuf(buf, len))
+        error = ENC28J60_ERROR_TIMEOUT;
+
+    return error;
+}
+
+/**
+ * @brief   Writes data to the packet loaded in the transmit buffer.
+ * @note    Used to patch headers after the payload was loaded.
+ * @param   offset position in the payload
+ * @param   data
+ * @param   len
+ * @retval
+ */
+enc28j60_error_t ENC28J60::writeTxData(uint16_t offset, uint8_t* data, uint16_t len)
+{
+    setWritePrt(txDataAddr(offset), 0);
+    if (!writeBuf(data, len))
+        return ENC28J60_ERROR_TIMEOUT;
+
+    return ENC28J60_ERROR_OK;
+}
+
+/**
+ * @brief   Gets the buffer address of payload data of the packet loaded in the transmit buffer.
+ * @note
+ * @param   offset position in the payload
+ * @retval
+ */
+uint16_t ENC28J60::txDataAddr(uint16_t offset)
+{
+    return _txLoadStart + TX_CTRL_LEN + offset;
+}
+
+/**
+ * @brief   Gets the buffer address of payload data of a received packet.
+ * @note    Wraps at the end of the receive buffer.
+ * @param   packet
+ * @param   offset position in the payload
+ * @retval
+ */
+uint16_t ENC28J60::rxDataAddr(const packet_t* packet, uint16_t offset)
+{
+    uint32_t    addr = packet->addr + RX_NEXT_LEN + RX_STAT_LEN + offset;
+
+    if (addr > _rxEnd)
+        addr -= _rxEnd - ERXST_INI + 1;
+
+    return addr;
+}
+
+/**
+ * @brief   Computes a checksum with the DMA controller.
+ * @note    IP one's complement checksum of a part of the buffer memory
+ *          (see datasheet page 73). A part of the receive buffer can wrap.
+ *          The thread yields while the DMA runs instead of spinning.
+ * @param   start buffer address of the first byte
+ * @param   len number of bytes
+ * @param   checksum in network byte order as value, 0 for correct data
+ *          which include the checksum
+ * @retval
+ */
+enc28j60_error_t ENC28J60::dmaChecksum(uint16_t start, uint16_t len, uint16_t* checksum)
+{
+    uint32_t    end = start + len - 1;
+    uint32_t    startTime;
+
+    if (len == 0)
+        return ENC28J60_ERROR_PARAM;
+
+    if (start <= _rxEnd && end > _rxEnd)
+        end -= _rxEnd - ERXST_INI + 1;
+
+    beginBatch();
+    writeRegPair<EDMASTL>(start);
+    writeRegPair<EDMANDL>(end);
+    bitFieldSet<ECON1>(ECON1_CSUMEN);
+    bitFieldSet<ECON1>(ECON1_DMAST);
+    endBatch();
+
+    // wait until the DMA completes
+    startTime = us_ticker_read();
+    while (readReg<ECON1>() & ECON1_DMAST) {
+        if (us_ticker_read() - startTime > DMA_TIME_OUT_US) {
+            bitFieldClr<ECON1>(ECON1_DMAST | ECON1_CSUMEN);
+            return ENC28J60_ERROR_TIMEOUT;
+        }
+
+        ThisThread::yield();
+    }
+
+    bitFieldClr<ECON1>(ECON1_CSUMEN);
+    *checksum = readRegPair<EDMACSL>();
+    return ENC28J60_ERROR_OK;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+enc28j60_error_t ENC28J60::softReset(void)
+{
+    writeOp(ENC28J60_SOFT_RESET, 0, ENC28J60_SOFT_RESET);
+    _bank = 0;
+    _invalidateShadow();
+
+    ThisThread::sleep_for(1ms);
+    return ENC28J60_ERROR_OK;
+}
+
+/**
+ * @brief   Sets the partition of the buffer memory.
+ * @note    The receive buffer is 0 to size_kb * 1024 - 1, so ERXND is odd
+ *          (see errata) and ERXST stays 0. Pointers of packets in the buffers
+ *          would be invalid, so the partition is changed only if both are empty.
+ *          Reception is disabled at a packet boundary meanwhile, the write
+ *          pointer follows ERXST. A buffer found in use before is reported
+ *          without disabling the reception.
+ * @param   size_kb receive buffer size in kbytes
+ * @retval  ENC28J60_ERROR_BUSY if a buffer is in use
+ */
+enc28j60_error_t ENC28J60::setRxBufSize(uint32_t size_kb)
+{
+    uint16_t    rxEnd = size_kb * KBYTES_TO_BYTES_MULTIPLIER - 1;
+    bool        rxen;
+
+    if (size_kb < ENC28J60_RX_BUF_MIN_KB || size_kb > ENC28J60_RX_BUF_MAX_KB)
+        return ENC28J60_ERROR_PARAM;
+
+    if (rxEnd == _rxEnd)
+        return ENC28J60_ERROR_OK;
+
+    if (!_ready || _txLen != 0 || _txQueuedLen != 0)
+        return ENC28J60_ERROR_BUSY;
+
+    if (readReg<EPKTCNT>() != 0 || (readReg<ESTAT>() & ESTAT_RXBUSY) != 0)
+        return ENC28J60_ERROR_BUSY;
+
+    // A packet can still start before the reception is disabled
+    rxen = readRegBits<ECON1>(ECON1_RXEN) != 0;
+    bitFieldClr<ECON1>(ECON1_RXEN);
+    _waitRecvIdle();
+
+    if (readReg<EPKTCNT>() != 0) {
+        if (rxen)
+            bitFieldSet<ECON1>(ECON1_RXEN);
+        return ENC28J60_ERROR_BUSY;
+    }
+
+    _rxEnd = rxEnd;
+    _next = ERXST_INI;
+    _txLoadStart = _rxEnd + 1;
+
+    beginBatch();
+    writeRegPair<ERXNDL>(_rxEnd);
+    writeRegPair<ERXSTL>(ERXST_INI);
+    writeRegPair<ERXRDPTL>(_rxEnd);
+    if (rxen)
+        bitFieldSet<ECON1>(ECON1_RXEN);
+    endBatch();
+
+    return ENC28J60_ERROR_OK;
+}
+
+/**
+ * @brief   Gets the size of the receive buffer.
+ * @note
+ * @param
+ * @retval  size in bytes
+ */
+uint32_t ENC28J60::getRxBufSize(void)
+{
+    return _rxEnd - ERXST_INI + 1;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+enc28j60_error_t ENC28J60::resetPhy(void)
+{
+    enc28j60_error_t    error = ENC28J60_ERROR_OK;
+    uint16_t            phcon1 = 0;
+
+    // PRST is cleared by the PHY, the shadow copy doesn't know it
+    _phyShadowValid &= ~(1UL << PHCON1);
+    error = phyRead(PHCON1, &phcon1);
+    if (error)
+        return ENC28J60_ERROR_TIMEOUT;
+    error = phyWrite(PHCON1, (phcon1 | PHCON1_PRST));
+    if (error)
+        return ENC28J60_ERROR_TIMEOUT;
+    ThisThread::sleep_for(PHY_RESET_TIME_OUT_MS);
+
+    // The reset restored the defaults of all PHY registers
+    _phyShadowValid = 0;
+    error = phyRead(PHCON1, &phcon1);
+    if (error || (phcon1 & PHCON1_PRST) != 0) {
+        return ENC28J60_ERROR_TIMEOUT;
+    }
+
+    // The reset cleared the duplex mode of the PHY
+    if (_fullDuplex) {
+        return phyWrite(PHCON1, PHCON1_PDPXMD);
+    }
+
+    return ENC28J60_ERROR_OK;
+}
+
+/**
+ * @brief   Sets the duplex mode of the MAC and the PHY.
+ * @note    The PHY doesn't auto-negotiate. The link partner must be set
+ *          to the same mode, a switch port which auto-negotiates falls
+ *          back to half duplex. Reception is stopped while the MAC is
+ *          reconfigured (see datasheet section 10).
+ * @param   full true for full duplex, false for half duplex
+ * @retval
+ */
+void ENC28J60::setFullDuplex(bool full)
+{
+    bool    rxen = readRegBits<ECON1>(ECON1_RXEN) != 0;
+
+    beginBatch();
+
+    if (rxen) {
+        bitFieldClr<ECON1>(ECON1_RXEN);
+    }
+
+    // The bit field operations don't work on MAC registers.
+    // MACON3: automatic padding to 60 bytes and CRC operations.
+    if (full) {
+        // Pause frames are sent with setFlowControl and obeyed when received
+        writeReg<MACON1>(MACON1_MARXEN | MACON1_TXPAUS | MACON1_RXPAUS);
+        writeReg<MACON3>(MACON3_PADCFG0 | MACON3_TXCRCEN | MACON3_FRMLNEN | MACON3_FULDPX);
+        writeReg<MACON4>(0x00);
+        writeReg<MABBIPG>(0x15);        // back-to-back inter-packet gap
+        writeRegPair<MAIPGL>(0x0012);   // non-back-to-back inter-packet gap
+        phyWrite(PHCON1, PHCON1_PDPXMD);
+    }
+    else {
+        // DEFER waits for the medium to become idle for IEEE 802.3 conformance
+        writeReg<MACON1>(MACON1_MARXEN);
+        writeReg<MACON3>(MACON3_PADCFG0 | MACON3_TXCRCEN | MACON3_FRMLNEN);
+        writeReg<MACON4>(MACON4_DEFER);
+        writeReg<MABBIPG>(0x12);
+        writeRegPair<MAIPGL>(0x0C12);
+        phyWrite(PHCON1, 0x0000);
+    }
+
+    _fullDuplex = full;
+
+    if (rxen) {
+        bitFieldSet<ECON1>(ECON1_RXEN);
+    }
+
+    endBatch();
+}
+
+/**
+ * @brief   Checks the duplex mode.
+ * @note
+ * @param
+ * @retval  true if full duplex
+ */
+bool ENC28J60::isFullDuplex(void)
+{
+    return _fullDuplex;
+}
+
+/**
+ * @brief   Asks the link partner to pause or resume its transmission.
+ * @note    Full duplex sends pause frames with ENC28J60_PAUSE_TIME
+ *          periodically and a pause frame with 0 to resume. Half duplex
+ *          uses backpressure (see datasheet section 11).
+ * @param   pause true to pause, false to resume
+ * @retval
+ */
+void ENC28J60::setFlowControl(bool pause)
+{
+    uint8_t fcen;
+
+    if (_fullDuplex) {
+        fcen = pause ? EFLOCON_FCEN1 : (EFLOCON_FCEN1 | EFLOCON_FCEN0);
+    }
+    else {
+        fcen = pause ? EFLOCON_FCEN0 : 0x00;
+    }
+
+    writeReg<EFLOCON>(fcen);
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60::enableMacRecv(void)
+{
+    bitFieldSet<ECON1>(ECON1_RXEN);
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60::disableMacRecv(void)
+{
+    bitFieldClr<ECON1>(ECON1_RXEN);
+}
+
+/**
+ * @brief   Enables receive filters.
+ * @note
+ * @param   filters ERXFCON bits to set
+ * @retval
+ */
+void ENC28J60::enableRxFilter(uint8_t filters)
+{
+    bitFieldSet<ERXFCON>(filters);
+}
+
+/**
+ * @brief   Disables receive filters.
+ * @note
+ * @param   filters ERXFCON bits to clear
+ * @retval
+ */
+void ENC28J60::disableRxFilter(uint8_t filters)
+{
+    bitFieldClr<ERXFCON>(filters);
+}
+
+/**
+ * @brief   Writes the hash table of the hash table filter.
+ * @note    Takes effect with ERXFCON_HTEN enabled.
+ * @param   table 8 bytes, EHT0 to EHT7
+ * @retval
+ */
+void ENC28J60::writeHashTable(const uint8_t* table)
+{
+    beginBatch();
+    for (uint8_t i = 0; i < ENC28J60_HASH_TABLE_SIZE; i++) {
+        writeReg(EHT0 + i, table[i]);
+    }
+
+    endBatch();
+}
+
+/**
+ * @brief   Gets the position of an address in the hash table.
+ * @note    The position are bits 28:23 of the CRC-32 of the destination
+ *          address (see datasheet page 50). Bits 5:3 of the result select
+ *          the EHT register and bits 2:0 the bit in it.
+ * @param   addr 6 bytes hardware address
+ * @retval  Bit index 0 to 63
+ */
+uint8_t ENC28J60::hashTableIndex(const uint8_t* addr)
+{
+    uint32_t    crc = 0xFFFFFFFF;
+    uint8_t     data;
+    uint8_t     bit;
+
+    for (uint8_t i = 0; i < ENC28J60_HWADDR_SIZE; i++) {
+        data = addr[i];
+        for (uint8_t j = 0; j < 8; j++) {
+            bit = (crc >> 31) ^ (data & 0x01);
+            crc <<= 1;
+            data >>= 1;
+            if (bit)
+                crc ^= 0x04C11DB7;
+        }
+    }
+
+    return (crc >> 23) & 0x3F;
+}
+
+/**
+ * @brief   Programs the pattern match filter.
+ * @note    The filter has one pattern. It is matched at the begin of the packet.
+ *          The checksum of the bytes selected by the mask is computed as
+ *          if they were consecutive (see datasheet page 48).
+ *          Takes effect with ERXFCON_PMEN enabled.
+ * @param   pattern mask and data of the first ENC28J60_PATTERN_SIZE bytes of the packet
+ * @retval
+ */
+void ENC28J60::setPatternFilter(const enc28j60_pattern_t* pattern)
+{
+    uint32_t    sum = 0;
+    uint16_t    word = 0;
+    bool        odd = false;
+
+    for (uint8_t i = 0; i < ENC28J60_PATTERN_SIZE; i++) {
+        if ((pattern->mask & (1ULL << i)) == 0)
+            continue;
+
+        if (odd) {
+            sum += word | pattern->data[i];
+        }
+        else {
+            word = pattern->data[i] << 8;
+        }
+
+        odd = !odd;
+    }
+
+    if (odd)
+        sum += word;
+
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+
+    beginBatch();
+    for (uint8_t i = 0; i < ENC28J60_PATTERN_SIZE / 8; i++) {
+        writeReg(EPMM0 + i, (uint8_t) (pattern->mask >> (i * 8)));
+    }
+
+    writeRegPair<EPMCSL>(~sum & 0xFFFF);
+    writeRegPair<EPMOL>(0);
+    endBatch();
+}
+
+/**
+ * @brief   Sets a pattern to match broadcast packets.
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60::patternBroadcast(enc28j60_pattern_t* pattern)
+{
+    memset(pattern, 0, sizeof(enc28j60_pattern_t));
+    _patternSet(pattern, PATTERN_DST_POS, 0xFF, ENC28J60_HWADDR_SIZE);
+}
+
+/**
+ * @brief   Sets a pattern to match broadcast packets of an EtherType.
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60::patternEtherType(enc28j60_pattern_t* pattern, uint16_t type)
+{
+    patternBroadcast(pattern);
+    _patternSet(pattern, PATTERN_TYPE_POS, type >> 8, 1);
+    _patternSet(pattern, PATTERN_TYPE_POS + 1, type & 0xFF, 1);
+}
+
+/**
+ * @brief   Sets a pattern to match ARP requests.
+ * @note
+ * @param   ip 4 bytes target IP address or NULL for any
+ * @retval
+ */
+void ENC28J60::patternArp(enc28j60_pattern_t* pattern, const uint8_t* ip)
+{
+    patternEtherType(pattern, PATTERN_ETHERTYPE_ARP);
+    if (ip == NULL)
+        return;
+
+    for (uint8_t i = 0; i < 4; i++) {
+        _patternSet(pattern, PATTERN_ARP_TPA_POS + i, ip[i], 1);
+    }
+}
+
+/**
+ * @brief   Sets a pattern to match broadcast DHCP replies.
+ * @note    IPv4 packets with UDP protocol to the DHCP client port.
+ *          The position of the port expects IP header without options.
+ * @param
+ * @retval
+ */
+void ENC28J60::patternDhcpReply(enc28j60_pattern_t* pattern)
+{
+    patternEtherType(pattern, PATTERN_ETHERTYPE_IPV4);
+    _patternSet(pattern, PATTERN_IP_PROTO_POS, PATTERN_IP_PROTO_UDP, 1);
+    _patternSet(pattern, PATTERN_UDP_DST_POS, PATTERN_DHCP_CLIENT_PORT >> 8, 1);
+    _patternSet(pattern, PATTERN_UDP_DST_POS + 1, PATTERN_DHCP_CLIENT_PORT & 0xFF, 1);
+}
+
+/**
+ * @brief   Merges two patterns.
+ * @note    There is only one pattern in the hardware. The merged pattern
+ *          keeps the bytes both patterns match with the same value,
+ *          so it matches all packets any of them matches.
+ * @param   pattern pattern to merge into
+ * @param   other
+ * @retval
+ */
+void ENC28J60::patternMerge(enc28j60_pattern_t* pattern, const enc28j60_pattern_t* other)
+{
+    for (uint8_t i = 0; i < ENC28J60_PATTERN_SIZE; i++) {
+        if (pattern->data[i] != other->data[i])
+            pattern->mask &= ~(1ULL << i);
+    }
+
+    pattern->mask &= other->mask;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60::_patternSet(enc28j60_pattern_t* pattern, uint8_t pos, uint8_t value, uint8_t len)
+{
+    for (uint8_t i = pos; i < pos + len; i++) {
+        pattern->data[i] = value;
+        pattern->mask |= 1ULL << i;
+    }
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+enc28j60_error_t ENC28J60::readMacAddr(char* mac)
+{
+    if (!mac) {
+        return ENC28J60_ERROR_PARAM;
+    }
+
+    mac[0] = readReg<MAADR5>();
+    mac[1] = readReg<MAADR4>();
+    mac[2] = readReg<MAADR3>();
+    mac[3] = readReg<MAADR2>();
+    mac[4] = readReg<MAADR1>();
+    mac[5] = readReg<MAADR0>();
+
+    return ENC28J60_ERROR_OK;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+enc28j60_error_t ENC28J60::writeMacAddr(char* mac)
+{
+    if (!mac) {
+        return ENC28J60_ERROR_PARAM;
+    }
+
+    beginBatch();
+    writeReg<MAADR5>(mac[0]);
+    writeReg<MAADR4>(mac[1]);
+    writeReg<MAADR3>(mac[2]);
+    writeReg<MAADR2>(mac[3]);
+    writeReg<MAADR1>(mac[4]);
+    writeReg<MAADR0>(mac[5]);
+    endBatch();
+
+    return ENC28J60_ERROR_OK;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+enc28j60_error_t ENC28J60::setWritePrt(uint16_t position, uint16_t offset)
+{
+    uint32_t    start = position + offset > ETXND_INI ? position + offset - ETXND_INI + _rxEnd + 1 : position + offset;
+
+    writeRegPair<EWRPTL>(start);
+
+    return ENC28J60_ERROR_OK;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+enc28j60_error_t ENC28J60::transmitPacket(uint16_t payloadLen)
+{
+    if (_txLen == 0) {
+        _startTransmit(_txLoadStart, payloadLen);
+    }
+    else {
+        // Started by checkTransmit when the packet in transmission is done
+        _txQueuedStart = _txLoadStart;
+        _txQueuedLen = payloadLen;
+    }
+
+    return ENC28J60_ERROR_OK;
+}
+
+/**
+ * @brief   Checks if the packet in transmission is done.
+ * @note    Reads the interrupt flags.
  * @param
- * @retval
+ * @retval  ENC28J60_ERROR_NEXTPACKET if a transmission was aborted
  */
-void ENC28J60::readPacket(packet_t* packet)
+enc28j60_error_t ENC28J60::checkTransmit(void)
 {
-    // Read operation in receive buffer wraps the read pointer automatically.
-    // To utilize this feature we program the receive buffer read pointer (ERDPTL)
-    // to point to the begin of this packet (see datasheet page 43).
-    // Then we read the next packet pointer bytes + packet status vector bytes
-    // rather than calculating the payload position and advancing ERDPTL by software.
-    writeRegPair(ERDPTL, packet->addr);
-
-    // Advance the read pointer to the payload by reading bytes out of interest.
-    for (uint8_t i = 0; i < (RX_NEXT_LEN + RX_STAT_LEN); i++)
-        readOp(ENC28J60_READ_BUF_MEM, 0);
+    if (_txLen == 0)
+        return ENC28J60_ERROR_OK;
 
-    // The receive buffer read pointer is now pointing to the correct place.
-    // We can read packet payload bytes.
-    readBuf(packet->payload.buf, packet->payload.len);
+    return checkTransmit(getInterruptFlags());
 }
 
 /**
- * @brief   Frees the memory occupied by last packet.
- * @note    Programs the Receive Pointer (ERXRDPT)to point to the next
- *          packet address. Receive hardware will write data up to,
- *          but not including the memory pointed to by ERXRDPT.
- * @param
- * @retval
+ * @brief   Checks if the packet in transmission is done.
+ * @note    Completion is reported by EIR_TXIF or EIR_TXERIF.
+ *          Starts the queued packet if there is one. A transmission
+ *          not done in ENC28J60_TX_WATCHDOG_US is stalled: the transmit
+ *          logic is reset and the packet is retried. The bound is above
+ *          a maximum pause and the half duplex backoff. The stall is only
+ *          seen when this is called, with the INT pin in the worst case
+ *          on the RECEIVE_IRQ_FALLBACK_MS wake of the driver thread.
+ * @param   flags EIR register value
+ * @retval  ENC28J60_ERROR_NEXTPACKET if a transmission was aborted
  */
-void ENC28J60::freeRxBuffer(void)
+enc28j60_error_t ENC28J60::checkTransmit(uint8_t flags)
 {
-    // Compensate for the errata rev B7, point 11:
-    // The receive hardware may corrupt the circular
-    // receive buffer (including the Next Packet Pointer
-    // and receive status vector fields) when an even value
-    // is programmed into the ERXRDPTH:ERXRDPTL registers.
-    // Workaround: Never write an even address!
-    if ((_next - 1 < ERXST_INI) || (_next - 1 > ERXND_INI))
-        writeRegPair(ERXRDPTL, ERXND_INI);
-    else
-        writeRegPair(ERXRDPTL, _next - 1);
+    enc28j60_error_t    error = ENC28J60_ERROR_OK;
 
-    // Decrement the packet counter to indicate we are done with this packet.
-    writeOp(ENC28J60_BIT_FIELD_SET, ECON2, ECON2_PKTDEC);
+    if (_txLen == 0)
+        return ENC28J60_ERROR_OK;
 
-    _ready = true;  // ready for next packet
+    if ((flags & (EIR_TXIF | EIR_TXERIF)) == 0) {
+        if (us_ticker_read() - _txStartTime < ENC28J60_TX_WATCHDOG_US)
+            return ENC28J60_ERROR_OK;
+
+        _resetTransmit();
+        if (_txRetries < ENC28J60_TX_RETRIES) {
+            _txRetries++;
+            _startTransmit(_txStart, _txLen);
+            return ENC28J60_ERROR_OK;
+        }
+
+        error = ENC28J60_ERROR_NEXTPACKET;
+        _counters.tx_aborts++;
+    }
+    else {
+        clearInterruptFlags(EIR_TXIF | EIR_TXERIF);
+
+        // Chek whether the transmission was successfull
+        if ((flags & EIR_TXERIF) != 0 || (readReg<ESTAT>() & ESTAT_TXABRT) != 0) {
+            error = ENC28J60_ERROR_NEXTPACKET;
+            _counters.tx_aborts++;
+
+            // An abort may stall the transmit logic (see Rev. B7 Silicon Errata point 12)
+            _txResetPending = true;
+        }
+        else {
+            _counters.tx_frames++;
+            _counters.tx_bytes += _txLen;
+        }
+
+        _readTxStatus();
+    }
+
+    _txLen = 0;
+    _txRetries = 0;
+    if (_txQueuedLen != 0) {
+        _startTransmit(_txQueuedStart, _txQueuedLen);
+        _txQueuedLen = 0;
+    }
+
+    return error;
 }
 
 /**
- * @brief
- * @note
+ * @brief   Counts collisions from the transmit status vector.
+ * @note    The status vector is written after the transmitted packet. Read only
+ *          if no received packet is being read, because the read pointer is used.
  * @param
  * @retval
  */
-enc28j60_error_t ENC28J60::startPacketInTxBuffer(uint16_t payloadLen)
+void ENC28J60::_readTxStatus(void)
 {
-    uint8_t             controlByte = 0;
-    enc28j60_error_t    error = ENC28J60_ERROR_OK;
-    uint16_t            packetLen = TX_CTRL_LEN + payloadLen + TX_STAT_LEN;
-
-    if (packetLen > ETXND_INI - ETXST_INI) {
-        error = ENC28J60_ERROR_FIFOFULL;
-        return error;
-    }
+    uint8_t tsv[TX_STAT_LEN];
 
-    setWritePrt(ETXST_INI, 0);
+    if (!_ready)
+        return;
 
-    //_tx_packet.payload.len = data_len;
-    writeBuf(&controlByte, sizeof(controlByte));
-    return error;
+    writeRegPair<ERDPTL>(_txStart + _txLen + 1);
+    readBuf(tsv, TSV_COLLISION_POS + 2);
+    _counters.tx_collisions += tsv[TSV_COLLISION_POS] & TSV2_COLLISION_COUNT;
+    if ((tsv[TSV_COLLISION_POS + 1] & TSV3_LATE_COLLISION) != 0)
+        _counters.tx_late_collisions++;
 }
 
 /**
- * @brief
- * @note
- * @param
+ * @brief   Counts receive buffer overflows.
+ * @note    EIR_RXERIF is set when a packet was dropped for lack of space
+ *          in the receive buffer or because EPKTCNT is 255.
+ * @param   flags EIR register value
  * @retval
  */
-enc28j60_error_t ENC28J60::loadDataInTxBuffer(uint8_t* buf, uint16_t len)
+void ENC28J60::checkReceiveError(uint8_t flags)
 {
-    enc28j60_error_t    error = ENC28J60_ERROR_OK;
+    uint16_t    writePointer;
 
-    writeBuf(buf, len);
+    if ((flags & EIR_RXERIF) == 0)
+        return;
 
-    return error;
+    clearInterruptFlags(EIR_RXERIF);
+    _counters.rx_overflows++;
+
+    // With no packet buffered the next packet starts at the write pointer.
+    // The write pointer is read first, so a packet received meanwhile is counted.
+    writePointer = getWritePointer();
+    if (_ready && readReg<EPKTCNT>() == 0 && writePointer != _next)
+        resyncRxBuffer();
 }
 
 /**
- * @brief
- * @note
+ * @brief   Enables the PHY link change interrupt.
+ * @note    PHIE_PGEIE and PHIE_PLNKIE make the PHY set EIR_LINKIF
+ *          (see datasheet page 67). Pending PHY flags are cleared.
  * @param
  * @retval
  */
-enc28j60_error_t ENC28J60::softReset(void)
+void ENC28J60::enableLinkInterrupt(void)
 {
-    writeOp(ENC28J60_SOFT_RESET, 0, ENC28J60_SOFT_RESET);
+    uint16_t    phir;
 
-    ThisThread::sleep_for(1ms);
-    return ENC28J60_ERROR_OK;
+    phyWrite(PHIE, PHIE_PGEIE | PHIE_PLNKIE);
+    phyRead(PHIR, &phir);
+    enableInterrupts(ENC28J60_INTERRUPT_LINK_STATE_ENABLE);
 }
 
 /**
- * @brief
- * @note
- * @param
- * @retval
+ * @brief   Acknowledges the link change interrupt.
+ * @note    EIR_LINKIF is read-only. Reading PHIR clears it.
+ * @param   flags EIR register value
+ * @retval  true if the link changed
  */
-void ENC28J60::setRxBufSize(uint32_t size_kb)
+bool ENC28J60::checkLinkInterrupt(uint8_t flags)
 {
-    if (size_kb >= HW_CFG_REG_RX_FIFO_SIZE_MIN && size_kb <= HW_CFG_REG_RX_FIFO_SIZE_MAX) {
-        writeRegPair(ERXSTL, ERXST_INI);
+    uint16_t    phir;
 
-        // set receive pointer address
-        writeRegPair(ERXRDPTL, ERXST_INI);
+    if ((flags & EIR_LINKIF) == 0)
+        return false;
 
-        // RX end
-        writeRegPair(ERXNDL, 0x1FFF - (size_kb << HW_CFG_REG_RX_FIFO_POS));
-    }
+    phyRead(PHIR, &phir);
+    return true;
 }
 
 /**
- * @brief
+ * @brief   Gets the event counters.
  * @note
- * @param
+ * @param   counters counters copy
  * @retval
  */
-enc28j60_error_t ENC28J60::resetPhy(void)
+void ENC28J60::getCounters(enc28j60_counters_t* counters)
 {
-    enc28j60_error_t    error = ENC28J60_ERROR_OK;
-    uint16_t            phcon1 = 0;
-    error = phyRead(PHCON1, &phcon1);
-    if (error)
-        return ENC28J60_ERROR_TIMEOUT;
-    error = phyWrite(PHCON1, (phcon1 | PHCON1_PRST));
-    if (error)
-        return ENC28J60_ERROR_TIMEOUT;
-    ThisThread::sleep_for(PHY_RESET_TIME_OUT_MS);
-    error = phyRead(PHCON1, &phcon1);
-    if (error || (phcon1 & PHCON1_PRST) != 0) {
-        return ENC28J60_ERROR_TIMEOUT;
-    }
-
-    return ENC28J60_ERROR_OK;
+    *counters = _counters;
 }
 
 /**
- * @brief
+ * @brief   Clears the event counters.
  * @note
  * @param
  * @retval
  */
-void ENC28J60::enableMacRecv(void)
+void ENC28J60::resetCounters(void)
 {
-    writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_RXEN);
+    memset(&_counters, 0, sizeof(_counters));
 }
 
 /**
- * @brief
+ * @brief   Gets the result of the SPI clock calibration.
  * @note
- * @param
+ * @param   cal calibration result
  * @retval
  */
-void ENC28J60::disableMacRecv(void)
+void ENC28J60::getSpiCalibration(enc28j60_spi_cal_t* cal)
 {
-    writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_RXEN);
+    *cal = _spiCal;
 }
 
 /**
- * @brief
- * @note
+ * @brief   Finds the SPI clock frequency for the wiring.
+ * @note    Walks from ENC28J60_SPI_FREQ_MIN to ENC28J60_SPI_FREQ_MAX in steps of
+ *          ENC28J60_SPI_FREQ_STEP and verifies every frequency with _verifySpi,
+ *          up to the first one with errors. If all pass, ENC28J60_SPI_FREQ_MAX
+ *          is in the specification of the chip and is used. Otherwise the step below
+ *          the highest error free frequency is used as the safety margin.
+ *          A wrong transfer can write any register, so init resets ENC28J60 after it.
  * @param
- * @retval
+ * @retval  Frequency to use
  */
-enc28j60_error_t ENC28J60::readMacAddr(char* mac)
+uint32_t ENC28J60::_calibrateSpi(void)
 {
-    if (!mac) {
-        return ENC28J60_ERROR_PARAM;
+    uint32_t    freq;
+    uint32_t    good = 0;
+    uint32_t    errors = 0;
+
+    _spiCal.bytes = 0;
+    _spiCal.errors = 0;
+
+    // Start from a known state at the lowest frequency
+    _transport->setFrequency(ENC28J60_SPI_FREQ_MIN);
+    ThisThread::sleep_for(RESET_TIME_OUT_MS);
+    writeOp(ENC28J60_SOFT_RESET, 0, ENC28J60_SOFT_RESET);
+    _bank = 0;
+    _invalidateShadow();
+    ThisThread::sleep_for(RESET_TIME_OUT_MS);
+
+    for (freq = ENC28J60_SPI_FREQ_MIN; freq <= ENC28J60_SPI_FREQ_MAX; freq += ENC28J60_SPI_FREQ_STEP) {
+        _transport->setFrequency(freq);
+        errors = _verifySpi();
+        if (errors != 0)
+            break;
+        good = freq;
     }
 
-    _setBank(MAADR0);
+    if (errors == 0)
+        return good;
 
-    mac[0] = readReg(MAADR5);
-    mac[1] = readReg(MAADR4);
-    mac[2] = readReg(MAADR3);
-    mac[3] = readReg(MAADR2);
-    mac[4] = readReg(MAADR1);
-    mac[5] = readReg(MAADR0);
+    if (good >= ENC28J60_SPI_FREQ_MIN + ENC28J60_SPI_FREQ_STEP)
+        return good - ENC28J60_SPI_FREQ_STEP;
 
-    return ENC28J60_ERROR_OK;
+    // Not reliable even at the lowest frequency, the errors show it in the statistics
+    return ENC28J60_SPI_FREQ_MIN;
 }
 
 /**
- * @brief
- * @note
+ * @brief   Verifies the SPI transfers at the current frequency.
+ * @note    Writes patterns to the buffer memory at EWRPT, reads them back at ERDPT
+ *          and checks that EWRPT was incremented by the length. The receive
+ *          logic is off after the reset, so the buffer memory is free.
  * @param
- * @retval
+ * @retval  Bytes read back wrong
  */
-enc28j60_error_t ENC28J60::writeMacAddr(char* mac)
+uint32_t ENC28J60::_verifySpi(void)
 {
-    if (!mac) {
-        return ENC28J60_ERROR_PARAM;
-    }
+    uint8_t     pattern[ENC28J60_SPI_CAL_LEN];
+    uint8_t     data[ENC28J60_SPI_CAL_LEN];
+    uint32_t    errors = 0;
+
+    for (uint8_t round = 0; round < ENC28J60_SPI_CAL_ROUNDS; round++) {
+        for (uint16_t i = 0; i < ENC28J60_SPI_CAL_LEN; i++) {
+            switch (round & 0x03) {
+                case 0:
+                    pattern[i] = (i & 0x01) ? 0xAA : 0x55;  // alternating bits
+                    break;
+
+                case 1:
+                    pattern[i] = (i & 0x01) ? 0xFF : 0x00;  // all bits switching
+                    break;
+
+                case 2:
+                    pattern[i] = 1U << ((i + round) & 0x07);  // walking one
+                    break;
+
+                default:
+                    pattern[i] = (uint8_t) (i * 37U + round * 11U + 1U);
+                    break;
+            }
+        }
+
+        writeRegPair<EWRPTL>(0);
+        writeRegPair<ERDPTL>(0);
+        if (!writeBuf(pattern, ENC28J60_SPI_CAL_LEN) || !readBuf(data, ENC28J60_SPI_CAL_LEN)) {
+            // A failed transfer counts all bytes
+            errors += ENC28J60_SPI_CAL_LEN;
+        }
+        else {
+            for (uint16_t i = 0; i < ENC28J60_SPI_CAL_LEN; i++) {
+                if (data[i] != pattern[i])
+                    errors++;
+            }
+        }
 
-    _setBank(MAADR0);
+        if (readRegPair<EWRPTL>() != ENC28J60_SPI_CAL_LEN)
+            errors++;
 
-    writeReg(MAADR5, mac[0]);
-    writeReg(MAADR4, mac[1]);
-    writeReg(MAADR3, mac[2]);
-    writeReg(MAADR2, mac[3]);
-    writeReg(MAADR1, mac[4]);
-    writeReg(MAADR0, mac[5]);
+        _spiCal.bytes += ENC28J60_SPI_CAL_LEN;
+    }
 
-    return ENC28J60_ERROR_OK;
+    _spiCal.errors += errors;
+    return errors;
 }
 
 /**
- * @brief
+ * @brief   Checks if a packet waits for the packet in transmission.
  * @note
  * @param
  * @retval
  */
-enc28j60_error_t ENC28J60::setWritePrt(uint16_t position, uint16_t offset)
+bool ENC28J60::transmitPending(void)
 {
-    uint32_t    start = position + offset > ETXND_INI ? position + offset - ETXND_INI + ETXST_INI : position + offset;
-
-    writeRegPair(EWRPTL, start);
-
-    return ENC28J60_ERROR_OK;
+    return _txQueuedLen != 0;
 }
 
 /**
- * @brief
+ * @brief   Starts transmission of a packet loaded in the transmit buffer.
  * @note
- * @param
+ * @param   start address of the control byte
+ * @param   payloadLen
  * @retval
  */
-enc28j60_error_t ENC28J60::transmitPacket(uint16_t payloadLen)
+void ENC28J60::_startTransmit(uint16_t start, uint16_t payloadLen)
 {
+    beginBatch();
+    if (_txResetPending) {
+        _resetTransmit();
+        _txResetPending = false;
+    }
+
     // Set Transmit Buffer Start pointer
-    writeRegPair(ETXSTL, ETXST_INI);
+    writeRegPair<ETXSTL>(start);
 
-    // Set Transmit Buffer End pointer
-    writeRegPair(ETXNDL, ETXST_INI + TX_CTRL_LEN + payloadLen);
+    // Set Transmit Buffer End pointer to the last byte of the payload
+    writeRegPair<ETXNDL>(start + payloadLen);
 
     // Enable transmittion
-    writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
+    bitFieldSet<ECON1>(ECON1_TXRTS);
+    endBatch();
 
-    // Wait until transmission is completed
-    while ((readReg(ECON1) & ECON1_TXRTS) != 0) { }
+    _txStart = start;
+    _txLen = payloadLen;
+    _txStartTime = us_ticker_read();
+}
 
-    // Chek whether the transmission was successfull
-    if ((readReg(ESTAT) & ESTAT_TXABRT) == 0)
-        return ENC28J60_ERROR_OK;
-    else
-        return ENC28J60_ERROR_NEXTPACKET;
+/**
+ * @brief   Resets the transmit logic.
+ * @note    ECON1_TXRTS may stay set forever after a transmit abort
+ *          (see Rev. B7 Silicon Errata point 12). Setting and clearing
+ *          ECON1_TXRST recovers it without resetting ENC28J60.
+ * @param
+ * @retval
+ */
+void ENC28J60::_resetTransmit(void)
+{
+    beginBatch();
+    bitFieldClr<ECON1>(ECON1_TXRTS);
+    bitFieldSet<ECON1>(ECON1_TXRST);
+    bitFieldClr<ECON1>(ECON1_TXRST);
+    clearInterruptFlags(EIR_TXIF | EIR_TXERIF);
+    endBatch();
+    _counters.tx_resets++;
 }
 
 
@@ -527,11 +1518,11 @@ uint32_t ENC28J60::getRxBufFreeSpace(void)
     uint16_t    writePointer = getWritePointer();
     uint32_t    freeSpace = 0;
     if (writePointer > readPointer) {
-        freeSpace = (uint32_t) (ERXND_INI - ERXST_INI) - (writePointer - readPointer);
+        freeSpace = (uint32_t) (_rxEnd - ERXST_INI) - (writePointer - readPointer);
     }
     else
     if (writePointer == readPointer) {
-        freeSpace = (ERXND_INI - ERXST_INI);
+        freeSpace = (_rxEnd - ERXST_INI);
     }
     else {
         freeSpace = readPointer - writePointer - 1;
@@ -550,14 +1541,60 @@ enc28j60_error_t ENC28J60::setRxBufReadPtr(uint16_t position)
 {
     //
     // Wrap the start pointer of received data when greater than end of receive buffer
-    if (position > ERXND_INI)
-        position = ERXST_INI + (position - ERXND_INI - 1);
+    if (position > _rxEnd)
+        position = ERXST_INI + (position - _rxEnd - 1);
 
-    writeRegPair(ERDPTL, position);
+    writeRegPair<ERDPTL>(position);
 
     return ENC28J60_ERROR_OK;
 }
 
+/**
+ * @brief   Reads the interrupt flags.
+ * @note    EIR_PKTIF is not reliable (see Rev. B4 Silicon Errata point 6),
+ *          check EPKTCNT for pending packets.
+ * @param
+ * @retval  EIR register value
+ */
+uint8_t ENC28J60::getInterruptFlags(void)
+{
+    return readReg<EIR>();
+}
+
+/**
+ * @brief   Acknowledges interrupt flags.
+ * @note    EIR_PKTIF is read-only and is cleared by the hardware
+ *          when EPKTCNT reaches zero.
+ * @param   flags EIR bits to clear
+ * @retval
+ */
+void ENC28J60::clearInterruptFlags(uint8_t flags)
+{
+    bitFieldClr<EIR>(flags & ~EIR_PKTIF);
+}
+
+/**
+ * @brief   Enables interrupt sources.
+ * @note    Setting EIE_INTIE while a flag is pending drives INT low again.
+ * @param   sources combination of enc28j60_interrupt_source
+ * @retval
+ */
+void ENC28J60::enableInterrupts(uint8_t sources)
+{
+    bitFieldSet<EIE>(sources);
+}
+
+/**
+ * @brief   Disables interrupt sources.
+ * @note
+ * @param   sources combination of enc28j60_interrupt_source
+ * @retval
+ */
+void ENC28J60::disableInterrupts(uint8_t sources)
+{
+    bitFieldClr<EIE>(sources);
+}
+
 /**
  * @brief   Sets receive pointer.
  * @note    Receive hardware will write received data up to, but not including
@@ -567,7 +1604,7 @@ enc28j60_error_t ENC28J60::setRxBufReadPtr(uint16_t position)
  */
 uint16_t ENC28J60::getRecvPointer(void)
 {
-    return readRegPair(ERXRDPTL);
+    return readRegPair<ERXRDPTL>();
 }
 
 /**
@@ -580,13 +1617,13 @@ uint16_t ENC28J60::getRecvPointer(void)
  */
 uint16_t ENC28J60::getWritePointer(void)
 {
-    uint16_t    count_pre = readReg(EPKTCNT);
-    uint16_t    writePointer = readRegPair(ERXWRPTL);
-    uint16_t    count_post = readReg(EPKTCNT);
+    uint16_t    count_pre = readReg<EPKTCNT>();
+    uint16_t    writePointer = readRegPair<ERXWRPTL>();
+    uint16_t    count_post = readReg<EPKTCNT>();
     while (count_pre != count_post) {
         count_pre = count_post;
-        writePointer = readRegPair(ERXWRPTL);
-        count_post = readReg(EPKTCNT);
+        writePointer = readRegPair<ERXWRPTL>();
+        count_post = readReg<EPKTCNT>();
     }
 
     ENC28J60_DEBUG_PRINTF("[ENC28J60] rx_getWritePointer: %d", writePointer);
@@ -597,36 +1634,46 @@ uint16_t ENC28J60::getWritePointer(void)
  * @brief
  * @note
  * @param
- * @retval
+ * @retval  false if the SPI transfer failed, data isn't valid
  */
-void ENC28J60::readBuf(uint8_t* data, uint16_t len)
+bool ENC28J60::readBuf(uint8_t* data, uint16_t len)
 {
-    _read(ENC28J60_READ_BUF_MEM, data, len, false);
+    return _read(ENC28J60_READ_BUF_MEM, data, len, false);
 }
 
 /**
  * @brief
  * @note
  * @param
- * @retval
+ * @retval  false if the SPI transfer failed
  */
-void ENC28J60::writeBuf(uint8_t* data, uint16_t len)
+bool ENC28J60::writeBuf(uint8_t* data, uint16_t len)
 {
-    _write(ENC28J60_WRITE_BUF_MEM, data, len, false);
+    return _write(ENC28J60_WRITE_BUF_MEM, data, len, false);
 }
 
 /**
  * @brief
- * @note
+ * @note    A register changed only by the host is read from the shadow copy.
  * @param
  * @retval
  */
 uint8_t ENC28J60::readReg(uint8_t address)
 {
+    uint8_t hostBits = enc28j60HostBits(address);
+    uint8_t data;
+
+    if (hostBits == 0xFF && _shadowed(address))
+        return _shadow[_shadowBank(address)][address & ADDR_MASK];
+
     _setBank(address);
 
     // do the read
-    return readOp(ENC28J60_READ_CTRL_REG, address);
+    data = readOp(ENC28J60_READ_CTRL_REG, address);
+    if (hostBits != 0)
+        _setShadow(address, data);
+
+    return data;
 }
 
 /**
@@ -639,27 +1686,27 @@ uint16_t ENC28J60::readRegPair(uint8_t address)
 {
     uint16_t    temp;
 
-    _setBank(address);
-
-    // do the read
-    temp = (uint16_t) (readOp(ENC28J60_READ_CTRL_REG, address + 1)) << 8;
-    temp |= readOp(ENC28J60_READ_CTRL_REG, address);
+    temp = (uint16_t) (readReg(address + 1)) << 8;
+    temp |= readReg(address);
 
     return temp;
 }
 
 /**
  * @brief
- * @note
+ * @note    The write is skipped if the shadow copy has the value already.
  * @param
  * @retval
  */
 void ENC28J60::writeReg(uint8_t address, uint8_t data)
 {
+    if (!_shadowWrite(address, enc28j60HostBits(address), data))
+        return;
+
     _setBank(address);
 
     // do the write
-    writeOp(ENC28J60_WRITE_CTRL_REG, address, data);
+    _command(ENC28J60_WRITE_CTRL_REG | (address & ADDR_MASK), data);
 }
 
 /**
@@ -670,11 +1717,8 @@ void ENC28J60::writeReg(uint8_t address, uint8_t data)
  */
 void ENC28J60::writeRegPair(uint8_t address, uint16_t data)
 {
-    _setBank(address);
-
-    // do the write
-    writeOp(ENC28J60_WRITE_CTRL_REG, address, (data & 0xFF));
-    writeOp(ENC28J60_WRITE_CTRL_REG, address + 1, (data) >> 8);
+    writeReg(address, (data & 0xFF));
+    writeReg(address + 1, (data) >> 8);
 }
 
 /**
@@ -686,46 +1730,71 @@ void ENC28J60::writeRegPair(uint8_t address, uint16_t data)
 enc28j60_error_t ENC28J60::phyRead(uint8_t address, uint16_t* data)
 {
     uint8_t timeout = 0;
-    writeReg(MIREGADR, address);
-    writeReg(MICMD, MICMD_MIIRD);
+
+    if (_phyShadowed(address) && (_phyShadowValid & (1UL << address)) != 0) {
+        *data = _phyShadow[address];
+        return ENC28J60_ERROR_OK;
+    }
+
+    writeReg<MIREGADR>(address);
+    writeReg<MICMD>(MICMD_MIIRD);
 
     // wait until the PHY read completes
-    while (readReg(MISTAT) & MISTAT_BUSY) {
+    while (readReg<MISTAT>() & MISTAT_BUSY) {
         wait_us(15);
         timeout++;
         if (timeout > 10)
             return ENC28J60_ERROR_TIMEOUT;
     }   //and MIRDH
 
-    writeReg(MICMD, 0);
-    *data = (readReg(MIRDL) | readReg(MIRDH) << 8);
+    writeReg<MICMD>(0);
+    *data = (readReg<MIRDL>() | readReg<MIRDH>() << 8);
+    if (_phyShadowed(address)) {
+        _phyShadow[address] = *data;
+        _phyShadowValid |= 1UL << address;
+    }
+
     return ENC28J60_ERROR_OK;
 }
 
 /**
  * @brief
- * @note
+ * @note    The shadow takes the value when the write completed. After a
+ *          time out the register is unknown and read again by phyRead.
  * @param
  * @retval
  */
 enc28j60_error_t ENC28J60::phyWrite(uint8_t address, uint16_t data)
 {
     uint8_t timeout = 0;
+
+    if (_phyShadowed(address)) {
+        if ((_phyShadowValid & (1UL << address)) != 0 && _phyShadow[address] == data)
+            return ENC28J60_ERROR_OK;
+
+        _phyShadowValid &= ~(1UL << address);
+    }
+
     // set the PHY register address
 
-    writeReg(MIREGADR, address);
+    writeReg<MIREGADR>(address);
 
     // write the PHY data
-    writeRegPair(MIWRL, data);
+    writeRegPair<MIWRL>(data);
 
     // wait until the PHY write completes
-    while (readReg(MISTAT) & MISTAT_BUSY) {
+    while (readReg<MISTAT>() & MISTAT_BUSY) {
         wait_us(15);
         timeout++;
         if (timeout > 10)
             return ENC28J60_ERROR_TIMEOUT;
     }
 
+    if (_phyShadowed(address)) {
+        _phyShadow[address] = data;
+        _phyShadowValid |= 1UL << address;
+    }
+
     return ENC28J60_ERROR_OK;
 }
 
@@ -756,12 +1825,12 @@ uint8_t ENC28J60::readOp(uint8_t op, uint8_t address)
     // issue read command
 
     if (address & 0x80) {
-        _read((op | (address & ADDR_MASK)), &data[0], 2, false);
+        _read((op | (address & ADDR_MASK)), &data[0], 2, true);
         result = data[1];
         return result;
     }
     else {
-        _read((op | (address & ADDR_MASK)), &data[0], 1, false);
+        _read((op | (address & ADDR_MASK)), &data[0], 1, true);
     }
 
     result = data[0];
@@ -778,22 +1847,38 @@ void ENC28J60::writeOp(uint8_t op, uint8_t address, uint8_t data)
 {
     // issue write command
 
-    _write(op | (address & ADDR_MASK), &data, 1, false);
+    _write(op | (address & ADDR_MASK), &data, 1, true);
 }
 
 /**
  * @brief
- * @note
+ * @note    EIE to ECON1 are in all banks and need no switch.
  * @param
  * @retval
  */
 void ENC28J60::_setBank(uint8_t address)
 {
-    if ((address & BANK_MASK) != _bank) {
-        writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, (ECON1_BSEL1 | ECON1_BSEL0));
-        writeOp(ENC28J60_BIT_FIELD_SET, ECON1, (address & BANK_MASK) >> 5);
-        _bank = (address & BANK_MASK);
-    }
+    if ((address & ADDR_MASK) < (EIE & ADDR_MASK) && (address & BANK_MASK) != _bank)
+        _switchBank(address & BANK_MASK);
+}
+
+/**
+ * @brief   Switches the register bank.
+ * @note    Only the ECON1_BSEL bits which differ are cleared or set,
+ *          so a switch to a neighbouring bank takes one SPI transaction.
+ * @param   bank bank bits of a register address
+ * @retval
+ */
+void ENC28J60::_switchBank(uint8_t bank)
+{
+    uint8_t clr = (_bank & ~bank) >> 5;
+    uint8_t set = (bank & ~_bank) >> 5;
+
+    if (clr != 0)
+        bitFieldClr<ECON1>(clr);
+    if (set != 0)
+        bitFieldSet<ECON1>(set);
+    _bank = bank;
 }
 
 /**
@@ -802,93 +1887,124 @@ void ENC28J60::_setBank(uint8_t address)
  * @param
  * @retval
  */
-void ENC28J60::_read(uint8_t cmd, uint8_t* buf, uint16_t len, bool blocking)
+bool ENC28J60::_read(uint8_t cmd, uint8_t* buf, uint16_t len, bool blocking)
 {
-#ifndef ENC28J60_READWRITE
-    _SPIMutex.lock();
-    _cs = 0;
+    return _readwrite(cmd, buf, NULL, len, blocking);
+}
 
-    // issue read command
-    _spi->write((int)cmd);
-    while (len) {
-        len--;
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+bool ENC28J60::_write(uint8_t cmd, uint8_t* buf, uint16_t len, bool blocking)
+{
+    return _readwrite(cmd, NULL, buf, len, blocking);
+}
 
-        // read data
-        *buf = _spi->write(0x00);
-        buf++;
-    }
+/**
+ * @brief
+ * @note    A failed transfer is counted in spi_errors. Only the not blocking
+ *          transfers of the buffer memory can fail (see ENC28J60_SPI_ASYNC).
+ * @param
+ * @retval  false if the transfer failed, readbuf isn't valid
+ */
+bool ENC28J60::_readwrite(uint8_t cmd, uint8_t* readbuf, uint8_t* writebuf, uint16_t len, bool blocking)
+{
+    bool    done = true;
 
-    _cs = 1;
-    _SPIMutex.unlock();
-#else
-    uint8_t*    dummy = NULL;
-    _readwrite(cmd, buf, dummy, len, blocking);
-#endif
+    // queued writes go first
+    _flushBatch();
+
+    _counters.spi_transactions++;
+    _counters.spi_bytes += 1 + len;
+    _transport->select();
+
+    // issue command
+    _transport->transfer(&cmd, NULL, 1, true);
+
+    // transfer data in one burst
+    if (len > 0)
+        done = _transport->transfer(writebuf, readbuf, len, blocking);
+
+    _transport->deselect();
+    if (!done)
+        _counters.spi_errors++;
+
+    return done;
 }
 
 /**
- * @brief
+ * @brief   Starts a batch of register writes.
  * @note
  * @param
  * @retval
  */
-void ENC28J60::_write(uint8_t cmd, uint8_t* buf, uint16_t len, bool blocking)
+void ENC28J60::beginBatch(void)
 {
-#ifndef ENC28J60_READWRITE
-    _SPIMutex.lock();
-    _cs = 0;
+    _batchDepth++;
+}
 
-    // issue read command
-    _spi->write((int)cmd);
-    while (len) {
-        len--;
+/**
+ * @brief   Ends a batch of register writes.
+ * @note    The queued writes are sent when the outermost batch ends.
+ * @param
+ * @retval
+ */
+void ENC28J60::endBatch(void)
+{
+    if (_batchDepth > 0 && --_batchDepth == 0)
+        _flushBatch();
+}
 
-        // read data
-        _spi->write((int) *buf);
-        buf++;
+/**
+ * @brief   Sends a two byte command or queues it in the batch.
+ * @note
+ * @param   cmd opcode and register address
+ * @param   data
+ * @retval
+ */
+void ENC28J60::_command(uint8_t cmd, uint8_t data)
+{
+    if (_batchDepth == 0) {
+        _write(cmd, &data, 1, true);
+        return;
     }
 
-    _cs = 1;
-    _SPIMutex.unlock();
-#else
-    uint8_t*    dummy = NULL;
-    _readwrite(cmd, dummy, buf, len, blocking);
-#endif
-}
+    if (_batchLen == ENC28J60_WRITE_BATCH_SIZE)
+        _flushBatch();
 
-#ifdef ENC28J60_READWRITE
+    _batch[_batchLen][0] = cmd;
+    _batch[_batchLen][1] = data;
+    _batchLen++;
+}
 
 /**
- * @brief
+ * @brief   Sends the queued commands back to back.
  * @note
  * @param
  * @retval
  */
-void ENC28J60::_readwrite(uint8_t cmd, uint8_t* readbuf, uint8_t* writebuf, uint16_t len, bool blocking)
+void ENC28J60::_flushBatch(void)
 {
-    _SPIMutex.lock();
-    _cs = 0;
+    if (_batchLen == 0)
+        return;
 
-    // issue read command
-    _spi->write((int)cmd);
-    while (len) {
-        len--;
-
-        if (readbuf == NULL) {
-            _spi->write((int) *writebuf);
-            writebuf++;
-        }
-        else
-        if (writebuf == NULL) {
-            *readbuf = _spi->write(0x00);
-            readbuf++;
-        }
-        else {
-            break;
-        }
-    }
+    _counters.spi_transactions += _batchLen;
+    _counters.spi_bytes += 2 * _batchLen;
+    _transport->transferCommands(&_batch[0][0], _batchLen);
+    _batchLen = 0;
+}
 
-    _cs = 1;
-    _SPIMutex.unlock();
+/**
+ * @brief   Forgets the shadow copies of the registers.
+ * @note    After a reset the registers have their default values.
+ * @param
+ * @retval
+ */
+void ENC28J60::_invalidateShadow(void)
+{
+    memset(_shadowValid, 0, sizeof(_shadowValid));
+    _phyShadowValid = 0;
 }
-#endif
@@ -22,8 +22,7 @@
 
 #include "enc28j60_reg.h"
 #include "enc28j60_emac_config.h"
-
-#define ENC28J60_READWRITE  1
+#include "enc28j60_transport.h"
 
 /**
  * \brief Error code definitions
@@ -38,9 +37,53 @@ typedef struct
 typedef struct
 {
     uint16_t    addr;
+    uint16_t    next;                   /*!< next packet pointer */
+    uint8_t     status[RX_STAT_LEN];    /*!< receive status vector */
     payload_t   payload;
 } packet_t;
 
+/**
+ * \brief Event counters
+ *
+ */
+typedef struct
+{
+    uint32_t    rx_crc_errors;          /*!< packets dropped for CRC error */
+    uint32_t    rx_symbol_errors;       /*!< packets dropped for other receive errors */
+    uint32_t    rx_overflows;           /*!< EIR_RXERIF events, packets lost */
+    uint32_t    tx_frames;              /*!< packets transmitted */
+    uint32_t    tx_bytes;               /*!< payload bytes transmitted */
+    uint32_t    tx_aborts;              /*!< transmissions aborted */
+    uint32_t    tx_collisions;          /*!< collisions while transmitting */
+    uint32_t    tx_late_collisions;     /*!< transmissions with late collision */
+    uint32_t    tx_resets;              /*!< transmit logic resets of the watchdog */
+    uint32_t    rx_resyncs;             /*!< receive buffer resynchronizations */
+    uint32_t    spi_transactions;       /*!< chip select cycles */
+    uint32_t    spi_bytes;              /*!< bytes transferred, including commands */
+    uint32_t    spi_errors;             /*!< transfers failed by the transport, data dropped */
+} enc28j60_counters_t;
+
+/**
+ * \brief Result of the SPI clock calibration
+ *
+ */
+typedef struct
+{
+    uint32_t    frequency;              /*!< SPI clock frequency in use */
+    uint32_t    bytes;                  /*!< bytes verified by the calibration */
+    uint32_t    errors;                 /*!< bytes read back wrong */
+} enc28j60_spi_cal_t;
+
+/**
+ * \brief Pattern of the pattern match filter
+ *
+ */
+typedef struct
+{
+    uint64_t    mask;                           /*!< bit n selects data[n] */
+    uint8_t     data[ENC28J60_PATTERN_SIZE];    /*!< first bytes of the packet */
+} enc28j60_pattern_t;
+
 /**
  * \brief Error code definitions
  *
@@ -77,6 +120,53 @@ typedef enum
     ENC28J60_INTERRUPT_RX_ERROR_ENABLE  = EIE_RXERIE
 } enc28j60_interrupt_source;
 
+/**
+ * \brief Bits of a control register changed only by the host
+ *
+ * ENC28J60 keeps a shadow copy of these bits. A register changed only by
+ * the host (0xFF) is read from the shadow copy and a write of the value
+ * it already has is skipped, except ERXSTL, ERXSTH (ERXWRPT follows them)
+ * and ERXRDPTH (latches ERXRDPTL).
+ */
+constexpr uint8_t enc28j60HostBits(uint8_t address)
+{
+    return
+        (address == ECON1) ? (ECON1_TXRST | ECON1_RXRST | ECON1_CSUMEN | ECON1_RXEN | ECON1_BSEL1 | ECON1_BSEL0) :
+        (address == ECON2) ? (ECON2_AUTOINC | ECON2_PWRSV | ECON2_VRPS) :
+        (address == EIE) ? 0xFF :
+        (address >= ETXSTL && address <= ERXRDPTH) ? 0xFF :     // buffer boundaries, receive pointer
+        (address >= EDMASTL && address <= EDMADSTH) ? 0xFF :    // DMA pointers
+        (address >= EHT0 && address <= EPMCSH) ? 0xFF :         // hash table, pattern match filter
+        (address == EPMOL || address == EPMOH || address == ERXFCON) ? 0xFF :
+        (address >= MACON1 && address <= MAMXFLH) ? 0xFF :      // MAC configuration
+        (address == MIREGADR) ? 0xFF :
+        (address >= MAADR1 && address <= MAADR4) ? 0xFF :       // MAC address
+        (address == EREVID || address == ECOCON || address == EPAUSL || address == EPAUSH) ? 0xFF :
+        0x00;
+}
+
+/**
+ * \brief Control register resolved at compile time
+ *
+ * Address is a register define of enc28j60_reg.h. The bank, whether the register
+ * is in all banks (EIE to ECON1), whether a read returns a dummy byte first
+ * (MAC and MII registers) and the bits kept in the shadow copy are constants of the type.
+ */
+template<uint8_t Address>
+struct ENC28J60Reg
+{
+    static constexpr uint8_t    addr = Address & ADDR_MASK;
+    static constexpr uint8_t    bank = Address & BANK_MASK;
+    static constexpr bool       common = (Address & ADDR_MASK) >= (EIE & ADDR_MASK);
+    static constexpr bool       dummy = (Address & SPRD_MASK) != 0;
+    static constexpr uint8_t    host = enc28j60HostBits(Address);
+};
+
+/**
+ * \brief ENC28J60 chip access
+ *
+ * Not thread safe. ENC28J60_EMAC accesses it only from its driver thread.
+ */
 class   ENC28J60
 {
 public:
@@ -84,6 +174,13 @@ public:
 
     ENC28J60(mbed::SPI * spi, PinName cs);
 
+    ENC28J60(ENC28J60Transport* transport);
+
+    /**
+     * \brief Deletes the transport if it was created by the constructor.
+     */
+    ~ENC28J60();
+
     /**
      * \brief Initializes ENC28J60 Ethernet controller to a known default state:
      *          - device ID is checked
@@ -114,13 +211,25 @@ public:
     enc28j60_error_t    softReset(void);
 
     /**
-     * \brief Set maximum transition unit by Rx fifo size.
-     *        Note: The MTU will be smaller by 512 bytes,
-     *        because the status uses this fixed space.
+     * \brief Set the partition of the buffer memory.
+     *
+     * The receive buffer starts at 0, the transmit buffer takes the rest.
+     * Applied only if no packet is in the receive buffer or in the transmit
+     * buffer. Reception is disabled while the pointers are written.
      *
-     * \param[in] val Size of the fifo in kbytes
+     * \param[in] size_kb Size of the receive buffer in kbytes,
+     *                    ENC28J60_RX_BUF_MIN_KB to ENC28J60_RX_BUF_MAX_KB
+     *
+     * \return ENC28J60_ERROR_BUSY if a buffer is in use, try again later
      */
-    void                setRxBufSize(uint32_t val);
+    enc28j60_error_t    setRxBufSize(uint32_t size_kb);
+
+    /**
+     * \brief Get the size of the receive buffer.
+     *
+     * \return Size in bytes
+     */
+    uint32_t            getRxBufSize(void);
 
     /**
      * \brief Reset PHY
@@ -129,6 +238,32 @@ public:
      */
     enc28j60_error_t    resetPhy(void);
 
+    /**
+     * \brief Set the duplex mode of the MAC and the PHY.
+     *
+     * The PHY doesn't auto-negotiate, so the link partner must be set to
+     * the same mode. Half duplex works with hubs.
+     *
+     * \param[in] full True for full duplex, false for half duplex
+     */
+    void                setFullDuplex(bool full);
+
+    /**
+     * \brief Get the duplex mode set by setFullDuplex.
+     *
+     * \return True if full duplex
+     */
+    bool                isFullDuplex(void);
+
+    /**
+     * \brief Ask the link partner to pause or resume its transmission.
+     *
+     * Pause frames in full duplex, backpressure in half duplex.
+     *
+     * \param[in] pause True to pause, false to resume
+     */
+    void                setFlowControl(bool pause);
+
     /**
      * \brief Enable receive
      */
@@ -139,6 +274,54 @@ public:
      */
     void                disableMacRecv(void);
 
+    /**
+     * \brief Enable receive filters
+     *
+     * \param[in] filters ERXFCON bits to set
+     */
+    void                enableRxFilter(uint8_t filters);
+
+    /**
+     * \brief Disable receive filters
+     *
+     * \param[in] filters ERXFCON bits to clear
+     */
+    void                disableRxFilter(uint8_t filters);
+
+    /**
+     * \brief Write the hash table of the hash table filter.
+     *
+     * \param[in] table ENC28J60_HASH_TABLE_SIZE bytes, EHT0 first
+     */
+    void                writeHashTable(const uint8_t* table);
+
+    /**
+     * \brief Get the bit of an address in the hash table.
+     *
+     * \param[in] addr 6 bytes hardware address
+     *
+     * \return Bit index 0 to 63, index / 8 is the EHT register
+     */
+    static uint8_t      hashTableIndex(const uint8_t* addr);
+
+    /**
+     * \brief Program the pattern match filter.
+     *
+     * \param[in] pattern Pattern to match at the begin of the packet
+     */
+    void                setPatternFilter(const enc28j60_pattern_t* pattern);
+
+    /**
+     * \brief Patterns for the pattern match filter.
+     *        All match only broadcast packets. Use patternMerge to get
+     *        one pattern matching the packets of more patterns.
+     */
+    static void         patternBroadcast(enc28j60_pattern_t* pattern);
+    static void         patternEtherType(enc28j60_pattern_t* pattern, uint16_t type);
+    static void         patternArp(enc28j60_pattern_t* pattern, const uint8_t* ip);
+    static void         patternDhcpReply(enc28j60_pattern_t* pattern);
+    static void         patternMerge(enc28j60_pattern_t* pattern, const enc28j60_pattern_t* other);
+
     /**
      * \brief Read MAC address from EEPROM.
      *
@@ -176,7 +359,74 @@ public:
     enc28j60_error_t    setWritePrt(uint16_t position, uint16_t offset);
     enc28j60_error_t    startPacketInTxBuffer(uint16_t payloadLen);
     enc28j60_error_t    loadDataInTxBuffer(uint8_t* buf, uint16_t len);
+
+    /**
+     * \brief Load a packet in the transmit buffer in one SPI transaction.
+     *
+     * Replaces startPacketInTxBuffer and loadDataInTxBuffer for packets in parts.
+     *
+     * \param[in] payloadLen Packet length
+     * \param[in] segments Parts of the packet in order
+     * \param[in] count Number of segments
+     *
+     * \return error code /ref enc28j60_error_t
+     */
+    enc28j60_error_t    loadPacketInTxBuffer(uint16_t payloadLen, const payload_t* segments, uint8_t count);
+    enc28j60_error_t    writeTxData(uint16_t offset, uint8_t* data, uint16_t len);
+    uint16_t            txDataAddr(uint16_t offset);
+    uint16_t            rxDataAddr(const packet_t* packet, uint16_t offset);
+
+    /**
+     * \brief Compute IP checksum of a part of buffer memory with the DMA controller.
+     *
+     * \param[in] start Buffer address
+     * \param[in] len Number of bytes
+     * \param[out] checksum Checksum
+     *
+     * \return error code /ref enc28j60_error_t
+     */
+    enc28j60_error_t    dmaChecksum(uint16_t start, uint16_t len, uint16_t* checksum);
     enc28j60_error_t    transmitPacket(uint16_t payloadLen);
+    enc28j60_error_t    checkTransmit(void);
+    enc28j60_error_t    checkTransmit(uint8_t flags);
+    bool                transmitPending(void);
+    void                checkReceiveError(uint8_t flags);
+
+    /**
+     * \brief Enables the PHY link change interrupt.
+     *
+     * EIR_LINKIF is set on every link change. The INT pin is driven
+     * only with EIE_LINKIE enabled too.
+     */
+    void                enableLinkInterrupt(void);
+
+    /**
+     * \brief Acknowledges the link change interrupt.
+     *
+     * \param[in] flags EIR register value
+     *
+     * \return True if the link changed
+     */
+    bool                checkLinkInterrupt(uint8_t flags);
+
+    /**
+     * \brief Get the event counters.
+     *
+     * \param[out] counters Counters copy
+     */
+    void                getCounters(enc28j60_counters_t* counters);
+
+    /**
+     * \brief Clear the event counters.
+     */
+    void                resetCounters(void);
+
+    /**
+     * \brief Get the SPI clock frequency chosen at init and the calibration errors.
+     *
+     * \param[out] cal Calibration result
+     */
+    void                getSpiCalibration(enc28j60_spi_cal_t* cal);
 
     /**
      * \brief Get the free space of Rx fifo in bytes.
@@ -201,33 +451,256 @@ public:
     enc28j60_error_t    setRxBufReadPtr(uint16_t position);
     enc28j60_error_t    getPacketInfo(packet_t* packet);
     void                abortPacketRead(uint16_t addr);
-    void                readPacket(packet_t* packet);
+    enc28j60_error_t    readPacket(packet_t* packet);
     void                freeRxBuffer(void);
+
+    /**
+     * \brief Drops the buffered packets and continues at the receive write pointer.
+     *
+     * Used when the receive buffer lost the track of the packets. ENC28J60 isn't reset.
+     */
+    void                resyncRxBuffer(void);
+    uint8_t             getInterruptFlags(void);
+    void                clearInterruptFlags(uint8_t flags);
+    void                enableInterrupts(uint8_t sources);
+    void                disableInterrupts(uint8_t sources);
     uint16_t            getRecvPointer(void);
     uint16_t            getWritePointer(void);
-    void                readBuf(uint8_t* data, uint16_t len);
-    void                writeBuf(uint8_t* data, uint16_t len);
+    bool                readBuf(uint8_t* data, uint16_t len);
+    bool                writeBuf(uint8_t* data, uint16_t len);
     uint8_t             readReg(uint8_t address);
     uint16_t            readRegPair(uint8_t address);
     void                writeReg(uint8_t address, uint8_t data);
     void                writeRegPair(uint8_t address, uint16_t data);
+
+    /**
+     * \brief Register access with the address resolved at compile time.
+     *
+     * readReg<EPKTCNT>() does what readReg(EPKTCNT) does without the runtime
+     * checks of the address: the bank is switched only for a banked register
+     * and the dummy byte is read only for a MAC or MII register.
+     */
+    template<uint8_t Address> uint8_t   readReg(void);
+    template<uint8_t Address> uint16_t  readRegPair(void);
+    template<uint8_t Address> void      writeReg(uint8_t data);
+    template<uint8_t Address> void      writeRegPair(uint16_t data);
+
+    /**
+     * \brief Reads bits of a register, from the shadow copy if only the host changes them.
+     *
+     * \param[in] mask Bits to read
+     */
+    template<uint8_t Address> uint8_t   readRegBits(uint8_t mask);
+
+    /**
+     * \brief Sets or clears bits of an ETH register in one SPI transaction.
+     */
+    template<uint8_t Address> void      bitFieldSet(uint8_t bits);
+    template<uint8_t Address> void      bitFieldClr(uint8_t bits);
     enc28j60_error_t    phyRead(uint8_t address, uint16_t* data);
     enc28j60_error_t    phyWrite(uint8_t address, uint16_t data);
     bool                linkStatus(void);
     uint8_t             readOp(uint8_t op, uint8_t address);
     void                writeOp(uint8_t op, uint8_t address, uint8_t data);
+
+    /**
+     * \brief Queue the register writes until endBatch.
+     *
+     * The queued writes are sent back to back (see ENC28J60Transport::transferCommands)
+     * when the batch ends, the queue is full or anything is read. Batches can nest.
+     */
+    void                beginBatch(void);
+
+    /**
+     * \brief Send the register writes queued since beginBatch.
+     */
+    void                endBatch(void);
 private:
+    template<uint8_t Address> void      _setBank(void);
+    static constexpr uint8_t _shadowBank(uint8_t address)
+    {
+        return (address & ADDR_MASK) >= (EIE & ADDR_MASK) ? 0 : (address & BANK_MASK) >> 5;
+    }
+    static constexpr bool _phyShadowed(uint8_t address)
+    {
+        return address == PHCON1 || address == PHCON2 || address == PHIE || address == PHLCON;
+    }
+    bool        _shadowed(uint8_t address);
+    void        _setShadow(uint8_t address, uint8_t data);
+    bool        _shadowWrite(uint8_t address, uint8_t hostBits, uint8_t data);
+    bool        _shadowBits(uint8_t address, uint8_t hostBits, uint8_t bits, bool set);
+    void        _invalidateShadow(void);
+    void        _command(uint8_t cmd, uint8_t data);
+    void        _flushBatch(void);
     void        _setBank(uint8_t address);
-    void        _read(uint8_t cmd, uint8_t* buf, uint16_t len, bool blocking);
-    void        _write(uint8_t cmd, uint8_t* buf, uint16_t len, bool blocking);
-#ifdef ENC28J60_READWRITE
-    void        _readwrite(uint8_t cmd, uint8_t* readbuf, uint8_t* writebuf, uint16_t len, bool blocking);
-#endif
-    mbed::SPI*        _spi;
-    rtos::Mutex       _SPIMutex;
-    mbed::DigitalOut  _cs;
+    void        _switchBank(uint8_t bank);
+    static void _patternSet(enc28j60_pattern_t* pattern, uint8_t pos, uint8_t value, uint8_t len);
+    enc28j60_error_t _reserveTxBuffer(uint16_t payloadLen);
+    void        _startTransmit(uint16_t start, uint16_t payloadLen);
+    void        _resetTransmit(void);
+    void        _waitRecvIdle(void);
+    uint32_t    _calibrateSpi(void);
+    uint32_t    _verifySpi(void);
+    void        _setRecvPointer(void);
+    void        _readTxStatus(void);
+    bool        _read(uint8_t cmd, uint8_t* buf, uint16_t len, bool blocking);
+    bool        _write(uint8_t cmd, uint8_t* buf, uint16_t len, bool blocking);
+    bool        _readwrite(uint8_t cmd, uint8_t* readbuf, uint8_t* writebuf, uint16_t len, bool blocking);
+    ENC28J60Transport*  _transport;
+    bool        _transportOwned;    // created by the constructor
     uint8_t     _bank;
     bool        _ready;
+    bool        _fullDuplex;
     uint16_t    _next;
+    uint16_t    _rxEnd;             // ERXND, the transmit buffer starts after it
+    uint16_t    _txStart;           // packet in transmission
+    uint16_t    _txLen;             // its payload length, 0 if none
+    uint32_t    _txStartTime;       // us_ticker_read() at its start
+    uint8_t     _txRetries;         // its restarts by the watchdog
+    bool        _txResetPending;    // reset the transmit logic before the next start
+    uint16_t    _txQueuedStart;     // packet waiting for the transmission
+    uint16_t    _txQueuedLen;       // its payload length, 0 if none
+    uint16_t    _txLoadStart;       // packet being loaded
+    uint8_t     _shadow[4][32];     // registers by bank, EIE to ECON1 in bank 0
+    uint32_t    _shadowValid[4];    // bit n: _shadow[bank][n] is known
+    uint16_t    _phyShadow[PHLCON + 1];
+    uint32_t    _phyShadowValid;
+    uint8_t     _batch[ENC28J60_WRITE_BATCH_SIZE][2];
+    uint8_t     _batchLen;
+    uint8_t     _batchDepth;
+    enc28j60_counters_t _counters;
+    enc28j60_spi_cal_t  _spiCal;
 };
+
+inline bool ENC28J60::_shadowed(uint8_t address)
+{
+    return (_shadowValid[_shadowBank(address)] & (1UL << (address & ADDR_MASK))) != 0;
+}
+
+inline void ENC28J60::_setShadow(uint8_t address, uint8_t data)
+{
+    _shadow[_shadowBank(address)][address & ADDR_MASK] = data;
+    _shadowValid[_shadowBank(address)] |= 1UL << (address & ADDR_MASK);
+}
+
+/**
+ * Updates the shadow copy for a register write.
+ * Returns false if the register has the value already.
+ */
+inline bool ENC28J60::_shadowWrite(uint8_t address, uint8_t hostBits, uint8_t data)
+{
+    uint8_t&    value = _shadow[_shadowBank(address)][address & ADDR_MASK];
+
+    if (hostBits == 0)
+        return true;
+
+    if (hostBits == 0xFF && address != ERXSTL && address != ERXSTH && address != ERXRDPTH
+    &&  _shadowed(address) && value == data)
+        return false;
+
+    _setShadow(address, data);
+    return true;
+}
+
+/**
+ * Updates the shadow copy for a bit field operation.
+ * Returns false if the bits have the value already.
+ */
+inline bool ENC28J60::_shadowBits(uint8_t address, uint8_t hostBits, uint8_t bits, bool set)
+{
+    uint8_t&    value = _shadow[_shadowBank(address)][address & ADDR_MASK];
+
+    if (hostBits == 0 || !_shadowed(address))
+        return true;
+
+    if ((bits & ~hostBits) == 0 && (value & bits) == (set ? bits : 0))
+        return false;
+
+    value = set ? (value | bits) : (value & ~bits);
+    return true;
+}
+
+template<uint8_t Address>
+inline void ENC28J60::_setBank(void)
+{
+    if (!ENC28J60Reg<Address>::common && ENC28J60Reg<Address>::bank != _bank)
+        _switchBank(ENC28J60Reg<Address>::bank);
+}
+
+template<uint8_t Address>
+inline uint8_t ENC28J60::readReg(void)
+{
+    typedef ENC28J60Reg<Address>    reg;
+    uint8_t                         data[2];
+
+    if (reg::host == 0xFF && _shadowed(Address))
+        return _shadow[_shadowBank(Address)][reg::addr];
+
+    _setBank<Address>();
+    _read(ENC28J60_READ_CTRL_REG | reg::addr, data, reg::dummy ? 2 : 1, true);
+    if (reg::host != 0)
+        _setShadow(Address, data[reg::dummy ? 1 : 0]);
+
+    return data[reg::dummy ? 1 : 0];
+}
+
+template<uint8_t Address>
+inline uint16_t ENC28J60::readRegPair(void)
+{
+    static_assert(ENC28J60Reg<Address>::bank == ENC28J60Reg<Address + 1>::bank, "register pair spans banks");
+
+    uint16_t    high = readReg<Address + 1>();
+
+    return (high << 8) | readReg<Address>();
+}
+
+template<uint8_t Address>
+inline void ENC28J60::writeReg(uint8_t data)
+{
+    if (!_shadowWrite(Address, ENC28J60Reg<Address>::host, data))
+        return;
+
+    _setBank<Address>();
+    _command(ENC28J60_WRITE_CTRL_REG | ENC28J60Reg<Address>::addr, data);
+}
+
+template<uint8_t Address>
+inline void ENC28J60::writeRegPair(uint16_t data)
+{
+    writeReg<Address>(data & 0xFF);
+    writeReg<Address + 1>(data >> 8);
+}
+
+template<uint8_t Address>
+inline uint8_t ENC28J60::readRegBits(uint8_t mask)
+{
+    if ((mask & ~ENC28J60Reg<Address>::host) == 0 && _shadowed(Address))
+        return _shadow[_shadowBank(Address)][ENC28J60Reg<Address>::addr] & mask;
+
+    return readReg<Address>() & mask;
+}
+
+template<uint8_t Address>
+inline void ENC28J60::bitFieldSet(uint8_t bits)
+{
+    static_assert(!ENC28J60Reg<Address>::dummy, "bit field operations work only on ETH registers");
+
+    if (!_shadowBits(Address, ENC28J60Reg<Address>::host, bits, true))
+        return;
+
+    _setBank<Address>();
+    _command(ENC28J60_BIT_FIELD_SET | ENC28J60Reg<Address>::addr, bits);
+}
+
+template<uint8_t Address>
+inline void ENC28J60::bitFieldClr(uint8_t bits)
+{
+    static_assert(!ENC28J60Reg<Address>::dummy, "bit field operations work only on ETH registers");
+
+    if (!_shadowBits(Address, ENC28J60Reg<Address>::host, bits, false))
+        return;
+
+    _setBank<Address>();
+    _command(ENC28J60_BIT_FIELD_CLR | ENC28J60Reg<Address>::addr, bits);
+}
 #endif /* ENC28J60_ETH_DRV_H_ */
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2019 Tobias Jaster
+ *
+ * Modified by Zoltan Hudak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "enc28j60_cmd_queue.h"
+#include "mbed_atomic.h"
+
+#define CMD_QUEUE_MASK  (ENC28J60_CMD_QUEUE_SIZE - 1)
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+ENC28J60CommandQueue::ENC28J60CommandQueue() :
+    _pushPos(0),
+    _popPos(0)
+{
+    for (uint32_t i = 0; i < ENC28J60_CMD_QUEUE_SIZE; i++) {
+        _cells[i].seq = i;
+    }
+}
+
+/**
+ * @brief   Copies a command to the queue.
+ * @note    Safe to call from any number of threads, not from an interrupt.
+ * @param   cmd command
+ * @retval  false if the queue is full
+ */
+bool ENC28J60CommandQueue::push(const enc28j60_cmd_t* cmd)
+{
+    uint32_t    pos = core_util_atomic_load_u32(&_pushPos);
+    cell_t*     cell;
+    int32_t     diff;
+
+    while (true) {
+        cell = &_cells[pos & CMD_QUEUE_MASK];
+        diff = (int32_t) (core_util_atomic_load_u32(&cell->seq) - pos);
+        if (diff == 0) {
+            // On failure pos is updated to the current value
+            if (core_util_atomic_cas_u32(&_pushPos, &pos, pos + 1)) {
+                break;
+            }
+        }
+        else
+        if (diff < 0) {
+            return false;   // the cell still holds a command of the previous round
+        }
+        else {
+            pos = core_util_atomic_load_u32(&_pushPos);
+        }
+    }
+
+    cell->cmd = *cmd;
+    core_util_atomic_store_u32(&cell->seq, pos + 1);
+    return true;
+}
+
+/**
+ * @brief   Takes the oldest command from the queue.
+ * @note
+ * @param   cmd command
+ * @retval  false if the queue is empty
+ */
+bool ENC28J60CommandQueue::pop(enc28j60_cmd_t* cmd)
+{
+    uint32_t    pos = core_util_atomic_load_u32(&_popPos);
+    cell_t*     cell;
+    int32_t     diff;
+
+    while (true) {
+        cell = &_cells[pos & CMD_QUEUE_MASK];
+        diff = (int32_t) (core_util_atomic_load_u32(&cell->seq) - (pos + 1));
+        if (diff == 0) {
+            if (core_util_atomic_cas_u32(&_popPos, &pos, pos + 1)) {
+                break;
+            }
+        }
+        else
+        if (diff < 0) {
+            return false;   // not pushed yet
+        }
+        else {
+            pos = core_util_atomic_load_u32(&_popPos);
+        }
+    }
+
+    *cmd = cell->cmd;
+    core_util_atomic_store_u32(&cell->seq, pos + ENC28J60_CMD_QUEUE_SIZE);
+    return true;
+}
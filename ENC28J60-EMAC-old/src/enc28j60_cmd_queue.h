@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2019 Tobias Jaster
+ *
+ * Modified by Zoltan Hudak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ENC28J60_CMD_QUEUE_H_
+#define ENC28J60_CMD_QUEUE_H_
+
+#include <stdint.h>
+#include "mbed.h"
+#include "EMAC.h"
+#include "rtos.h"
+#include "enc28j60_emac_config.h"
+
+/**
+ * \brief Commands run by the driver thread
+ */
+typedef enum
+{
+    ENC28J60_CMD_LINK_OUT = 0,
+    ENC28J60_CMD_POWER_UP,
+    ENC28J60_CMD_POWER_DOWN,
+    ENC28J60_CMD_GET_HWADDR,
+    ENC28J60_CMD_SET_HWADDR,
+    ENC28J60_CMD_ADD_MULTICAST,
+    ENC28J60_CMD_REMOVE_MULTICAST,
+    ENC28J60_CMD_ALL_MULTICAST,
+    ENC28J60_CMD_BROADCAST_FILTER,
+    ENC28J60_CMD_FULL_DUPLEX,
+    ENC28J60_CMD_RX_BUF_SIZE,
+    ENC28J60_CMD_RX_BUDGET,
+    ENC28J60_CMD_GET_RX_DRAIN_STATS,
+    ENC28J60_CMD_RESET_RX_DRAIN_STATS,
+    ENC28J60_CMD_GET_RX_ALLOC_STATS,
+    ENC28J60_CMD_RESET_RX_ALLOC_STATS,
+    ENC28J60_CMD_GET_STATS,
+    ENC28J60_CMD_RESET_STATS,
+    ENC28J60_CMD_STOP
+} enc28j60_cmd_type_t;
+
+/**
+ * \brief Command posted to the driver thread
+ */
+typedef struct
+{
+    uint8_t             type;       /*!< enc28j60_cmd_type_t */
+    emac_mem_buf_t*     buf;        /*!< packet of ENC28J60_CMD_LINK_OUT */
+    void*               arg;        /*!< argument or result buffer of a control command */
+    uint32_t            value;      /*!< numeric argument of a control command */
+    bool*               result;     /*!< return value of a control command */
+    rtos::Semaphore*    done;       /*!< released when a control command has run, NULL for link out */
+} enc28j60_cmd_t;
+
+/**
+ * \brief Bounded lock-free queue of commands
+ *
+ * Any thread may push, the driver thread pops. Each cell has a sequence number:
+ * it is free for the push of position pos if the number is pos, and it holds
+ * the command of position pos if the number is pos + 1. Positions are claimed
+ * with compare and swap, so no lock is taken and a full queue is reported at once.
+ */
+class   ENC28J60CommandQueue
+{
+public:
+    ENC28J60CommandQueue();
+
+    /**
+     * \brief Copies a command to the queue.
+     *
+     * \param[in] cmd Command
+     * \return False if the queue is full
+     */
+    bool    push(const enc28j60_cmd_t* cmd);
+
+    /**
+     * \brief Takes the oldest command from the queue.
+     *
+     * \param[out] cmd Command
+     * \return False if the queue is empty
+     */
+    bool    pop(enc28j60_cmd_t* cmd);
+private:
+    typedef struct
+    {
+        volatile uint32_t   seq;
+        enc28j60_cmd_t      cmd;
+    } cell_t;
+
+    cell_t              _cells[ENC28J60_CMD_QUEUE_SIZE];
+    volatile uint32_t   _pushPos;
+    volatile uint32_t   _popPos;
+};
+
+static_assert((ENC28J60_CMD_QUEUE_SIZE & (ENC28J60_CMD_QUEUE_SIZE - 1)) == 0, "ENC28J60_CMD_QUEUE_SIZE must be a power of 2");
+#endif /* ENC28J60_CMD_QUEUE_H_ */
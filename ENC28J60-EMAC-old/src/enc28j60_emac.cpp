@@ -20,7 +20,7 @@
 #include "mbed_wait_api.h"
 #include "mbed_assert.h"
 #include "netsocket/nsapi_types.h"
-#include "mbed_shared_queues.h"
+#include "mbed_atomic.h"
 #include "EthernetInterface.h"
 
 #include <Arduino.h> // for digitalPinToPinName
@@ -33,11 +33,39 @@
 #ifndef ENC28J60_CS
 #define ENC28J60_CS digitalPinToPinName(PIN_SPI_SS)
 #endif
+#ifndef ENC28J60_INT
+#define ENC28J60_INT NC
+#endif
 
 using namespace mbed;
 using namespace rtos;
 using namespace std::chrono_literals;
 
+/** Header positions for the checksums */
+#define ETH_HDR_LEN         14U
+#define ETH_TYPE_POS        12U
+#define ETH_TYPE_IPV4       0x0800U
+#define IP_HDR_MIN_LEN      20U
+#define IP_TOTAL_LEN_POS    2U
+#define IP_FRAG_POS         6U
+#define IP_PROTO_POS        9U
+#define IP_CHECKSUM_POS     10U
+#define IP_SRC_POS          12U
+#define IP_PROTO_TCP        6U
+#define IP_PROTO_UDP        17U
+#define TCP_CHECKSUM_POS    16U
+#define UDP_CHECKSUM_POS    6U
+
+#if ENC28J60_TX_CHECKSUM_OFFLOAD && ((defined(CHECKSUM_GEN_IP) && CHECKSUM_GEN_IP) || (defined(CHECKSUM_GEN_TCP) && CHECKSUM_GEN_TCP) || (defined(CHECKSUM_GEN_UDP) && CHECKSUM_GEN_UDP))
+#error "ENC28J60_TX_CHECKSUM_OFFLOAD needs the checksum generation of the stack off"
+#endif
+
+#if ENC28J60_RX_CHECKSUM_CHECK
+static_assert(ENC28J60_RX_HEADER_LEN >= ETH_HDR_LEN + IP_HDR_MIN_LEN + TCP_CHECKSUM_POS + 2, "ENC28J60_RX_HEADER_LEN is too short for the checksum check");
+#endif
+
+volatile uint32_t ENC28J60_EMAC::_instances = 0;
+
 /**
  * @brief
  * @note
@@ -45,16 +73,114 @@ using namespace std::chrono_literals;
  * @retval
  */
 ENC28J60_EMAC::ENC28J60_EMAC() :
-    _enc28j60(new ENC28J60(ENC28J60_MOSI, ENC28J60_MISO, ENC28J60_SCK, ENC28J60_CS)),
+    ENC28J60_EMAC(new ENC28J60(ENC28J60_MOSI, ENC28J60_MISO, ENC28J60_SCK, ENC28J60_CS), ENC28J60_INT)
+{ }
+
+/**
+ * @brief
+ * @note    Used to run more ENC28J60 chips, each on its own SPI bus.
+ *          Every instance has its own driver thread.
+ * @param   mosi, miso, sclk SPI pins
+ * @param   cs pin wired to the CS pin of ENC28J60
+ * @param   int_pin pin wired to the INT pin of ENC28J60 or NC to poll
+ * @retval
+ */
+ENC28J60_EMAC::ENC28J60_EMAC(PinName mosi, PinName miso, PinName sclk, PinName cs, PinName int_pin) :
+    ENC28J60_EMAC(new ENC28J60(mosi, miso, sclk, cs), int_pin)
+{ }
+
+/**
+ * @brief
+ * @note    Used to run the driver with other than the default pins
+ *          or with a simulated ENC28J60. The instance takes the ownership
+ *          of enc28j60 and deletes it.
+ * @param   enc28j60 initialized ENC28J60
+ * @param   int_pin pin wired to the INT pin of ENC28J60 or NC to poll
+ * @retval
+ */
+ENC28J60_EMAC::ENC28J60_EMAC(ENC28J60* enc28j60, PinName int_pin) :
+    _index(core_util_atomic_incr_u32(&_instances, 1) - 1),
+    _enc28j60(enc28j60),
+    _int_in(int_pin != NC ? new InterruptIn(int_pin) : NULL),
+    _cmd_waiters(0),
+    _cmd_space(0),
+    _driver_thread(DRIVER_THREAD_PRIORITY, DRIVER_THREAD_STACK_SIZE, NULL, instance_name()),
+    _driver_thread_started(false),
+    _driver_thread_stop(false),
+    _powered(false),
+    _irq_pending(false),
+    _link_check_pending(false),
     _prev_link_status_up(PHY_STATE_LINK_DOWN),
-    _link_status_task_handle(0),
-    _receive_task_handle(0),
+    _tx_drops(0),
+    _tx_waits(0),
+    _rx_budget(RECEIVE_TASK_BUDGET),
+    _rx_alloc_failed(false),
+    _rx_paused(false),
+    _rx_irq_masked(false),
+    _rx_pauses(0),
+    _rx_filtered(0),
+    _rx_checksum_errors(0),
+    _rx_buf_request(0),
+    _rx_buf_resizes(0),
+    _rx_tune_overflows(0),
+    _rx_tune_tx_waits(0),
+    _rx_tune_quiet(0),
     _memory_manager(NULL)
-{ }
+{
+    memset(&_rx_drain_stats, 0, sizeof(_rx_drain_stats));
+    memset(&_rx_alloc_stats, 0, sizeof(_rx_alloc_stats));
+    _rx_irq_time = 0;
+    _rx_event_time = 0;
+    _rx_frames = 0;
+    _rx_bytes = 0;
+    _rx_latency_min = UINT32_MAX;
+    _rx_latency_max = 0;
+    _rx_latency_sum = 0;
+    _rx_latency_count = 0;
+    memset(_mcast_groups, 0, sizeof(_mcast_groups));
+    _mcast_overflow = 0;
+    _mcast_all = false;
+#if ENC28J60_RX_RING_SIZE > 0
+    memset(_rx_ring, 0, sizeof(_rx_ring));
+    _rx_ring_count = 0;
+#endif
+}
+
+/**
+ * @brief
+ * @note    Runs the commands queued before, then the driver thread returns.
+ *          Deleting the InterruptIn detaches the INT pin handler before
+ *          ENC28J60 is deleted.
+ * @param
+ * @retval
+ */
+ENC28J60_EMAC::~ENC28J60_EMAC()
+{
+    if (_driver_thread_started) {
+        power_down();
+        call(ENC28J60_CMD_STOP);
+        _driver_thread.join();
+    }
+
+    if (_int_in != NULL) {
+        _int_in->disable_irq();
+        delete _int_in;
+    }
+
+#if ENC28J60_RX_RING_SIZE > 0
+    while (_rx_ring_count > 0) {
+        _rx_ring_count--;
+        _memory_manager->free(_rx_ring[_rx_ring_count]);
+    }
+#endif
+
+    delete _enc28j60;
+}
 
 /**
  * @brief
  * @note    Allocates buffer chain from a pool and filles it with incoming packet.
+ *          Headers read by rx_accept are not read again.
  * @param
  * @retval  Data from incoming packet
  */
@@ -63,118 +189,1178 @@ emac_mem_buf_t* ENC28J60_EMAC::low_level_input()
     emac_mem_buf_t*     chain;
     emac_mem_buf_t*     buf;
     packet_t            packet;
+    enc28j60_error_t    error;
+    uint8_t             header[ENC28J60_RX_HEADER_LEN];
+    uint16_t            header_len = 0;
+    uint16_t            offset = 0;
+    uint16_t            len;
+    uint16_t            frame_len;
+    uint8_t*            data;
 
-    if (_enc28j60->getPacketInfo(&packet) != ENC28J60_ERROR_OK) {
-        return NULL;
-    }
+    // Faulty packets are dropped by getPacketInfo, rejected ones here.
+    // Skip them so they don't end the draining of the receive buffer.
+    do {
+        error = _enc28j60->getPacketInfo(&packet);
+        if (error == ENC28J60_ERROR_OK && (packet.payload.len == 0 || !rx_accept(&packet, header, &header_len))) {
+            _enc28j60->freeRxBuffer();
+            error = ENC28J60_ERROR_RECEIVE;
+        }
+    } while (error == ENC28J60_ERROR_RECEIVE);
 
-    if (packet.payload.len == 0) {
+    if (error != ENC28J60_ERROR_OK) {
         return NULL;
     }
 
-    // Allocate a buffer chain from the memory pool.
-//    chain = _memory_manager->alloc_pool(packet.payload.len, ENC28J60_BUFF_ALIGNMENT);
-//    if (chain == NULL) {
-      chain = _memory_manager->alloc_heap(packet.payload.len, ENC28J60_BUFF_ALIGNMENT);
-//    }
+    chain = alloc_rx_buffer(packet.payload.len);
     buf = chain;
     if (buf == NULL) {
       _enc28j60->abortPacketRead(packet.addr);
+      _rx_alloc_failed = true;
       return NULL;
     }
 
+    frame_len = packet.payload.len;
+
     // Iterate through the buffer chain and fill it with packet payload.
-    while (buf != NULL) {
-        packet.payload.buf = (uint8_t*)_memory_manager->get_ptr(buf);
-        packet.payload.len = (uint16_t) (_memory_manager->get_len(buf));
+    while (buf != NULL && error == ENC28J60_ERROR_OK) {
+        data = (uint8_t*)_memory_manager->get_ptr(buf);
+        len = (uint16_t) (_memory_manager->get_len(buf));
+
+        // The headers are already read, the read pointer is after them.
+        if (offset < header_len) {
+            packet.payload.len = (header_len - offset < len) ? header_len - offset : len;
+            memcpy(data, &header[offset], packet.payload.len);
+            offset += packet.payload.len;
+            data += packet.payload.len;
+            len -= packet.payload.len;
+        }
 
         // Fill the ethernet stack buffer with packet payload received by ENC28J60.
-        _enc28j60->readPacket(&packet);
+        if (len > 0) {
+            packet.payload.buf = data;
+            packet.payload.len = len;
+            error = _enc28j60->readPacket(&packet);
+        }
 
         buf = _memory_manager->get_next(buf);
     }
     _enc28j60->freeRxBuffer();  // make room in ENC28J60 receive buffer for new packets
 
+    // The payload of a failed SPI transfer isn't valid. The packet is dropped
+    // and the next one is found by its next packet pointer as usual.
+    if (error != ENC28J60_ERROR_OK) {
+        _memory_manager->free(chain);
+        return NULL;
+    }
+
+    _rx_frames++;
+    _rx_bytes += frame_len;
+
     // Return the buffer chain filled with packet payload.
     return chain;
 }
 
 /**
- * @brief   Receive task.
- * @note    Passes packet payload received by ENC28J60 to the ethernet stack
+ * @brief   Decides on a received packet from its headers.
+ * @note    Only the first ENC28J60_RX_HEADER_LEN bytes are read, for the
+ *          checksum check and the early filter. A rejected packet is
+ *          dropped without copying the rest out of ENC28J60. The read
+ *          pointer is left after the headers.
+ * @param   packet
+ * @param   header where the headers are read
+ * @param   header_len number of bytes read, 0 if none
+ * @retval  true to receive the packet
+ */
+bool ENC28J60_EMAC::rx_accept(const packet_t* packet, uint8_t* header, uint16_t* header_len)
+{
+    *header_len = 0;
+#if !ENC28J60_RX_CHECKSUM_CHECK
+    if (!_rx_filter_cb) {
+        return true;
+    }
+#endif
+
+    *header_len = (packet->payload.len < ENC28J60_RX_HEADER_LEN) ? packet->payload.len : ENC28J60_RX_HEADER_LEN;
+    if (!_enc28j60->readBuf(header, *header_len)) {
+        return false;
+    }
+
+#if ENC28J60_RX_CHECKSUM_CHECK
+    if (!rx_checksum_valid(packet, header, *header_len)) {
+        _rx_checksum_errors++;
+        return false;
+    }
+#endif
+
+    if (_rx_filter_cb && !_rx_filter_cb(header, *header_len, packet->payload.len)) {
+        _rx_filtered++;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief   Allocates a buffer chain for a received packet.
+ * @note    Tries the memory pool first, then the receive ring
+ *          and at last the heap.
+ * @param   len packet length
+ * @retval  Buffer chain or NULL
+ */
+emac_mem_buf_t* ENC28J60_EMAC::alloc_rx_buffer(uint16_t len)
+{
+    emac_mem_buf_t*     buf;
+
+    buf = _memory_manager->alloc_pool(len, ENC28J60_BUFF_ALIGNMENT);
+    if (buf != NULL) {
+        _rx_alloc_stats.pool_hits++;
+        return buf;
+    }
+
+#if ENC28J60_RX_RING_SIZE > 0
+    if (_rx_ring_count > 0 && len <= MAX_FRAMELEN) {
+        _rx_ring_count--;
+        buf = _rx_ring[_rx_ring_count];
+        _rx_ring[_rx_ring_count] = NULL;
+        _memory_manager->set_len(buf, len);
+        _rx_alloc_stats.ring_hits++;
+        return buf;
+    }
+#endif
+
+    buf = _memory_manager->alloc_heap(len, ENC28J60_BUFF_ALIGNMENT);
+    if (buf != NULL) {
+        _rx_alloc_stats.heap_fallbacks++;
+        return buf;
+    }
+
+    _rx_alloc_stats.alloc_failures++;
+    return NULL;
+}
+
+/**
+ * @brief   Refills the receive ring.
+ * @note    The ring is a reserve of maximum size buffers for when the pool
+ *          is exhausted, not a recycling pool: EMACMemoryManager doesn't
+ *          report the buffers freed by the stack, so they go back to the
+ *          heap. The refill allocates the same size again, so the heap
+ *          doesn't fragment. It only allocates after the ring was used.
+ * @param
+ * @retval
+ */
+void ENC28J60_EMAC::refill_rx_ring()
+{
+#if ENC28J60_RX_RING_SIZE > 0
+    emac_mem_buf_t*     buf;
+
+    while (_rx_ring_count < ENC28J60_RX_RING_SIZE) {
+        buf = _memory_manager->alloc_heap(MAX_FRAMELEN, ENC28J60_BUFF_ALIGNMENT);
+        if (buf == NULL) {
+            break;
+        }
+
+        _rx_ring[_rx_ring_count] = buf;
+        _rx_ring_count++;
+    }
+#endif
+}
+
+/**
+ * @brief   Gets the receive buffer allocation counters.
+ * @note
+ * @param   stats counters copy
+ * @retval
+ */
+void ENC28J60_EMAC::get_rx_alloc_stats(enc28j60_rx_alloc_stats_t* stats)
+{
+    if (!driver_context()) {
+        call(ENC28J60_CMD_GET_RX_ALLOC_STATS, stats);
+        return;
+    }
+
+    *stats = _rx_alloc_stats;
+}
+
+/**
+ * @brief   Clears the receive buffer allocation counters.
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60_EMAC::reset_rx_alloc_stats(void)
+{
+    if (!driver_context()) {
+        call(ENC28J60_CMD_RESET_RX_ALLOC_STATS);
+        return;
+    }
+
+    memset(&_rx_alloc_stats, 0, sizeof(_rx_alloc_stats));
+}
+
+/**
+ * @brief   Gets the driver statistics.
+ * @note
+ * @param   stats statistics copy
+ * @retval
+ */
+void ENC28J60_EMAC::get_stats(enc28j60_stats_t* stats)
+{
+    enc28j60_counters_t counters;
+    enc28j60_spi_cal_t  spi_cal;
+
+    if (!driver_context()) {
+        call(ENC28J60_CMD_GET_STATS, stats);
+        return;
+    }
+
+    _enc28j60->getCounters(&counters);
+    _enc28j60->getSpiCalibration(&spi_cal);
+    stats->rx_frames = _rx_frames;
+    stats->rx_bytes = _rx_bytes;
+    stats->rx_crc_errors = counters.rx_crc_errors;
+    stats->rx_symbol_errors = counters.rx_symbol_errors;
+    stats->rx_overflows = counters.rx_overflows;
+    stats->rx_resyncs = counters.rx_resyncs;
+    stats->rx_alloc_failures = _rx_alloc_stats.alloc_failures;
+    stats->rx_filtered = _rx_filtered;
+    stats->rx_checksum_errors = _rx_checksum_errors;
+    stats->rx_pauses = _rx_pauses;
+    stats->rx_buf_size = _enc28j60->getRxBufSize();
+    stats->rx_buf_resizes = _rx_buf_resizes;
+    stats->tx_frames = counters.tx_frames;
+    stats->tx_bytes = counters.tx_bytes;
+    stats->tx_aborts = counters.tx_aborts;
+    stats->tx_collisions = counters.tx_collisions;
+    stats->tx_late_collisions = counters.tx_late_collisions;
+    stats->tx_resets = counters.tx_resets;
+    stats->tx_waits = _tx_waits;
+    stats->tx_drops = core_util_atomic_load_u32(&_tx_drops);
+    stats->spi_transactions = counters.spi_transactions;
+    stats->spi_bytes = counters.spi_bytes;
+    stats->spi_errors = counters.spi_errors;
+    stats->spi_frequency = spi_cal.frequency;
+    stats->spi_cal_bytes = spi_cal.bytes;
+    stats->spi_cal_errors = spi_cal.errors;
+    stats->spi_cal_error_ppm = (spi_cal.bytes > 0) ? (uint32_t) ((uint64_t) spi_cal.errors * 1000000U / spi_cal.bytes) : 0;
+    stats->rx_latency_min_us = (_rx_latency_count > 0) ? _rx_latency_min : 0;
+    stats->rx_latency_avg_us = (_rx_latency_count > 0) ? (uint32_t) (_rx_latency_sum / _rx_latency_count) : 0;
+    stats->rx_latency_max_us = _rx_latency_max;
+}
+
+/**
+ * @brief   Clears the driver statistics.
+ * @note    Clears the receive allocation counters too.
+ * @param
+ * @retval
+ */
+void ENC28J60_EMAC::reset_stats(void)
+{
+    if (!driver_context()) {
+        call(ENC28J60_CMD_RESET_STATS);
+        return;
+    }
+
+    _enc28j60->resetCounters();
+    memset(&_rx_alloc_stats, 0, sizeof(_rx_alloc_stats));
+    core_util_atomic_store_u32(&_tx_drops, 0);
+    _tx_waits = 0;
+    _rx_tune_overflows = 0;
+    _rx_tune_tx_waits = 0;
+    _rx_buf_resizes = 0;
+    _rx_pauses = 0;
+    _rx_filtered = 0;
+    _rx_checksum_errors = 0;
+    _rx_frames = 0;
+    _rx_bytes = 0;
+    _rx_latency_min = UINT32_MAX;
+    _rx_latency_max = 0;
+    _rx_latency_sum = 0;
+    _rx_latency_count = 0;
+}
+
+/**
+ * @brief   Receive task.
+ * @note    Passes packets received by ENC28J60 to the ethernet stack.
+ *          Drains the receive buffer up to the budget of packets per run.
+ *          Packets are copied out of ENC28J60 in batches of up to
+ *          ENC28J60_RX_BATCH_SIZE and each batch is delivered when
+ *          ENC28J60 is no longer accessed. Queued commands run between
+ *          the batches, so the transmission doesn't wait for the whole run.
+ * @param
+ * @retval  true if the budget was used up and packets may be left
+ */
+bool ENC28J60_EMAC::receive_task()
+{
+    emac_mem_buf_t*     batch[ENC28J60_RX_BATCH_SIZE];
+    uint32_t            count;
+    uint32_t            frames = 0;
+
+    _rx_alloc_failed = false;
+    while (frames < _rx_budget && _powered) {
+        count = 0;
+        while (count < ENC28J60_RX_BATCH_SIZE && frames + count < _rx_budget) {
+            batch[count] = low_level_input();
+            if (batch[count] == NULL) {
+                break;
+            }
+
+            count++;
+        }
+
+        if (count == 0) {
+            break;
+        }
+
+        frames += count;
+        deliver_rx_batch(batch, count);
+        run_commands();
+    }
+
+    _rx_drain_stats.wakeups++;
+    _rx_drain_stats.frames += frames;
+    if (frames > _rx_drain_stats.max_per_wakeup) {
+        _rx_drain_stats.max_per_wakeup = frames;
+    }
+
+    if (frames == _rx_budget) {
+        _rx_drain_stats.budget_hits++;
+    }
+
+    // Refill the reserve once the receive buffer is drained, not between
+    // the packets of a burst
+    if (frames > 0 && frames < _rx_budget && !_rx_alloc_failed) {
+        refill_rx_ring();
+    }
+
+#if ENC28J60_RX_FLOW_CONTROL
+    // The receive buffer is empty if the run ended for no more packets
+    if (_powered && (frames == _rx_budget || _rx_alloc_failed || _rx_paused)) {
+        rx_flow_control();
+    }
+#endif
+
+    return frames == _rx_budget;
+}
+
+/**
+ * @brief   Receive flow control.
+ * @note    Pauses the sender before the receive buffer of ENC28J60
+ *          overflows, so a burst arrives later instead of being lost.
+ *          Pauses when less than ENC28J60_RX_PAUSE_WATERMARK bytes are free
+ *          or a packet was left for lack of memory, resumes when
+ *          ENC28J60_RX_RESUME_WATERMARK bytes are free and the stack
+ *          takes packets again.
+ * @param
+ * @retval
+ */
+void ENC28J60_EMAC::rx_flow_control()
+{
+    uint32_t    free_space = _enc28j60->getRxBufFreeSpace();
+    uint32_t    size = _enc28j60->getRxBufSize();
+
+    // A small receive buffer is paused at half and resumed at three quarters free
+    uint32_t    pause = (ENC28J60_RX_PAUSE_WATERMARK < size / 2) ? ENC28J60_RX_PAUSE_WATERMARK : size / 2;
+    uint32_t    resume = (ENC28J60_RX_RESUME_WATERMARK < size * 3 / 4) ? ENC28J60_RX_RESUME_WATERMARK : size * 3 / 4;
+
+    if (!_rx_paused) {
+        if (_rx_alloc_failed || free_space < pause) {
+            _enc28j60->setFlowControl(true);
+            _rx_paused = true;
+            _rx_pauses++;
+        }
+    }
+    else
+    if (!_rx_alloc_failed && free_space >= resume) {
+        _enc28j60->setFlowControl(false);
+        _rx_paused = false;
+    }
+}
+
+/**
+ * @brief   Receive buffer auto-sizing.
+ * @note    Runs every ENC28J60_RX_BUF_TUNE_PERIOD_MS. Grows the receive buffer
+ *          by 1 KB after an overflow. Shrinks it by 1 KB, giving the room to the
+ *          transmit buffer, when packets waited for room in the transmit buffer
+ *          and the receive buffer didn't overflow for ENC28J60_RX_BUF_TUNE_HOLD periods.
+ *          The new size is applied by apply_rx_buf_size.
+ * @param
+ * @retval
+ */
+void ENC28J60_EMAC::rx_buf_tune()
+{
+    enc28j60_counters_t counters;
+    uint32_t            overflows;
+    uint32_t            waits;
+    uint32_t            size_kb;
+
+    if (Kernel::Clock::now() < _rx_tune_time) {
+        return;
+    }
+
+    _rx_tune_time = Kernel::Clock::now() + ENC28J60_RX_BUF_TUNE_PERIOD_MS;
+    _enc28j60->getCounters(&counters);
+    overflows = counters.rx_overflows - _rx_tune_overflows;
+    waits = _tx_waits - _rx_tune_tx_waits;
+    _rx_tune_overflows = counters.rx_overflows;
+    _rx_tune_tx_waits = _tx_waits;
+    size_kb = _enc28j60->getRxBufSize() / 1024;
+
+    if (overflows > 0) {
+        _rx_tune_quiet = 0;
+        if (size_kb < ENC28J60_RX_BUF_MAX_KB) {
+            _rx_buf_request = size_kb + 1;
+        }
+    }
+    else {
+        if (_rx_tune_quiet < ENC28J60_RX_BUF_TUNE_HOLD) {
+            _rx_tune_quiet++;
+        }
+
+        if (_rx_tune_quiet == ENC28J60_RX_BUF_TUNE_HOLD && waits >= ENC28J60_RX_BUF_TUNE_TX_WAITS
+        &&  size_kb > ENC28J60_RX_BUF_MIN_KB) {
+            _rx_buf_request = size_kb - 1;
+            _rx_tune_quiet = 0;
+        }
+    }
+}
+
+/**
+ * @brief   Applies the requested receive buffer size.
+ * @note    ENC28J60 changes the partition only if both buffers are empty,
+ *          otherwise the request is kept and retried after
+ *          ENC28J60_RX_BUF_RETRY_MS, so steady traffic doesn't get a try
+ *          on every run of the service task.
+ * @param
+ * @retval
+ */
+void ENC28J60_EMAC::apply_rx_buf_size()
+{
+    uint32_t            size = _enc28j60->getRxBufSize();
+    enc28j60_error_t    error;
+
+    if (Kernel::Clock::now() < _rx_buf_retry_time) {
+        return;
+    }
+
+    error = _enc28j60->setRxBufSize(_rx_buf_request);
+    if (error == ENC28J60_ERROR_BUSY) {
+        _rx_buf_retry_time = Kernel::Clock::now() + ENC28J60_RX_BUF_RETRY_MS;
+        return;
+    }
+
+    if (_enc28j60->getRxBufSize() != size) {
+        _rx_buf_resizes++;
+    }
+
+    _rx_buf_request = 0;
+}
+
+/**
+ * @brief   Passes received packets to the ethernet stack.
+ * @note    The batch callback gets all of them in one call,
+ *          otherwise the input callback is called for each.
+ * @param   batch packets
+ * @param   count number of packets
+ * @retval
+ */
+void ENC28J60_EMAC::deliver_rx_batch(emac_mem_buf_t** batch, uint32_t count)
+{
+    if (_emac_link_input_batch_cb) {
+        add_rx_latency(us_ticker_read() - _rx_event_time, count);
+        _emac_link_input_batch_cb(batch, count);
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (_emac_link_input_cb) {
+            add_rx_latency(us_ticker_read() - _rx_event_time, 1);
+            _emac_link_input_cb(batch[i]);  // pass packet payload to the ethernet stack
+        }
+        else {
+            _memory_manager->free(batch[i]);
+        }
+    }
+}
+
+/**
+ * @brief   Adds packets to the receive latency statistics.
+ * @note
+ * @param   latency time from the event to the delivery in us
+ * @param   count number of packets delivered at that time
+ * @retval
+ */
+void ENC28J60_EMAC::add_rx_latency(uint32_t latency, uint32_t count)
+{
+    _rx_latency_count += count;
+    _rx_latency_sum += (uint64_t) latency * count;
+    if (latency < _rx_latency_min) {
+        _rx_latency_min = latency;
+    }
+
+    if (latency > _rx_latency_max) {
+        _rx_latency_max = latency;
+    }
+}
+
+/**
+ * @brief   Sets the receive budget.
+ * @note    Maximum number of packets passed to the stack in one run of the receive task.
+ * @param   frames budget, at least 1
+ * @retval
+ */
+void ENC28J60_EMAC::set_rx_budget(uint32_t frames)
+{
+    if (!driver_context()) {
+        call(ENC28J60_CMD_RX_BUDGET, NULL, frames);
+        return;
+    }
+
+    _rx_budget = (frames > 0) ? frames : 1;
+}
+
+/**
+ * @brief   Gets the receive draining counters.
+ * @note
+ * @param   stats counters copy
+ * @retval
+ */
+void ENC28J60_EMAC::get_rx_drain_stats(enc28j60_rx_drain_stats_t* stats)
+{
+    if (!driver_context()) {
+        call(ENC28J60_CMD_GET_RX_DRAIN_STATS, stats);
+        return;
+    }
+
+    *stats = _rx_drain_stats;
+}
+
+/**
+ * @brief   Clears the receive draining counters.
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60_EMAC::reset_rx_drain_stats(void)
+{
+    if (!driver_context()) {
+        call(ENC28J60_CMD_RESET_RX_DRAIN_STATS);
+        return;
+    }
+
+    memset(&_rx_drain_stats, 0, sizeof(_rx_drain_stats));
+}
+
+/**
+ * @brief   Checks if the caller may access ENC28J60.
+ * @note    True in the driver thread and before the thread is started.
+ * @param
+ * @retval
+ */
+bool ENC28J60_EMAC::driver_context() const
+{
+    return !_driver_thread_started || ThisThread::get_id() == _driver_thread.get_id();
+}
+
+/**
+ * @brief   Runs a control command in the driver thread.
+ * @note    Waits until the command has run, so arg may point to the stack
+ *          of the caller. Waits for room if the queue is full.
+ * @param   type enc28j60_cmd_type_t
+ * @param   arg argument or result buffer
+ * @param   value numeric argument
+ * @retval  result of the command
+ */
+bool ENC28J60_EMAC::call(uint8_t type, void* arg, uint32_t value)
+{
+    Semaphore       done(0);
+    bool            result = false;
+    enc28j60_cmd_t  cmd = { type, NULL, arg, value, &result, &done };
+
+    while (!_cmd_queue.push(&cmd)) {
+        wait_cmd_space();
+    }
+
+    _driver_thread.flags_set(DRIVER_CMD_FLAG);
+    done.acquire();
+    return result;
+}
+
+/**
+ * @brief   Waits until the driver thread takes a command from the full queue.
+ * @note    Returns after CMD_QUEUE_RETRY_MS at the latest.
+ * @param
+ * @retval
+ */
+void ENC28J60_EMAC::wait_cmd_space()
+{
+    core_util_atomic_incr_u32(&_cmd_waiters, 1);
+    _driver_thread.flags_set(DRIVER_CMD_FLAG);
+    _cmd_space.try_acquire_for(CMD_QUEUE_RETRY_MS);
+    core_util_atomic_decr_u32(&_cmd_waiters, 1);
+}
+
+/**
+ * @brief   Runs a command in the driver thread.
+ * @note
+ * @param   cmd command taken from the queue
+ * @retval
+ */
+void ENC28J60_EMAC::run_command(const enc28j60_cmd_t* cmd)
+{
+    switch (cmd->type) {
+        case ENC28J60_CMD_LINK_OUT:
+            transmit(cmd->buf);
+            break;
+
+        case ENC28J60_CMD_POWER_UP:
+            *cmd->result = power_up();
+            break;
+
+        case ENC28J60_CMD_POWER_DOWN:
+            power_down();
+            break;
+
+        case ENC28J60_CMD_GET_HWADDR:
+            *cmd->result = get_hwaddr((uint8_t*)cmd->arg);
+            break;
+
+        case ENC28J60_CMD_SET_HWADDR:
+            set_hwaddr((const uint8_t*)cmd->arg);
+            break;
+
+        case ENC28J60_CMD_ADD_MULTICAST:
+            add_multicast_group((const uint8_t*)cmd->arg);
+            break;
+
+        case ENC28J60_CMD_REMOVE_MULTICAST:
+            remove_multicast_group((const uint8_t*)cmd->arg);
+            break;
+
+        case ENC28J60_CMD_ALL_MULTICAST:
+            set_all_multicast(cmd->value != 0);
+            break;
+
+        case ENC28J60_CMD_BROADCAST_FILTER:
+            *cmd->result = set_broadcast_filter((const enc28j60_pattern_t*)cmd->arg, cmd->value);
+            break;
+
+        case ENC28J60_CMD_FULL_DUPLEX:
+            set_full_duplex(cmd->value != 0);
+            break;
+
+        case ENC28J60_CMD_RX_BUF_SIZE:
+            *cmd->result = set_rx_buffer_size(cmd->value);
+            break;
+
+        case ENC28J60_CMD_RX_BUDGET:
+            set_rx_budget(cmd->value);
+            break;
+
+        case ENC28J60_CMD_GET_RX_DRAIN_STATS:
+            get_rx_drain_stats((enc28j60_rx_drain_stats_t*)cmd->arg);
+            break;
+
+        case ENC28J60_CMD_RESET_RX_DRAIN_STATS:
+            reset_rx_drain_stats();
+            break;
+
+        case ENC28J60_CMD_GET_RX_ALLOC_STATS:
+            get_rx_alloc_stats((enc28j60_rx_alloc_stats_t*)cmd->arg);
+            break;
+
+        case ENC28J60_CMD_RESET_RX_ALLOC_STATS:
+            reset_rx_alloc_stats();
+            break;
+
+        case ENC28J60_CMD_GET_STATS:
+            get_stats((enc28j60_stats_t*)cmd->arg);
+            break;
+
+        case ENC28J60_CMD_RESET_STATS:
+            reset_stats();
+            break;
+
+        case ENC28J60_CMD_STOP:
+            _driver_thread_stop = true;
+            break;
+
+        default:
+            break;
+    }
+
+    if (cmd->done != NULL) {
+        cmd->done->release();
+    }
+}
+
+/**
+ * @brief   Runs the queued commands.
+ * @note    Runs in the driver thread. Wakes up the threads waiting for room in the queue.
+ * @param
+ * @retval
+ */
+void ENC28J60_EMAC::run_commands()
+{
+    enc28j60_cmd_t  cmd;
+
+    while (_cmd_queue.pop(&cmd)) {
+        if (core_util_atomic_load_u32(&_cmd_waiters) != 0) {
+            _cmd_space.release();
+        }
+
+        run_command(&cmd);
+    }
+}
+
+/**
+ * @brief   Driver thread.
+ * @note    The only thread which accesses ENC28J60 after power_up.
+ *          Runs the queued commands and services the chip on the INT pin
+ *          falling edge, or every RECEIVE_TASK_PERIOD_MS without the INT pin.
+ *          A busy stream of commands doesn't delay the polling.
+ * @param
+ * @retval
+ */
+void ENC28J60_EMAC::driver_thread()
+{
+    Kernel::Clock::time_point   service_time = Kernel::Clock::now();
+    Kernel::Clock::duration     wait;
+    uint32_t                    flags;
+
+    while (!_driver_thread_stop) {
+        wait = RECEIVE_IRQ_FALLBACK_MS;
+        if (_powered) {
+            wait = service_time - Kernel::Clock::now();
+            if (wait < 0ms) {
+                wait = 0ms;
+            }
+        }
+
+        flags = ThisThread::flags_wait_any_for(DRIVER_IRQ_FLAG | DRIVER_CMD_FLAG, wait);
+        if ((flags & DRIVER_IRQ_FLAG) != 0) {
+            _irq_pending = true;
+        }
+
+        run_commands();
+
+        if (!_powered || _driver_thread_stop || (!_irq_pending && Kernel::Clock::now() < service_time)) {
+            continue;
+        }
+
+        _rx_event_time = _irq_pending ? _rx_irq_time : us_ticker_read();
+        _irq_pending = false;
+        if (service_task()) {
+            service_time = Kernel::Clock::now();    // packets left, run again after the commands
+        }
+        else {
+            // No interrupt tells when the stack has memory again
+            service_time = Kernel::Clock::now() + ((_int_in != NULL && !_rx_irq_masked && !_rx_paused) ? RECEIVE_IRQ_FALLBACK_MS : RECEIVE_TASK_PERIOD_MS);
+        }
+    }
+}
+
+/**
+ * @brief   Services ENC28J60.
+ * @note    Reads and acknowledges the interrupt flags, starts a queued
+ *          packet transmission and passes received packets to the
+ *          ethernet stack.
+ * @param
+ * @retval  true if the receive budget was used up
+ */
+bool ENC28J60_EMAC::service_task()
+{
+    uint8_t     flags;
+    bool        more;
+
+    // Clearing INTIE releases the INT line. Setting it again at the end
+    // makes a new falling edge if some flag is still pending.
+    if (_int_in != NULL) {
+        _enc28j60->disableInterrupts(ENC28J60_INTERRUPT_ENABLE);
+    }
+
+    flags = _enc28j60->getInterruptFlags();
+    _enc28j60->checkTransmit(flags);
+    _enc28j60->checkReceiveError(flags);
+    if (_enc28j60->checkLinkInterrupt(flags) || _link_check_pending) {
+        _link_check_pending = false;
+        link_status_task();
+    }
+
+    // checkTransmit and checkReceiveError clear their flags. The snapshot
+    // would clear the flags of a transmission started by checkTransmit.
+    if (_int_in != NULL) {
+        _enc28j60->clearInterruptFlags(flags & ~(EIR_TXIF | EIR_TXERIF | EIR_RXERIF));
+    }
+
+    more = receive_task();
+
+#if ENC28J60_RX_BUF_AUTO_TUNE
+    rx_buf_tune();
+#endif
+
+    // The receive buffer is empty if the budget wasn't used up
+    if (_rx_buf_request != 0 && !more && _powered) {
+        apply_rx_buf_size();
+    }
+
+    // A command run by the receive task may have powered ENC28J60 down
+    if (_int_in != NULL && _powered) {
+        // A packet left for lack of memory keeps PKTIF set. Its interrupt
+        // is masked and the receive task is polled until memory is free.
+        if (_rx_alloc_failed != _rx_irq_masked) {
+            if (_rx_alloc_failed) {
+                _enc28j60->disableInterrupts(ENC28J60_INTERRUPT_RX_PENDING_ENABLE);
+            }
+            else {
+                _enc28j60->enableInterrupts(ENC28J60_INTERRUPT_RX_PENDING_ENABLE);
+            }
+
+            _rx_irq_masked = _rx_alloc_failed;
+        }
+
+        _enc28j60->enableInterrupts(ENC28J60_INTERRUPT_ENABLE);
+    }
+
+    return more;
+}
+
+/**
+ * @brief   INT pin falling edge handler.
+ * @note    Runs in interrupt context. Only signals the driver thread.
+ * @param
+ * @retval
+ */
+void ENC28J60_EMAC::interrupt_handler()
+{
+    _rx_irq_time = us_ticker_read();
+    _driver_thread.flags_set(DRIVER_IRQ_FLAG);
+}
+
+/**
+ * @brief
+ * @note    Queues a packet payload from the ethernet stack for the driver thread.
+ *          Waits up to TRANSMIT_TIME_OUT_MS if the queue is full.
  * @param
  * @retval
  */
-void ENC28J60_EMAC::receive_task()
+bool ENC28J60_EMAC::link_out(emac_mem_buf_t* buf)
 {
-    emac_mem_buf_t*     payload;
+    enc28j60_cmd_t              cmd = { ENC28J60_CMD_LINK_OUT, buf, NULL, 0, NULL, NULL };
+    Kernel::Clock::time_point   timeout = Kernel::Clock::now() + TRANSMIT_TIME_OUT_MS;
 
-    _ethLockMutex.lock();
-    payload = low_level_input();
-    if (payload != NULL) {
-        if (_emac_link_input_cb) {
-            _emac_link_input_cb(payload);   // pass packet payload to the ethernet stack
+    if (buf == NULL) {
+        return false;
+    }
+
+    if (driver_context()) {
+        return transmit(buf);
+    }
+
+    while (!_cmd_queue.push(&cmd)) {
+        if (Kernel::Clock::now() >= timeout) {
+            _memory_manager->free(buf);
+            core_util_atomic_incr_u32(&_tx_drops, 1);
+            return false;
         }
+
+        wait_cmd_space();
     }
-    
-    _ethLockMutex.unlock();
-}
 
+    _driver_thread.flags_set(DRIVER_CMD_FLAG);
+    return true;
+}
 
 /**
  * @brief
- * @note    Passes a packet payload from the ethernet stack to ENC28J60 for transmittion
+ * @note    Passes a packet payload from the ethernet stack to ENC28J60 for transmittion.
+ *          Runs in the driver thread. Frees the packet.
  * @param
  * @retval
  */
-bool ENC28J60_EMAC::link_out(emac_mem_buf_t* buf)
+bool ENC28J60_EMAC::transmit(emac_mem_buf_t* buf)
 {
     emac_mem_buf_t*     chain = buf;
     enc28j60_error_t    error;
+    payload_t           segments[ENC28J60_TX_SEGMENTS];
+    uint8_t             count = 0;
 
-    if (buf == NULL) {
-        return false;
+    uint16_t packetLen = _memory_manager->get_total_len(chain);
+    Kernel::Clock::time_point timeout = Kernel::Clock::now() + TRANSMIT_TIME_OUT_MS;
+
+    // The buffers of the chain are written in one SPI transaction
+    while (buf != NULL && count < ENC28J60_TX_SEGMENTS) {
+        segments[count].buf = (uint8_t*) _memory_manager->get_ptr(buf);
+        segments[count].len = (uint16_t) _memory_manager->get_len(buf);
+        count++;
+        buf = _memory_manager->get_next(buf);
     }
 
-    _ethLockMutex.lock();
+    // Wait only if both packets in the transmit buffer are used
+    _enc28j60->checkTransmit();
+    error = _enc28j60->loadPacketInTxBuffer(packetLen, segments, count);
+    if (error == ENC28J60_ERROR_BUSY) {
+        _tx_waits++;
+    }
+
+    while (error == ENC28J60_ERROR_BUSY && Kernel::Clock::now() < timeout) {
+        wait_transmit();
+        error = _enc28j60->loadPacketInTxBuffer(packetLen, segments, count);
+    }
 
-    uint16_t packetLen = _memory_manager->get_total_len(chain);
-    error = _enc28j60->startPacketInTxBuffer(packetLen);
     if (error != ENC28J60_ERROR_OK) {
         _memory_manager->free(chain);
-        _ethLockMutex.unlock();
+        core_util_atomic_incr_u32(&_tx_drops, 1);
         return false;
     }
 
-    // Iterate through the buffer chain and fill the packet with payload.
+    // Buffers beyond ENC28J60_TX_SEGMENTS follow in own transactions
     while (buf != NULL) {
         uint16_t len = _memory_manager->get_len(buf);
     	  uint8_t* data = (uint8_t *) (_memory_manager->get_ptr(buf));
         error = _enc28j60->loadDataInTxBuffer(data, len);
         if (error != ENC28J60_ERROR_OK) {
             _memory_manager->free(chain);
-            _ethLockMutex.unlock();
+            core_util_atomic_incr_u32(&_tx_drops, 1);
             return false;
         }
         buf = _memory_manager->get_next(buf);
     }
 
+#if ENC28J60_TX_CHECKSUM_OFFLOAD
+    tx_checksum_offload((uint8_t*) _memory_manager->get_ptr(chain), _memory_manager->get_len(chain));
+#endif
+
     _memory_manager->free(chain);
 
     error = _enc28j60->transmitPacket(packetLen);
     if (error != ENC28J60_ERROR_OK) {
-        _ethLockMutex.unlock();
+        core_util_atomic_incr_u32(&_tx_drops, 1);
         return false;
     }
 
-    _ethLockMutex.unlock();
+    // Without the INT pin nothing else starts the queued packet
+    if (_int_in == NULL) {
+        while (_enc28j60->transmitPending() && Kernel::Clock::now() < timeout) {
+            wait_transmit();
+        }
+    }
 
     return true;
 }
 
 /**
- * @brief
+ * @brief   Adds data to a one's complement sum.
+ * @note
+ * @param
+ * @retval
+ */
+static uint32_t checksum_add(uint32_t sum, const uint8_t* data, uint16_t len)
+{
+    for (uint16_t i = 0; i + 1 < len; i += 2) {
+        sum += (data[i] << 8) | data[i + 1];
+    }
+
+    if (len & 1) {
+        sum += data[len - 1] << 8;
+    }
+
+    return sum;
+}
+
+/**
+ * @brief   Folds a one's complement sum to 16 bits.
+ * @note
+ * @param
+ * @retval
+ */
+static uint16_t checksum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return sum;
+}
+
+/**
+ * @brief   Gets the positions of the checksums of an IPv4 packet.
  * @note
+ * @param   frame first bytes of the packet
+ * @param   len number of bytes in frame
+ * @param   l4_pos position of the TCP or UDP header, 0 if none
+ * @param   l4_checksum_pos position of its checksum
+ * @param   pseudo sum of the pseudo header
+ * @retval  IP header length, 0 if not an IPv4 packet
+ */
+static uint16_t checksum_positions(const uint8_t* frame, uint16_t len, uint16_t* l4_pos, uint16_t* l4_checksum_pos, uint32_t* pseudo)
+{
+    const uint8_t*  ip = frame + ETH_HDR_LEN;
+    uint16_t        ip_len;
+    uint16_t        l4_len;
+
+    *l4_pos = 0;
+    if (len < ETH_HDR_LEN + IP_HDR_MIN_LEN || ((frame[ETH_TYPE_POS] << 8) | frame[ETH_TYPE_POS + 1]) != ETH_TYPE_IPV4) {
+        return 0;
+    }
+
+    ip_len = (ip[0] & 0x0F) * 4;
+    if ((ip[0] >> 4) != 4 || ip_len < IP_HDR_MIN_LEN || len < ETH_HDR_LEN + ip_len) {
+        return 0;
+    }
+
+    // Fragments have no complete TCP or UDP header
+    if (((ip[IP_FRAG_POS] & 0x3F) | ip[IP_FRAG_POS + 1]) != 0) {
+        return ip_len;
+    }
+
+    if (ip[IP_PROTO_POS] == IP_PROTO_TCP) {
+        *l4_checksum_pos = ETH_HDR_LEN + ip_len + TCP_CHECKSUM_POS;
+    }
+    else
+    if (ip[IP_PROTO_POS] == IP_PROTO_UDP) {
+        *l4_checksum_pos = ETH_HDR_LEN + ip_len + UDP_CHECKSUM_POS;
+    }
+    else {
+        return ip_len;
+    }
+
+    if (len < *l4_checksum_pos + 2) {
+        return ip_len;
+    }
+
+    l4_len = ((ip[IP_TOTAL_LEN_POS] << 8) | ip[IP_TOTAL_LEN_POS + 1]) - ip_len;
+    *pseudo = checksum_add(l4_len + ip[IP_PROTO_POS], &ip[IP_SRC_POS], 8);
+    *l4_pos = ETH_HDR_LEN + ip_len;
+    return ip_len;
+}
+
+/**
+ * @brief   Fills in checksums of the loaded packet.
+ * @note    The IPv4, TCP and UDP checksums are computed by the DMA controller
+ *          of ENC28J60 over the packet in the transmit buffer. The stack
+ *          doesn't generate them (see ENC28J60_TX_CHECKSUM_OFFLOAD), so all
+ *          are computed. A value in the checksum field is taken out of the
+ *          sum, the field needn't be 0.
+ *          The headers must be in the first buffer of the chain.
+ * @param   frame first buffer of the packet
+ * @param   len its length
+ * @retval
+ */
+void ENC28J60_EMAC::tx_checksum_offload(const uint8_t* frame, uint16_t len)
+{
+    uint16_t    ip_len;
+    uint16_t    l4_pos;
+    uint16_t    l4_checksum_pos;
+    uint16_t    l4_len;
+    uint32_t    pseudo;
+    uint16_t    checksum;
+    uint16_t    field;
+    uint8_t     value[2];
+
+    ip_len = checksum_positions(frame, len, &l4_pos, &l4_checksum_pos, &pseudo);
+    if (ip_len == 0) {
+        return;
+    }
+
+    field = (frame[ETH_HDR_LEN + IP_CHECKSUM_POS] << 8) | frame[ETH_HDR_LEN + IP_CHECKSUM_POS + 1];
+    if (_enc28j60->dmaChecksum(_enc28j60->txDataAddr(ETH_HDR_LEN), ip_len, &checksum) == ENC28J60_ERROR_OK) {
+        // Subtract the field in one's complement
+        checksum = ~checksum_fold((uint16_t) ~checksum + (uint16_t) ~field);
+        value[0] = checksum >> 8;
+        value[1] = checksum & 0xFF;
+        _enc28j60->writeTxData(ETH_HDR_LEN + IP_CHECKSUM_POS, value, sizeof(value));
+    }
+
+    if (l4_pos == 0) {
+        return;
+    }
+
+    l4_len = ((frame[ETH_HDR_LEN + IP_TOTAL_LEN_POS] << 8) | frame[ETH_HDR_LEN + IP_TOTAL_LEN_POS + 1]) - ip_len;
+    if (_enc28j60->dmaChecksum(_enc28j60->txDataAddr(l4_pos), l4_len, &checksum) != ENC28J60_ERROR_OK) {
+        return;
+    }
+
+    // Subtract the field and add the pseudo header to the sum of the segment
+    field = (frame[l4_checksum_pos] << 8) | frame[l4_checksum_pos + 1];
+    checksum = ~checksum_fold((uint16_t) ~checksum + (uint16_t) ~field + pseudo);
+    if (checksum == 0 && l4_checksum_pos == l4_pos + UDP_CHECKSUM_POS) {
+        checksum = 0xFFFF;  // 0 means no checksum in UDP
+    }
+
+    value[0] = checksum >> 8;
+    value[1] = checksum & 0xFF;
+    _enc28j60->writeTxData(l4_checksum_pos, value, sizeof(value));
+}
+
+/**
+ * @brief   Checks checksums of a received packet.
+ * @note    The DMA controller of ENC28J60 computes the checksums over
+ *          the packet in the receive buffer, only the headers are read.
+ * @param   packet
+ * @param   frame headers read by rx_accept
+ * @param   len number of bytes in frame
+ * @retval  false if IPv4, TCP or UDP checksum is wrong
+ */
+bool ENC28J60_EMAC::rx_checksum_valid(const packet_t* packet, const uint8_t* frame, uint16_t len)
+{
+    uint16_t    ip_len;
+    uint16_t    l4_pos;
+    uint16_t    l4_checksum_pos;
+    uint32_t    pseudo;
+    uint16_t    checksum;
+    bool        valid = true;
+
+    ip_len = checksum_positions(frame, len, &l4_pos, &l4_checksum_pos, &pseudo);
+    if (ip_len == 0) {
+        return true;
+    }
+
+    if (_enc28j60->dmaChecksum(_enc28j60->rxDataAddr(packet, ETH_HDR_LEN), ip_len, &checksum) == ENC28J60_ERROR_OK) {
+        valid = (checksum == 0);
+    }
+
+    // l4_pos is 0 also if IP options moved the checksum out of the read headers
+    if (!valid || l4_pos == 0) {
+        return valid;
+    }
+
+    // 0 means no checksum in UDP
+    if (l4_checksum_pos == l4_pos + UDP_CHECKSUM_POS && (frame[l4_checksum_pos] | frame[l4_checksum_pos + 1]) == 0) {
+        return true;
+    }
+
+    uint16_t l4_len = ((frame[ETH_HDR_LEN + IP_TOTAL_LEN_POS] << 8) | frame[ETH_HDR_LEN + IP_TOTAL_LEN_POS + 1]) - ip_len;
+    if (l4_pos + l4_len > packet->payload.len) {
+        return false;
+    }
+
+    if (_enc28j60->dmaChecksum(_enc28j60->rxDataAddr(packet, l4_pos), l4_len, &checksum) == ENC28J60_ERROR_OK) {
+        valid = (checksum_fold((uint16_t) ~checksum + pseudo) == 0xFFFF);
+    }
+
+    return valid;
+}
+
+/**
+ * @brief   Waits for the end of the packet in transmission.
+ * @note    Runs in the driver thread. Wakes up on the INT pin or after
+ *          TRANSMIT_POLL_PERIOD_MS and polls the transmit flags. The INT pin
+ *          event is kept for the service task.
+ * @param
+ * @retval
+ */
+void ENC28J60_EMAC::wait_transmit()
+{
+    if ((ThisThread::flags_wait_any_for(DRIVER_IRQ_FLAG, TRANSMIT_POLL_PERIOD_MS) & DRIVER_IRQ_FLAG) != 0) {
+        _irq_pending = true;
+    }
+
+    _enc28j60->checkTransmit();
+}
+
+/**
+ * @brief   Reports the link state to the stack if it changed.
+ * @note    Runs on the link change interrupt and once after power_up.
  * @param
  * @retval
  */
@@ -185,7 +1371,6 @@ void ENC28J60_EMAC::link_status_task()
 
     /* Get current status */
 
-    _ethLockMutex.lock();
     _enc28j60->phyRead(PHSTAT2, &phy_basic_status_reg_value);
 
     current_link_status_up = (bool) ((phy_basic_status_reg_value & PHSTAT2_LSTAT) != 0);
@@ -198,8 +1383,6 @@ void ENC28J60_EMAC::link_status_task()
 
         _prev_link_status_up = current_link_status_up;
     }
-
-    _ethLockMutex.unlock();
 }
 
 /**
@@ -210,9 +1393,18 @@ void ENC28J60_EMAC::link_status_task()
  */
 bool ENC28J60_EMAC::power_up()
 {
+    if (!_driver_thread_started) {
+        _driver_thread.start(mbed::callback(this, &ENC28J60_EMAC::driver_thread));
+        _driver_thread_started = true;
+    }
+
+    if (!driver_context()) {
+        return call(ENC28J60_CMD_POWER_UP);
+    }
+
     volatile uint32_t   timeout = 500;
-    _enc28j60->writeOp(ENC28J60_BIT_FIELD_CLR, ECON2, ECON2_PWRSV);
-    while (_enc28j60->readReg(ESTAT_CLKRDY) == 0) {
+    _enc28j60->bitFieldClr<ECON2>(ECON2_PWRSV);
+    while ((_enc28j60->readReg<ESTAT>() & ESTAT_CLKRDY) == 0) {
         ThisThread::sleep_for(1ms);
         timeout--;
         if (timeout == 0) {
@@ -220,24 +1412,25 @@ bool ENC28J60_EMAC::power_up()
         }
     }
 
-    /* Trigger thread to deal with any RX packets that arrived
-     * before receiver_thread was started */
-    _receive_task_handle = mbed::mbed_event_queue()->call_every
-        (
-            RECEIVE_TASK_PERIOD_MS,
-            mbed::callback(this, &ENC28J60_EMAC::receive_task)
-        );
+    refill_rx_ring();
 
+    /* Link changes are reported by the link change interrupt */
+    _enc28j60->enableLinkInterrupt();
     _prev_link_status_up = PHY_STATE_LINK_DOWN;
-    mbed::mbed_event_queue()->call(mbed::callback(this, &ENC28J60_EMAC::link_status_task));
 
-    /* Allow the Link Status task to detect the initial link state */
-    ThisThread::sleep_for(10ms);
-    _link_status_task_handle = mbed::mbed_event_queue()->call_every
-        (
-            LINK_STATUS_TASK_PERIOD_MS,
-            mbed::callback(this, &ENC28J60_EMAC::link_status_task)
-        );
+    if (_int_in != NULL) {
+        _enc28j60->enableInterrupts(ENC28J60_INTERRUPT_TX_ENABLE | ENC28J60_INTERRUPT_TX_ERROR_ENABLE);
+        _int_in->fall(mbed::callback(this, &ENC28J60_EMAC::interrupt_handler));
+        _int_in->enable_irq();
+    }
+
+    /* Service the RX packets that arrived before the interrupt was enabled
+     * and detect the initial link state when the driver thread runs next.
+     * Their latency counts from now, not from an interrupt before power_down */
+    _powered = true;
+    _rx_irq_time = us_ticker_read();
+    _irq_pending = true;
+    _link_check_pending = true;
 
     return true;
 }
@@ -272,7 +1465,9 @@ uint32_t ENC28J60_EMAC::get_align_preference() const
  */
 void ENC28J60_EMAC::get_ifname(char* name, uint8_t size) const
 {
-    memcpy(name, ENC28J60_ETH_IF_NAME, (size < sizeof(ENC28J60_ETH_IF_NAME)) ? size : sizeof(ENC28J60_ETH_IF_NAME));
+    size_t  len = strlen(_name) + 1;
+
+    memcpy(name, _name, (size < len) ? size : len);
 }
 
 /**
@@ -294,6 +1489,10 @@ uint8_t ENC28J60_EMAC::get_hwaddr_size() const
  */
 bool ENC28J60_EMAC::get_hwaddr(uint8_t* addr) const
 {
+    if (!driver_context()) {
+        return const_cast<ENC28J60_EMAC*>(this)->call(ENC28J60_CMD_GET_HWADDR, addr);
+    }
+
     enc28j60_error_t    error = _enc28j60->readMacAddr((char*)addr);
     if (error == ENC28J60_ERROR_OK) {
         return true;
@@ -315,11 +1514,14 @@ void ENC28J60_EMAC::set_hwaddr(const uint8_t* addr)
         return;
     }
 
+    if (!driver_context()) {
+        call(ENC28J60_CMD_SET_HWADDR, (void*)addr);
+        return;
+    }
+
     memcpy(_hwaddr, addr, sizeof _hwaddr);
-    _ethLockMutex.lock();
 
     enc28j60_error_t    error = _enc28j60->writeMacAddr((char*)addr);
-    _ethLockMutex.unlock();
     if (error) {
         return;
     }
@@ -336,6 +1538,29 @@ void ENC28J60_EMAC::set_link_input_cb(emac_link_input_cb_t input_cb)
     _emac_link_input_cb = input_cb;
 }
 
+/**
+ * @brief   Sets the callback for batches of received packets.
+ * @note    Used instead of the input callback if set.
+ * @param
+ * @retval
+ */
+void ENC28J60_EMAC::set_link_input_batch_cb(emac_link_input_batch_cb_t input_cb)
+{
+    _emac_link_input_batch_cb = input_cb;
+}
+
+/**
+ * @brief   Sets the early filter of received packets.
+ * @note    With the filter set, the headers of a packet are read before
+ *          the rest (see rx_accept).
+ * @param
+ * @retval
+ */
+void ENC28J60_EMAC::set_rx_filter_cb(emac_rx_filter_cb_t filter_cb)
+{
+    _rx_filter_cb = filter_cb;
+}
+
 /**
  * @brief
  * @note
@@ -355,7 +1580,36 @@ void ENC28J60_EMAC::set_link_state_cb(emac_link_state_change_cb_t state_cb)
  */
 void ENC28J60_EMAC::add_multicast_group(const uint8_t* addr)
 {
-    // No action for now
+    int free = -1;
+
+    if (!driver_context()) {
+        call(ENC28J60_CMD_ADD_MULTICAST, (void*)addr);
+        return;
+    }
+
+    for (uint8_t i = 0; i < ENC28J60_MULTICAST_GROUPS; i++) {
+        if (_mcast_groups[i].refs == 0) {
+            if (free < 0) {
+                free = i;
+            }
+        }
+        else
+        if (memcmp(_mcast_groups[i].addr, addr, ENC28J60_HWADDR_SIZE) == 0) {
+            _mcast_groups[i].refs++;
+            return;
+        }
+    }
+
+    if (free >= 0) {
+        memcpy(_mcast_groups[free].addr, addr, ENC28J60_HWADDR_SIZE);
+        _mcast_groups[free].refs = 1;
+    }
+    else {
+        // The list is full, receive all multicast packets
+        _mcast_overflow++;
+    }
+
+    update_multicast_filter();
 }
 
 /**
@@ -366,7 +1620,27 @@ void ENC28J60_EMAC::add_multicast_group(const uint8_t* addr)
  */
 void ENC28J60_EMAC::remove_multicast_group(const uint8_t* addr)
 {
-    // No action for now
+    if (!driver_context()) {
+        call(ENC28J60_CMD_REMOVE_MULTICAST, (void*)addr);
+        return;
+    }
+
+    for (uint8_t i = 0; i < ENC28J60_MULTICAST_GROUPS; i++) {
+        if (_mcast_groups[i].refs != 0 && memcmp(_mcast_groups[i].addr, addr, ENC28J60_HWADDR_SIZE) == 0) {
+            _mcast_groups[i].refs--;
+            if (_mcast_groups[i].refs == 0) {
+                update_multicast_filter();
+            }
+
+            return;
+        }
+    }
+
+    // Not in the list, it was added while the list was full
+    if (_mcast_overflow > 0) {
+        _mcast_overflow--;
+        update_multicast_filter();
+    }
 }
 
 /**
@@ -377,7 +1651,140 @@ void ENC28J60_EMAC::remove_multicast_group(const uint8_t* addr)
  */
 void ENC28J60_EMAC::set_all_multicast(bool all)
 {
-    // No action for now
+    if (!driver_context()) {
+        call(ENC28J60_CMD_ALL_MULTICAST, NULL, all);
+        return;
+    }
+
+    _mcast_all = all;
+    update_multicast_filter();
+}
+
+/**
+ * @brief   Sets the broadcast packets to receive.
+ * @note    The rules are merged to the one pattern of the pattern match
+ *          filter and other broadcast packets are rejected by ENC28J60.
+ *          If rules don't have much in common, the merged pattern
+ *          matches more packets than the rules. If it would match all
+ *          broadcast packets, the filter isn't changed.
+ * @param   rules patterns made with the ENC28J60::pattern functions
+ * @param   count number of rules, 0 to receive all broadcast packets
+ * @retval  false if the rules have nothing in common but the broadcast address
+ */
+bool ENC28J60_EMAC::set_broadcast_filter(const enc28j60_pattern_t* rules, uint8_t count)
+{
+    enc28j60_pattern_t  pattern;
+    enc28j60_pattern_t  broadcast;
+
+    if (!driver_context()) {
+        return call(ENC28J60_CMD_BROADCAST_FILTER, (void*)rules, count);
+    }
+
+    if (count == 0) {
+        _enc28j60->enableRxFilter(ERXFCON_BCEN);
+        return true;
+    }
+
+    pattern = rules[0];
+    for (uint8_t i = 1; i < count; i++) {
+        ENC28J60::patternMerge(&pattern, &rules[i]);
+    }
+
+    // The merged pattern must select among the broadcast packets
+    ENC28J60::patternBroadcast(&broadcast);
+    if ((pattern.mask & broadcast.mask) != broadcast.mask || (pattern.mask & ~broadcast.mask) == 0) {
+        return false;
+    }
+
+    _enc28j60->setPatternFilter(&pattern);
+    _enc28j60->enableRxFilter(ERXFCON_PMEN);
+    _enc28j60->disableRxFilter(ERXFCON_BCEN);
+    return true;
+}
+
+/**
+ * @brief   Sets the duplex mode.
+ * @note    A packet in transmission is finished in the old mode.
+ * @param   full true for full duplex, false for half duplex
+ * @retval
+ */
+void ENC28J60_EMAC::set_full_duplex(bool full)
+{
+    Kernel::Clock::time_point   timeout = Kernel::Clock::now() + TRANSMIT_TIME_OUT_MS;
+
+    if (!driver_context()) {
+        call(ENC28J60_CMD_FULL_DUPLEX, NULL, full);
+        return;
+    }
+
+    while ((_enc28j60->transmitPending() || (_enc28j60->readReg<ECON1>() & ECON1_TXRTS) != 0)
+    &&     Kernel::Clock::now() < timeout) {
+        wait_transmit();
+    }
+
+    _enc28j60->setFullDuplex(full);
+    if (_rx_paused) {
+        _enc28j60->setFlowControl(true);    // EFLOCON bits differ in the two modes
+    }
+}
+
+/**
+ * @brief   Sets the size of the receive buffer.
+ * @note    Applied by the service task when both buffers of ENC28J60 are empty.
+ * @param   size_kb receive buffer size in kbytes
+ * @retval  false if the size is out of the range
+ */
+bool ENC28J60_EMAC::set_rx_buffer_size(uint32_t size_kb)
+{
+    if (!driver_context()) {
+        return call(ENC28J60_CMD_RX_BUF_SIZE, NULL, size_kb);
+    }
+
+    if (size_kb < ENC28J60_RX_BUF_MIN_KB || size_kb > ENC28J60_RX_BUF_MAX_KB) {
+        return false;
+    }
+
+    _rx_buf_request = size_kb;
+    return true;
+}
+
+/**
+ * @brief   Programs the multicast filters of ENC28J60.
+ * @note    Groups are received by the hash table filter. MCEN receives all
+ *          multicast packets and is used if requested or the list is full.
+ *          Runs in the driver thread.
+ * @param
+ * @retval
+ */
+void ENC28J60_EMAC::update_multicast_filter()
+{
+    uint8_t table[ENC28J60_HASH_TABLE_SIZE];
+    uint8_t index;
+    bool    groups = false;
+
+    memset(table, 0, sizeof(table));
+    for (uint8_t i = 0; i < ENC28J60_MULTICAST_GROUPS; i++) {
+        if (_mcast_groups[i].refs != 0) {
+            index = ENC28J60::hashTableIndex(_mcast_groups[i].addr);
+            table[index >> 3] |= 1 << (index & 0x07);
+            groups = true;
+        }
+    }
+
+    _enc28j60->writeHashTable(table);
+    if (groups) {
+        _enc28j60->enableRxFilter(ERXFCON_HTEN);
+    }
+    else {
+        _enc28j60->disableRxFilter(ERXFCON_HTEN);
+    }
+
+    if (_mcast_all || _mcast_overflow > 0) {
+        _enc28j60->enableRxFilter(ERXFCON_MCEN);
+    }
+    else {
+        _enc28j60->disableRxFilter(ERXFCON_MCEN);
+    }
 }
 
 /**
@@ -388,19 +1795,40 @@ void ENC28J60_EMAC::set_all_multicast(bool all)
  */
 void ENC28J60_EMAC::power_down()
 {
+    if (!driver_context()) {
+        call(ENC28J60_CMD_POWER_DOWN);
+        return;
+    }
+
     _enc28j60->disableMacRecv();
-    if (_enc28j60->readReg(ESTAT_RXBUSY) != 0) {
+    if ((_enc28j60->readReg<ESTAT>() & ESTAT_RXBUSY) != 0) {
         _enc28j60->enableMacRecv();
         return;
     }
 
-    if (_enc28j60->readReg(ECON1_TXRTS) != 0) {
+    if ((_enc28j60->readReg<ECON1>() & ECON1_TXRTS) != 0) {
         _enc28j60->enableMacRecv();
         return;
     }
 
-    _enc28j60->writeOp(ENC28J60_BIT_FIELD_SET, ECON2, ECON2_VRPS);
-    _enc28j60->writeOp(ENC28J60_BIT_FIELD_SET, ECON2, ECON2_PWRSV);
+    if (_int_in != NULL) {
+        _int_in->disable_irq();
+    }
+
+    // The driver thread only runs commands until the next power_up
+    _powered = false;
+    if (_rx_paused) {
+        _enc28j60->setFlowControl(false);
+        _rx_paused = false;
+    }
+
+    if (_rx_irq_masked) {
+        _enc28j60->enableInterrupts(ENC28J60_INTERRUPT_RX_PENDING_ENABLE);
+        _rx_irq_masked = false;
+    }
+
+    _enc28j60->bitFieldSet<ECON2>(ECON2_VRPS);
+    _enc28j60->bitFieldSet<ECON2>(ECON2_PWRSV);
 }
 
 /**
@@ -416,7 +1844,29 @@ void ENC28J60_EMAC::set_memory_manager(EMACMemoryManager& mem_mngr)
 
 /**
  * @brief
- * @note
+ * @note    The first instance is named ENC28J60_ETH_IF_NAME, the next ones
+ *          get the instance number appended. The name is used for the
+ *          interface and the driver thread.
+ * @param
+ * @retval  Name of the instance
+ */
+const char* ENC28J60_EMAC::instance_name()
+{
+    if (_index == 0) {
+        snprintf(_name, sizeof(_name), "%s", ENC28J60_ETH_IF_NAME);
+    }
+    else {
+        snprintf(_name, sizeof(_name), "%s%u", ENC28J60_ETH_IF_NAME, (unsigned)(_index % 100));
+    }
+
+    return _name;
+}
+
+/**
+ * @brief
+ * @note    The instance on the ENC28J60_MOSI, ENC28J60_MISO, ENC28J60_SCK,
+ *          ENC28J60_CS and ENC28J60_INT pins. Other chips are driven
+ *          by ENC28J60_EMAC objects constructed with their pins.
  * @param
  * @retval
  */
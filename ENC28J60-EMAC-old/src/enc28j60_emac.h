@@ -28,14 +28,111 @@
 #include "rtos.h"
 #include "enc28j60_reg.h"
 #include "enc28j60.h"
+#include "enc28j60_cmd_queue.h"
 #include "enc28j60_emac_config.h"
 
+/**
+ * \brief Receive draining counters, used to tune the receive budget
+ *
+ */
+typedef struct
+{
+    uint32_t    wakeups;            /*!< runs of the receive task */
+    uint32_t    frames;             /*!< packets passed to the stack */
+    uint32_t    max_per_wakeup;     /*!< most packets passed in one run */
+    uint32_t    budget_hits;        /*!< runs which used the whole budget */
+} enc28j60_rx_drain_stats_t;
+
+/**
+ * \brief Receive buffer allocation counters, used to size the memory pools
+ *
+ */
+typedef struct
+{
+    uint32_t    pool_hits;          /*!< buffers allocated from the pool */
+    uint32_t    ring_hits;          /*!< buffers taken from the receive ring */
+    uint32_t    heap_fallbacks;     /*!< buffers allocated from the heap */
+    uint32_t    alloc_failures;     /*!< packets left in ENC28J60 for lack of memory */
+} enc28j60_rx_alloc_stats_t;
+
+/**
+ * \brief Driver statistics
+ *
+ */
+typedef struct
+{
+    uint32_t    rx_frames;              /*!< packets received */
+    uint32_t    rx_bytes;               /*!< their bytes */
+    uint32_t    rx_crc_errors;          /*!< packets dropped for CRC error */
+    uint32_t    rx_symbol_errors;       /*!< packets dropped for other receive errors */
+    uint32_t    rx_overflows;           /*!< receive buffer overflow events */
+    uint32_t    rx_resyncs;             /*!< receive buffer resynchronizations */
+    uint32_t    rx_alloc_failures;      /*!< no memory for a received packet */
+    uint32_t    rx_filtered;            /*!< packets rejected by the early filter */
+    uint32_t    rx_checksum_errors;     /*!< packets dropped for wrong IPv4, TCP or UDP checksum */
+    uint32_t    rx_pauses;              /*!< sender paused by the receive flow control */
+    uint32_t    rx_buf_size;            /*!< receive buffer size in bytes, the transmit buffer has the rest */
+    uint32_t    rx_buf_resizes;         /*!< changes of the receive buffer size */
+    uint32_t    tx_frames;              /*!< packets transmitted */
+    uint32_t    tx_bytes;               /*!< their bytes */
+    uint32_t    tx_aborts;              /*!< transmissions aborted */
+    uint32_t    tx_collisions;          /*!< collisions while transmitting */
+    uint32_t    tx_late_collisions;     /*!< transmissions with late collision */
+    uint32_t    tx_resets;              /*!< stalled transmissions reset by the watchdog */
+    uint32_t    tx_waits;               /*!< packets which waited for room in the transmit buffer */
+    uint32_t    tx_drops;               /*!< packets dropped by link_out: queue full, no room in ENC28J60 */
+    uint32_t    spi_transactions;       /*!< SPI chip select cycles */
+    uint32_t    spi_bytes;              /*!< SPI bytes transferred */
+    uint32_t    spi_errors;             /*!< SPI transfers failed, the data was dropped */
+    uint32_t    spi_frequency;          /*!< SPI clock frequency chosen by the calibration */
+    uint32_t    spi_cal_bytes;          /*!< bytes verified by the calibration */
+    uint32_t    spi_cal_errors;         /*!< of them read back wrong, at the rejected frequencies */
+    uint32_t    spi_cal_error_ppm;      /*!< spi_cal_errors per million spi_cal_bytes */
+    uint32_t    rx_latency_min_us;      /*!< time from the INT pin or the polling */
+    uint32_t    rx_latency_avg_us;      /*!< tick to the stack input callback */
+    uint32_t    rx_latency_max_us;
+} enc28j60_stats_t;
+
+/**
+ * \brief Callback for a batch of received packets
+ *
+ * The packets are in the order of reception. The callback takes ownership of them.
+ */
+typedef mbed::Callback<void(emac_mem_buf_t** bufs, uint32_t count)> emac_link_input_batch_cb_t;
+
+/**
+ * \brief Early filter of received packets
+ *
+ * Gets the first bytes of a packet (up to ENC28J60_RX_HEADER_LEN) and the packet
+ * length. Returns false to drop the packet before the rest is read from ENC28J60.
+ */
+typedef mbed::Callback<bool(const uint8_t* header, uint16_t len, uint16_t packet_len)> emac_rx_filter_cb_t;
+
+/**
+ * \brief ENC28J60 EMAC driver
+ *
+ * ENC28J60 is owned by one driver thread. It services the chip on the INT pin
+ * or by polling, and runs the commands posted by link_out and the control
+ * functions through a lock-free queue. The control functions wait until their
+ * command has run, link_out returns when the packet is queued.
+ */
 class ENC28J60_EMAC :
     public EMAC
 {
 public:
     ENC28J60_EMAC();
 
+    ENC28J60_EMAC(PinName mosi, PinName miso, PinName sclk, PinName cs, PinName int_pin = NC);
+
+    ENC28J60_EMAC(ENC28J60* enc28j60, PinName int_pin = NC);
+
+    /**
+     * \brief Powers down ENC28J60, stops the driver thread and deletes ENC28J60.
+     *
+     * Must not be called from the driver thread, so not from the stack callbacks.
+     */
+    virtual ~ENC28J60_EMAC();
+
     /** Return the ENC28J60 EMAC
      *
      * Returns the default on-board EMAC - this will be target-specific, and
@@ -106,10 +203,12 @@ public:
     /**
      * Sends the packet over the link
      *
-     * That can not be called from an interrupt context.
+     * That can not be called from an interrupt context. The packet is
+     * queued for the driver thread. Packets it can't transmit are counted
+     * in tx_drops.
      *
      * @param buf  Packet to be send
-     * @return     True if the packet was send successfully, False otherwise
+     * @return     True if the packet was queued, False otherwise
      */
     virtual bool            link_out(emac_mem_buf_t* buf);
 
@@ -134,6 +233,28 @@ public:
      */
     virtual void            set_link_input_cb(emac_link_input_cb_t input_cb);
 
+    /**
+     * Sets a callback for batches of received packets, used instead of the
+     * input callback
+     *
+     * A run of the receive task copies up to ENC28J60_RX_BATCH_SIZE packets
+     * out of ENC28J60 and delivers them in one call.
+     *
+     * @param input_cb Function to be register as a callback, NULL to use the input callback
+     */
+    void                    set_link_input_batch_cb(emac_link_input_batch_cb_t input_cb);
+
+    /**
+     * Sets a filter which decides on received packets from their headers
+     *
+     * Only the headers of a rejected packet are read from ENC28J60. The
+     * filter runs in the driver thread. It may be called again for a packet
+     * left in ENC28J60 for lack of memory.
+     *
+     * @param filter_cb Function to be register as a filter, NULL to receive all packets
+     */
+    void                    set_rx_filter_cb(emac_rx_filter_cb_t filter_cb);
+
     /**
      * Sets a callback that needs to be called on link status changes for given
      * interface
@@ -166,21 +287,159 @@ public:
      * @param mem_mngr Pointer to memory manager
      */
     virtual void            set_memory_manager(EMACMemoryManager& mem_mngr);
+
+    /** Sets broadcast packets to receive
+     *
+     * Other broadcast packets are dropped by ENC28J60. By default all
+     * broadcast packets are received.
+     *
+     * @param rules Patterns made with ENC28J60::patternArp, patternDhcpReply,...
+     * @param count Number of rules, 0 to receive all broadcast packets
+     * @return     False if the rules can't be merged to a pattern narrower than
+     *             all broadcast packets. The filter isn't changed then.
+     */
+    bool                    set_broadcast_filter(const enc28j60_pattern_t* rules, uint8_t count);
+
+    /** Sets the duplex mode, ENC28J60_FULL_DUPLEX by default
+     *
+     * The PHY of ENC28J60 doesn't auto-negotiate, so the switch port must be
+     * set to the same mode. Half duplex works with hubs.
+     *
+     * @param full True for full duplex, false for half duplex
+     */
+    void                    set_full_duplex(bool full);
+
+    /** Sets the size of the receive buffer of ENC28J60, the transmit buffer gets the rest
+     *
+     * The driver thread changes the size when both buffers are empty.
+     * With ENC28J60_RX_BUF_AUTO_TUNE the size is adjusted to the traffic.
+     *
+     * @param size_kb Size in kbytes, ENC28J60_RX_BUF_MIN_KB to ENC28J60_RX_BUF_MAX_KB
+     * @return False if the size is out of the range
+     */
+    bool                    set_rx_buffer_size(uint32_t size_kb);
+
+    /** Sets maximum number of packets received in one run of the receive task
+     *
+     * @param frames Receive budget, at least 1
+     */
+    void                    set_rx_budget(uint32_t frames);
+
+    /** Gets the receive draining counters
+     *
+     * @param stats Where the counters should be copied
+     */
+    void                    get_rx_drain_stats(enc28j60_rx_drain_stats_t* stats);
+
+    /** Clears the receive draining counters
+     */
+    void                    reset_rx_drain_stats(void);
+
+    /** Gets the receive buffer allocation counters
+     *
+     * @param stats Where the counters should be copied
+     */
+    void                    get_rx_alloc_stats(enc28j60_rx_alloc_stats_t* stats);
+
+    /** Clears the receive buffer allocation counters
+     */
+    void                    reset_rx_alloc_stats(void);
+
+    /** Gets the driver statistics
+     *
+     * @param stats Where the statistics should be copied
+     */
+    void                    get_stats(enc28j60_stats_t* stats);
+
+    /** Clears the driver statistics
+     */
+    void                    reset_stats(void);
 private:
+    bool                        driver_context() const;
+    bool                        call(uint8_t type, void* arg = NULL, uint32_t value = 0);
+    void                        wait_cmd_space();
+    void                        run_command(const enc28j60_cmd_t* cmd);
+    void                        run_commands();
+    void                        driver_thread();
+    bool                        service_task();
     void                        link_status_task();
-    void                        receive_task();
+    bool                        receive_task();
+    void                        rx_flow_control();
+    void                        rx_buf_tune();
+    void                        apply_rx_buf_size();
+    void                        deliver_rx_batch(emac_mem_buf_t** batch, uint32_t count);
+    void                        add_rx_latency(uint32_t latency, uint32_t count);
+    void                        interrupt_handler();
+    bool                        transmit(emac_mem_buf_t* buf);
+    void                        wait_transmit();
+    void                        tx_checksum_offload(const uint8_t* frame, uint16_t len);
+    bool                        rx_checksum_valid(const packet_t* packet, const uint8_t* frame, uint16_t len);
+    bool                        rx_accept(const packet_t* packet, uint8_t* header, uint16_t* header_len);
     bool                        low_level_init_successful();
     emac_mem_buf_t*             low_level_input();
+    emac_mem_buf_t*             alloc_rx_buffer(uint16_t len);
+    void                        refill_rx_ring();
+    void                        update_multicast_filter();
+    const char*                 instance_name();
 
+    static volatile uint32_t    _instances;
+    uint32_t                    _index;
+    char                        _name[sizeof(ENC28J60_ETH_IF_NAME) + 3];
     ENC28J60*                   _enc28j60;
+    mbed::InterruptIn*          _int_in;
+    ENC28J60CommandQueue        _cmd_queue;
+    volatile uint32_t           _cmd_waiters;
+    rtos::Semaphore             _cmd_space;
+    rtos::Thread                _driver_thread;
+    bool                        _driver_thread_started;
+    bool                        _driver_thread_stop;
+    bool                        _powered;
+    bool                        _irq_pending;
+    bool                        _link_check_pending;
     bool                        _prev_link_status_up;
-    int                         _link_status_task_handle;
-    int                         _receive_task_handle;
+    volatile uint32_t           _tx_drops;
+    uint32_t                    _tx_waits;
+    uint32_t                    _rx_budget;
+    bool                        _rx_alloc_failed;
+    bool                        _rx_paused;
+    bool                        _rx_irq_masked;
+    uint32_t                    _rx_pauses;
+    uint32_t                    _rx_filtered;
+    uint32_t                    _rx_checksum_errors;
+    uint32_t                    _rx_buf_request;        // kbytes, 0 if none
+    uint32_t                    _rx_buf_resizes;
+    rtos::Kernel::Clock::time_point _rx_tune_time;
+    rtos::Kernel::Clock::time_point _rx_buf_retry_time;     // of a resize found busy
+    uint32_t                    _rx_tune_overflows;     // counters at the last tuning
+    uint32_t                    _rx_tune_tx_waits;
+    uint32_t                    _rx_tune_quiet;         // periods without overflow
+    enc28j60_rx_drain_stats_t   _rx_drain_stats;
+    enc28j60_rx_alloc_stats_t   _rx_alloc_stats;
+    volatile uint32_t           _rx_irq_time;
+    uint32_t                    _rx_event_time;
+    uint32_t                    _rx_frames;
+    uint32_t                    _rx_bytes;
+    uint32_t                    _rx_latency_min;
+    uint32_t                    _rx_latency_max;
+    uint64_t                    _rx_latency_sum;
+    uint32_t                    _rx_latency_count;
+#if ENC28J60_RX_RING_SIZE > 0
+    emac_mem_buf_t*             _rx_ring[ENC28J60_RX_RING_SIZE];
+    uint32_t                    _rx_ring_count;
+#endif
     EMACMemoryManager*          _memory_manager;
-    rtos::Mutex                 _ethLockMutex;
     uint8_t                     _hwaddr[ENC28J60_HWADDR_SIZE];
 
+    struct {
+        uint8_t                 addr[ENC28J60_HWADDR_SIZE];
+        uint16_t                refs;
+    }                           _mcast_groups[ENC28J60_MULTICAST_GROUPS];
+    uint16_t                    _mcast_overflow;
+    bool                        _mcast_all;
+
     emac_link_input_cb_t        _emac_link_input_cb;
+    emac_link_input_batch_cb_t  _emac_link_input_batch_cb;
+    emac_rx_filter_cb_t         _rx_filter_cb;
     emac_link_state_change_cb_t _emac_link_state_cb;
 };
 #endif /* ENC28J60_EMAC_H_ */
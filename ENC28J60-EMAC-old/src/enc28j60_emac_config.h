@@ -12,12 +12,28 @@
 #define ENC28J60_EMAC_CONFIG_H_
 
 /*
- *  ENC28J60 receive buffer size in kylobytes
+ *  ENC28J60 receive buffer size in kylobytes at init. The rest of the 8 KB
+ *  buffer memory is the transmit buffer. It can be changed at runtime
+ *  within ENC28J60_RX_BUF_MIN_KB and ENC28J60_RX_BUF_MAX_KB.
  */
+#ifndef ENC28J60_ETH_RXBUF_SIZE_KB
 #define ENC28J60_ETH_RXBUF_SIZE_KB           6U
+#endif
+#define ENC28J60_RX_BUF_MIN_KB               2U
+#define ENC28J60_RX_BUF_MAX_KB               6U
 #define ENC28J60_HWADDR_SIZE                 6U
 #define ENC28J60_BUFF_ALIGNMENT              4U
 
+/*
+ * Number of maximum size receive buffers kept allocated by the driver
+ * for the case the memory pool is exhausted. 0 disables the ring.
+ * The stack frees the buffers taken from it to the heap, the driver
+ * allocates new ones when the receive buffer is drained.
+ */
+#ifndef ENC28J60_RX_RING_SIZE
+#define ENC28J60_RX_RING_SIZE                0U
+#endif
+
 /*
  * Maximum Transfer Unit
  * The IEEE 802.3 specification limits the data portion of the 802.3 frame
@@ -26,11 +42,177 @@
 #define ENC28J60_ETH_MTU_SIZE                1500U
 #define ENC28J60_ETH_IF_NAME                 "enc28j60"
 
-/** \brief Defines for receiver thread */
-#define LINK_STATUS_TASK_PERIOD_MS           200ms
+/*
+ * Duplex mode. The PHY of ENC28J60 doesn't auto-negotiate, full duplex needs
+ * a switch port set to full duplex. Half duplex works with hubs.
+ */
+#ifndef ENC28J60_FULL_DUPLEX
+#define ENC28J60_FULL_DUPLEX                 0
+#endif
+
+/*
+ * Pause time of the transmitted pause frames in units of 512 bit times
+ */
+#ifndef ENC28J60_PAUSE_TIME
+#define ENC28J60_PAUSE_TIME                  0x1000U
+#endif
+
+/*
+ * Multicast groups received by the hash table filter.
+ * All multicast packets are received if more groups are added.
+ */
+#define ENC28J60_MULTICAST_GROUPS            16U
+
+/*
+ * Checksums computed by the DMA controller of ENC28J60.
+ * TX: IPv4, TCP and UDP checksums are filled in. Enable it only with the
+ *     checksum generation of the stack off (lwIP CHECKSUM_GEN_IP,
+ *     CHECKSUM_GEN_TCP and CHECKSUM_GEN_UDP 0). The DMA runs in the driver
+ *     thread, up to two per packet.
+ * RX: packets with wrong IPv4, TCP or UDP checksum are dropped and counted
+ *     in rx_checksum_errors.
+ */
+#ifndef ENC28J60_TX_CHECKSUM_OFFLOAD
+#define ENC28J60_TX_CHECKSUM_OFFLOAD         0
+#endif
+#ifndef ENC28J60_RX_CHECKSUM_CHECK
+#define ENC28J60_RX_CHECKSUM_CHECK           0
+#endif
+
+/*
+ * SPI transfers of buffer memory at least ENC28J60_SPI_ASYNC_MIN_LEN long
+ * use the asynchronous SPI API, if the target supports it. A transfer not
+ * done in ENC28J60_SPI_ASYNC_TIME_OUT_MS is aborted, its packet is dropped
+ * and counted in spi_errors.
+ */
+#ifndef ENC28J60_SPI_ASYNC
+#if DEVICE_SPI_ASYNCH
+#define ENC28J60_SPI_ASYNC                   1
+#else
+#define ENC28J60_SPI_ASYNC                   0
+#endif
+#endif
+#define ENC28J60_SPI_ASYNC_MIN_LEN           64U
+#define ENC28J60_SPI_ASYNC_TIME_OUT_MS       10ms
+
+/*
+ * SPI clock calibration at init. The frequencies from ENC28J60_SPI_FREQ_MIN to
+ * ENC28J60_SPI_FREQ_MAX are verified by writing and reading back the buffer memory,
+ * and one step below the highest reliable one is used (ENC28J60_SPI_FREQ_MAX if all
+ * are reliable). MAC and MII registers need at least 8 MHz (see errata).
+ * Without the calibration ENC28J60_SPI_FREQ_MAX is used.
+ */
+#ifndef ENC28J60_SPI_CALIBRATION
+#define ENC28J60_SPI_CALIBRATION             1
+#endif
+#ifndef ENC28J60_SPI_FREQ_MIN
+#define ENC28J60_SPI_FREQ_MIN                8000000U
+#endif
+#ifndef ENC28J60_SPI_FREQ_MAX
+#define ENC28J60_SPI_FREQ_MAX                20000000U
+#endif
+#ifndef ENC28J60_SPI_FREQ_STEP
+#define ENC28J60_SPI_FREQ_STEP               2000000U
+#endif
+#define ENC28J60_SPI_CAL_LEN                 64U
+#define ENC28J60_SPI_CAL_ROUNDS              8U
+
+/*
+ * Register writes queued in a batch (see ENC28J60::beginBatch).
+ * A full queue is sent and the batch continues.
+ */
+#ifndef ENC28J60_WRITE_BATCH_SIZE
+#define ENC28J60_WRITE_BATCH_SIZE            16U
+#endif
+
+/** \brief Defines for driver thread */
+#define DRIVER_THREAD_STACK_SIZE             2048U
+#define DRIVER_THREAD_PRIORITY               osPriorityHigh
+#define DRIVER_IRQ_FLAG                      0x01U
+#define DRIVER_CMD_FLAG                      0x02U
+/* Commands waiting for the driver thread, a power of 2 */
+#ifndef ENC28J60_CMD_QUEUE_SIZE
+#define ENC28J60_CMD_QUEUE_SIZE              16U
+#endif
+#define CMD_QUEUE_RETRY_MS                   1ms
+
+/** \brief Defines for receive */
 #define RECEIVE_TASK_PERIOD_MS               20ms
+#define RECEIVE_TASK_BUDGET                  8U
+/* Packets copied out of ENC28J60 before they are passed to the stack */
+#ifndef ENC28J60_RX_BATCH_SIZE
+#define ENC28J60_RX_BATCH_SIZE               4U
+#endif
+/*
+ * Receive flow control. ENC28J60 pauses the sender with pause frames (full duplex)
+ * or backpressure (half duplex) when less than ENC28J60_RX_PAUSE_WATERMARK bytes
+ * of its receive buffer are free or the stack has no memory for a packet,
+ * and resumes it when ENC28J60_RX_RESUME_WATERMARK bytes are free again.
+ */
+#ifndef ENC28J60_RX_FLOW_CONTROL
+#define ENC28J60_RX_FLOW_CONTROL             1
+#endif
+#ifndef ENC28J60_RX_PAUSE_WATERMARK
+#define ENC28J60_RX_PAUSE_WATERMARK          (2U * MAX_FRAMELEN)
+#endif
+#ifndef ENC28J60_RX_RESUME_WATERMARK
+#define ENC28J60_RX_RESUME_WATERMARK         (3U * MAX_FRAMELEN)
+#endif
+/*
+ * Bytes of a received packet read first for the early filter and the checksum
+ * check: Ethernet, IPv4 and TCP headers without options
+ */
+#ifndef ENC28J60_RX_HEADER_LEN
+#define ENC28J60_RX_HEADER_LEN               54U
+#endif
+/*
+ * Receive buffer auto-sizing. Every ENC28J60_RX_BUF_TUNE_PERIOD_MS the receive
+ * buffer grows by 1 KB if it overflowed, or shrinks by 1 KB if it didn't overflow
+ * for ENC28J60_RX_BUF_TUNE_HOLD periods and at least ENC28J60_RX_BUF_TUNE_TX_WAITS
+ * packets waited for room in the transmit buffer in the period.
+ */
+#ifndef ENC28J60_RX_BUF_AUTO_TUNE
+#define ENC28J60_RX_BUF_AUTO_TUNE            0
+#endif
+#ifndef ENC28J60_RX_BUF_TUNE_PERIOD_MS
+#define ENC28J60_RX_BUF_TUNE_PERIOD_MS       1000ms
+#endif
+#ifndef ENC28J60_RX_BUF_TUNE_HOLD
+#define ENC28J60_RX_BUF_TUNE_HOLD            10U
+#endif
+#ifndef ENC28J60_RX_BUF_TUNE_TX_WAITS
+#define ENC28J60_RX_BUF_TUNE_TX_WAITS        32U
+#endif
+/* A resize which found a buffer in use is retried after this time */
+#define ENC28J60_RX_BUF_RETRY_MS             20ms
+/* The INT pin is handled on the falling edge. A missed edge is recovered by this timeout. */
+#define RECEIVE_IRQ_FALLBACK_MS              200ms
 #define PHY_STATE_LINK_DOWN                  false
 #define PHY_STATE_LINK_UP                    true
 #define CRC_LENGTH_BYTES                     4U
 
+/** \brief Defines for transmit */
+#define TRANSMIT_TIME_OUT_MS                 100ms
+#define TRANSMIT_POLL_PERIOD_MS              1ms
+/* Buffers of a packet chain written to ENC28J60 in one SPI transaction */
+#ifndef ENC28J60_TX_SEGMENTS
+#define ENC28J60_TX_SEGMENTS                 8U
+#endif
+/*
+ * A transmission not done in ENC28J60_TX_WATCHDOG_US is considered stalled
+ * (see errata). The transmit logic is reset and the packet is transmitted
+ * again, up to ENC28J60_TX_RETRIES times. A legitimate transmission can take
+ * long: a received pause frame holds it for up to 65535 x 512 bit times
+ * (3.36 s at 10 Mb/s) in full duplex, and 16 attempts with the maximum
+ * collision backoff take about 0.45 s in half duplex. The bound is above both.
+ * The stall is detected when the driver thread wakes up, with the INT pin
+ * that is on the RECEIVE_IRQ_FALLBACK_MS timeout if no other event comes.
+ */
+#ifndef ENC28J60_TX_WATCHDOG_US
+#define ENC28J60_TX_WATCHDOG_US              4000000U
+#endif
+#ifndef ENC28J60_TX_RETRIES
+#define ENC28J60_TX_RETRIES                  2U
+#endif
+
 #endif /* ENC28J60_EMAC_CONFIG_H_ */
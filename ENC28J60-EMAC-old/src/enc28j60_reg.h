@@ -217,6 +217,12 @@
 #define ECON2_PKTDEC    0x40
 #define ECON2_PWRSV     0x20
 #define ECON2_VRPS      0x08
+/*
+ * ENC28J60 EFLOCON Register Bit Definitions
+ */
+#define EFLOCON_FULDPXS 0x04
+#define EFLOCON_FCEN1   0x02
+#define EFLOCON_FCEN0   0x01
 /*
  * ENC28J60 ECON1 Register Bit Definitions
  */
@@ -345,7 +351,22 @@
 #define ETXND_INI   0x1FFF
 
 // max frame length which the conroller will accept:
-#define MAX_FRAMELEN    ENC28J60_ETH_MTU_SIZE   // (note: maximum ethernet frame length would be 1518)
+// MTU plus 14 bytes ethernet header and 4 bytes CRC, 1518 for the 1500 MTU
+#define MAX_FRAMELEN    (ENC28J60_ETH_MTU_SIZE + 18)
+
+#define ENC28J60_HASH_TABLE_SIZE    8U  // EHT0 to EHT7
+#define ENC28J60_PATTERN_SIZE       64U // pattern match window, EPMM0 to EPMM7 bits
+
+// positions in the packet used by the pattern match filter patterns
+#define PATTERN_DST_POS             0U
+#define PATTERN_TYPE_POS            12U
+#define PATTERN_IP_PROTO_POS        23U
+#define PATTERN_UDP_DST_POS         36U
+#define PATTERN_ARP_TPA_POS         38U
+#define PATTERN_ETHERTYPE_IPV4      0x0800U
+#define PATTERN_ETHERTYPE_ARP       0x0806U
+#define PATTERN_IP_PROTO_UDP        17U
+#define PATTERN_DHCP_CLIENT_PORT    68U
 
 #define RX_NEXT_LEN 2U  // next packet pointer bytes
 #define RX_STAT_LEN 4U  // receive status vector bytes
@@ -353,4 +374,13 @@
 #define TX_CTRL_LEN 1U  // control byte
 #define TX_STAT_LEN 7U  // transmit status vector bytes
 
+// receive status vector byte 2 bits (see datasheet page 44, table 7-3)
+#define RSV2_CRCERROR           0x10
+#define RSV2_RXOK               0x80
+
+// transmit status vector byte 2 and 3 bits (see datasheet page 42, table 7-1)
+#define TSV_COLLISION_POS       2U
+#define TSV2_COLLISION_COUNT    0x0F
+#define TSV3_LATE_COLLISION     0x20
+
 #endif //ENC28J60_REG_H
@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2019 Tobias Jaster
+ *
+ * Modified by Zoltan Hudak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "enc28j60_transport.h"
+
+using namespace mbed;
+using namespace rtos;
+using namespace std::chrono_literals;
+
+/**
+ * @brief   Sends two byte commands back to back.
+ * @note    Every command is terminated by the chip select (see datasheet page 28).
+ * @param   cmds opcode and argument of every command
+ * @param   count number of commands
+ * @retval
+ */
+void ENC28J60Transport::transferCommands(const uint8_t* cmds, uint16_t count)
+{
+    for (uint16_t i = 0; i < count; i++) {
+        select();
+        transfer(&cmds[i * 2], NULL, 2, true);
+        deselect();
+    }
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+ENC28J60SpiTransport::ENC28J60SpiTransport(PinName mosi, PinName miso, PinName sclk, PinName cs) :
+    _spi(new SPI(mosi, miso, sclk)),
+    _spiOwned(true),
+    _cs(cs, 1)
+{ }
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+ENC28J60SpiTransport::ENC28J60SpiTransport(mbed::SPI* spi, PinName cs) :
+    _spi(spi),
+    _spiOwned(false),
+    _cs(cs, 1)
+{ }
+
+/**
+ * @brief
+ * @note    An SPI passed to the constructor belongs to the caller.
+ * @param
+ * @retval
+ */
+ENC28J60SpiTransport::~ENC28J60SpiTransport()
+{
+    if (_spiOwned)
+        delete _spi;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60SpiTransport::setFrequency(int hz)
+{
+    _spi->format(8, 0);         // 8bit, mode 0
+    _spi->frequency(hz);
+    _spi->set_default_write_value(0x00);
+}
+
+/**
+ * @brief
+ * @note    The SPI bus is locked while the chip is selected, so the transfers
+ *          of other devices on a shared bus don't interleave with its instruction.
+ * @param
+ * @retval
+ */
+void ENC28J60SpiTransport::select(void)
+{
+    _spi->lock();
+    _cs = 0;
+}
+
+/**
+ * @brief
+ * @note
+ * @param
+ * @retval
+ */
+void ENC28J60SpiTransport::deselect(void)
+{
+    _cs = 1;
+    _spi->unlock();
+}
+
+/**
+ * @brief   Transfers data in one burst.
+ * @note    Transfers at least ENC28J60_SPI_ASYNC_MIN_LEN long and not blocking
+ *          use the asynchronous SPI API, if the target supports it.
+ * @param
+ * @retval  false if the asynchronous transfer timed out and was aborted
+ */
+bool ENC28J60SpiTransport::transfer(const uint8_t* tx, uint8_t* rx, uint16_t len, bool blocking)
+{
+#if ENC28J60_SPI_ASYNC
+    if (!blocking && len >= ENC28J60_SPI_ASYNC_MIN_LEN && _transferAsync(tx, rx, len))
+        return _waitAsync();
+#else
+    (void) blocking;
+#endif
+
+    _spi->write((const char*)tx, tx ? len : 0, (char*)rx, rx ? len : 0);
+    return true;
+}
+
+/**
+ * @brief   Sends two byte commands back to back.
+ * @note    The SPI bus is locked once for all commands, so a bus shared
+ *          with other devices isn't arbitrated and reconfigured for each.
+ * @param   cmds opcode and argument of every command
+ * @param   count number of commands
+ * @retval
+ */
+void ENC28J60SpiTransport::transferCommands(const uint8_t* cmds, uint16_t count)
+{
+    _spi->lock();
+    for (uint16_t i = 0; i < count; i++) {
+        _cs = 0;
+        _spi->write((const char*) &cmds[i * 2], 2, NULL, 0);
+        _cs = 1;
+    }
+
+    _spi->unlock();
+}
+
+#if ENC28J60_SPI_ASYNC
+
+/**
+ * @brief   Starts a transfer with the asynchronous SPI API.
+ * @note
+ * @param
+ * @retval  false if the transfer could not be started
+ */
+bool ENC28J60SpiTransport::_transferAsync(const uint8_t* tx, uint8_t* rx, uint16_t len)
+{
+    int result = _spi->transfer<uint8_t>
+        (
+            tx,
+            tx ? len : 0,
+            rx,
+            rx ? len : 0,
+            mbed::callback(this, &ENC28J60SpiTransport::_transferDone),
+            SPI_EVENT_COMPLETE
+        );
+    return result == 0;
+}
+
+/**
+ * @brief   Waits for the asynchronous transfer.
+ * @note    The calling thread sleeps until the transfer completes.
+ *          A transfer not done in ENC28J60_SPI_ASYNC_TIME_OUT_MS is aborted.
+ *          It can complete between the time out and the abort, so the
+ *          semaphore is emptied after the abort. A left over count would
+ *          end the wait for the next transfer before it is done.
+ * @param
+ * @retval  false if the transfer was aborted
+ */
+bool ENC28J60SpiTransport::_waitAsync(void)
+{
+    if (_transferDoneSem.try_acquire_for(ENC28J60_SPI_ASYNC_TIME_OUT_MS))
+        return true;
+
+    _spi->abort_transfer();
+    while (_transferDoneSem.try_acquire()) { }
+
+    return false;
+}
+
+/**
+ * @brief   Asynchronous SPI transfer event handler.
+ * @note    Runs in interrupt context.
+ * @param
+ * @retval
+ */
+void ENC28J60SpiTransport::_transferDone(int events)
+{
+    (void) events;
+    _transferDoneSem.release();
+}
+#endif
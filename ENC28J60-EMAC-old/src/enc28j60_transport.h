@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2019 Tobias Jaster
+ *
+ * Modified by Zoltan Hudak
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ENC28J60_TRANSPORT_H_
+#define ENC28J60_TRANSPORT_H_
+
+#include "mbed.h"
+
+#include "enc28j60_emac_config.h"
+
+/**
+ * \brief SPI connection to ENC28J60
+ *
+ * ENC28J60 uses it for all access to the chip. A behavioural model
+ * of the chip can implement it to run the driver without hardware.
+ */
+class   ENC28J60Transport
+{
+public:
+    virtual ~ENC28J60Transport() { }
+
+    /**
+     * \brief Set SPI mode 0, 8 bit words and the clock frequency.
+     *
+     * \param[in] hz Clock frequency
+     */
+    virtual void        setFrequency(int hz) = 0;
+
+    /**
+     * \brief Drive the chip select low.
+     */
+    virtual void        select(void) = 0;
+
+    /**
+     * \brief Drive the chip select high.
+     */
+    virtual void        deselect(void) = 0;
+
+    /**
+     * \brief Transfer bytes in both directions.
+     *
+     * \param[in] tx Bytes to send or NULL to send zeros
+     * \param[out] rx Received bytes or NULL to discard them
+     * \param[in] len Number of bytes
+     * \param[in] blocking False allows a transfer by interrupt or DMA
+     *
+     * \return False if the transfer failed, the received bytes are not valid then
+     */
+    virtual bool        transfer(const uint8_t* tx, uint8_t* rx, uint16_t len, bool blocking) = 0;
+
+    /**
+     * \brief Send two byte commands back to back, each in its own chip select cycle.
+     *
+     * The default implementation uses select, transfer and deselect.
+     *
+     * \param[in] cmds Opcode and argument of every command
+     * \param[in] count Number of commands
+     */
+    virtual void        transferCommands(const uint8_t* cmds, uint16_t count);
+};
+
+/**
+ * \brief ENC28J60Transport over Mbed SPI and a DigitalOut chip select
+ *
+ */
+class   ENC28J60SpiTransport :
+    public ENC28J60Transport
+{
+public:
+    ENC28J60SpiTransport(PinName mosi, PinName miso, PinName sclk, PinName cs);
+
+    ENC28J60SpiTransport(mbed::SPI* spi, PinName cs);
+
+    virtual ~ENC28J60SpiTransport();
+
+    virtual void        setFrequency(int hz);
+    virtual void        select(void);
+    virtual void        deselect(void);
+    virtual bool        transfer(const uint8_t* tx, uint8_t* rx, uint16_t len, bool blocking);
+    virtual void        transferCommands(const uint8_t* cmds, uint16_t count);
+private:
+#if ENC28J60_SPI_ASYNC
+    bool        _transferAsync(const uint8_t* tx, uint8_t* rx, uint16_t len);
+    bool        _waitAsync(void);
+    void        _transferDone(int events);
+    rtos::Semaphore   _transferDoneSem;
+#endif
+    mbed::SPI*        _spi;
+    bool              _spiOwned;  // created by the constructor
+    mbed::DigitalOut  _cs;
+};
+#endif /* ENC28J60_TRANSPORT_H_ */